@@ -3,6 +3,7 @@ import numpy as np
 import glob
 import os
 import torch
+import trilinear
 
 class TrainDataset(Dataset):
     def __init__(self, path="train_img_np", transform=None):
@@ -19,4 +20,35 @@ class TrainDataset(Dataset):
         return torch.tensor(image), torch.tensor(target)
 
     def __len__(self):
-        return len(self.train_files)
\ No newline at end of file
+        return len(self.train_files)
+
+
+class ShardLoader(object):
+    """Shuffled (input, target) batches from the .lutshard files written by
+    buildTrainingDataset.py.
+
+    The shards are memory-mapped and worker threads convert pairs straight
+    into a ring of batch tensors allocated once, prefetching while the
+    previous batches train. layout is 'NHWC' or 'NCHW'; with normalize the
+    batches are float in [0, 1], otherwise the stored uint8 / uint16 (as
+    int16) samples. A batch is only valid until the next one is taken, so
+    clone it to keep it.
+    """
+    def __init__(self, path="train_shards", batch_size=8, shuffle=True, layout='NHWC', normalize=True,
+                 workers=2, prefetch=0, pin_memory=None, seed=0):
+        files = sorted(glob.glob(os.path.join(path, "*.lutshard")))
+        if pin_memory is None:
+            pin_memory = torch.cuda.is_available()
+        self.loader = trilinear.ShardLoader(files, batch_size, layout == 'NCHW', normalize, shuffle,
+                                            workers, prefetch, pin_memory, seed)
+        self.epoch = 0
+
+    def __iter__(self):
+        self.loader.start_epoch(self.epoch)
+        self.epoch += 1
+        for _ in range(len(self)):
+            yield self.loader.next()
+
+    def __len__(self):
+        return self.loader.batches()
+
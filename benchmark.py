@@ -0,0 +1,396 @@
+from lut3d import *
+import numpy as np
+import torch
+import cv2
+import time
+import glob
+import os
+import subprocess
+import sys
+import tempfile
+
+def timeit(fn, repeat=5):
+    fn()
+    start = time.perf_counter()
+    for _ in range(repeat):
+        fn()
+    return (time.perf_counter() - start) / repeat
+
+def bench_threads(fn, threads=(1, 2, 4, 8, 16)):
+    print("{:>8} {:>10} {:>8}".format("threads", "ms/call", "speedup"))
+    base = None
+    for n in threads:
+        torch.set_num_threads(n)
+        t = timeit(fn)
+        base = base or t
+        print("{:>8d} {:>10.1f} {:>7.2f}x".format(n, t * 1000, base / t))
+
+def forward_fn(interp, lut, img):
+    def fn():
+        with torch.no_grad():
+            interp(lut, img)
+    return fn
+
+def train_step_fn(interp, lut, img):
+    lut = lut.clone().requires_grad_(True)
+    def fn():
+        _, out = interp(lut, img)
+        out.sum().backward()
+    return fn
+
+def shaper_step_fn(shaper, lut, img, fused):
+    shaper = shaper.detach().requires_grad_()
+    lut = lut.detach().requires_grad_()
+    interp = TrilinearInterpolation()
+    def fn():
+        if fused:
+            out = ShaperLut3DFunction.apply(shaper, lut, img)
+        else:
+            x = torch.clamp(img, 0, 1)
+            loc = x * (shaper.size(0) - 1)
+            lo = torch.floor(loc).long()
+            hi = torch.clamp(lo + 1, 0, shaper.size(0) - 1)
+            d = loc - lo
+            x = torch.clamp((1 - d) * shaper[lo] + d * shaper[hi], 0, 1)
+            _, out = interp(lut, x)
+        out.sum().backward()
+    return fn
+
+def blend_step_fn(basis, weights, img, fused):
+    basis = basis.detach().requires_grad_()
+    weights = weights.detach().requires_grad_()
+    interp = TrilinearInterpolation()
+    def fn():
+        if fused:
+            out = BlendLut3DFunction.apply(basis, weights, img)
+        else:
+            luts = torch.einsum('bn,ncijk->bcijk', weights, basis)
+            out = torch.cat([interp(luts[b], img[b:b + 1])[1] for b in range(img.size(0))])
+        out.sum().backward()
+    return fn
+
+def bench_bank(batch=16, size=512):
+    # Mixed-filter batch: one call per image against one call for the batch.
+    luts = [torch.rand((3, dim, dim, dim), dtype=torch.float) for dim in (32, 33, 64)]
+    bank = LutBank(luts)
+    ids = torch.randint(0, len(luts), (batch,))
+    img = torch.rand((batch, 3, size, size), dtype=torch.float)
+    interp = TrilinearInterpolation()
+    with torch.no_grad():
+        t_loop = timeit(lambda: [interp(luts[i], img[b:b + 1]) for b, i in enumerate(ids.tolist())])
+        t_bank = timeit(lambda: bank(img, ids))
+    print("{:>12} {:>12}".format("per-image ms", "bank ms"))
+    print("{:>12.1f} {:>12.1f}".format(t_loop * 1000, t_bank * 1000))
+
+def bench_fanout(img, count=35, dim=32):
+    luts = torch.rand((count, 3, dim, dim, dim), dtype=torch.float)
+    interp = TrilinearInterpolation()
+    with torch.no_grad():
+        t_loop = timeit(lambda: [interp(lut, img) for lut in luts])
+        t_fanout = timeit(lambda: fanout_lut3d(luts, img))
+    print("{:>12} {:>12}".format("per-LUT ms", "fan-out ms"))
+    print("{:>12.1f} {:>12.1f}".format(t_loop * 1000, t_fanout * 1000))
+
+def bench_cube_load(paths):
+    import colour
+    for path in paths:
+        load_cube(path)  # writes the .lutbin caches
+    t_colour = timeit(lambda: [torch.tensor(colour.read_LUT(path).table.astype(np.float32)).permute(3, 0, 1, 2).contiguous() for path in paths])
+    t_parse = timeit(lambda: [load_cube(path, cache=False) for path in paths])
+    t_mapped = timeit(lambda: [load_cube(path) for path in paths])
+    print("{:>10} {:>12} {:>12}".format("colour ms", "parse ms", "mapped ms"))
+    print("{:>10.1f} {:>12.1f} {:>12.2f}".format(t_colour * 1000, t_parse * 1000, t_mapped * 1000))
+
+def bench_layouts(img, dims=(17, 33, 64)):
+    print("{:>5} {:>12} {:>12}".format("dim", "planar ms", "packed ms"))
+    interp = TrilinearInterpolation()
+    with torch.no_grad():
+        for dim in dims:
+            lut = torch.rand((3, dim, dim, dim), dtype=torch.float)
+            packed = PackedLut3D(lut)
+            t_planar = timeit(lambda: interp(lut, img))
+            t_packed = timeit(lambda: packed(img))
+            print("{:>5d} {:>12.1f} {:>12.1f}".format(dim, t_planar * 1000, t_packed * 1000))
+
+def bench_table(img, dims=(17, 33, 64)):
+    print("{:>5} {:>10} {:>12} {:>12} {:>10}".format("dim", "bake ms", "interp ms", "table ms", "break-even"))
+    interp = TrilinearInterpolation()
+    with torch.no_grad():
+        for dim in dims:
+            lut = torch.rand((3, dim, dim, dim), dtype=torch.float)
+            table = TableLut3D(lut)
+            entries = table.bake()
+            t_bake = timeit(lambda: table.backend.bake_table(lut, entries, dim, dim ** 3))
+            t_interp = timeit(lambda: interp(lut, img))
+            t_table = timeit(lambda: table(img))
+            frames = t_bake / (t_interp - t_table) if t_interp > t_table else float('inf')
+            print("{:>5d} {:>10.1f} {:>12.1f} {:>12.1f} {:>10.1f}".format(dim, t_bake * 1000, t_interp * 1000, t_table * 1000, frames))
+
+def bench_separable(img, paths, dims=(17, 33, 64)):
+    # Per-channel curve LUTs (a gamma per channel) against a 3D forward, then
+    # how the 35_Free_LUTs collection classifies.
+    print("{:>5} {:>12} {:>10} {:>12} {:>12}".format("dim", "classify ms", "kind", "interp ms", "curves ms"))
+    interp = TrilinearInterpolation()
+    with torch.no_grad():
+        for dim in dims:
+            grid = torch.linspace(0, 1, dim)
+            lut = torch.stack([grid.view(dim, 1, 1).expand(dim, dim, dim) ** 0.8,
+                               grid.view(1, dim, 1).expand(dim, dim, dim) ** 1.0,
+                               grid.view(1, 1, dim).expand(dim, dim, dim) ** 1.2]).contiguous()
+            separable = SeparableLut3D(lut)
+            separable.classify()
+            t_classify = timeit(lambda: separable.backend.classify(lut, separable.curves, dim, separable.tol))
+            t_interp = timeit(lambda: interp(lut, img))
+            t_curves = timeit(lambda: separable(img))
+            print("{:>5d} {:>12.2f} {:>10} {:>12.1f} {:>12.1f}".format(dim, t_classify * 1000, separable.kind, t_interp * 1000, t_curves * 1000))
+    kinds = [SeparableLut3D(load_cube(path)[0]).classify() for path in paths]
+    print(", ".join("{} {}".format(kinds.count(kind), kind) for kind in SeparableLut3D.kinds))
+
+def bench_call_overhead(sizes=(8, 32, 128, 512)):
+    # Small inputs, where the Python autograd.Function glue dominates.
+    print("{:>6} {:>14} {:>14}".format("size", "Function us", "torch.ops us"))
+    lut = torch.rand((3, 17, 17, 17), dtype=torch.float, requires_grad=True)
+    interp = TrilinearInterpolation()
+    for size in sizes:
+        img = torch.rand((1, 3, size, size), dtype=torch.float)
+        def function_step():
+            _, out = interp(lut, img)
+            out.sum().backward()
+        def op_step():
+            torch.ops.trilinear.interpolate(lut, img).sum().backward()
+        t_function = timeit(function_step, repeat=200)
+        t_op = timeit(op_step, repeat=200)
+        print("{:>6d} {:>14.1f} {:>14.1f}".format(size, t_function * 1e6, t_op * 1e6))
+
+def isa_outputs(seed=0):
+    # Output of every CPU path with vector kernels: forward (planar, packed,
+    # uint8) on random colours, on lattice nodes with ties between channels and
+    # on out-of-range / NaN inputs, backward, fan-out, masked blend and its
+    # backward, and separable curves.
+    torch.manual_seed(seed)
+    dim, shape = 33, (2, 3, 97, 131)
+    lut = torch.rand((3, dim, dim, dim)) * 1.4 - 0.2
+    luts = torch.rand((5, 3, dim, dim, dim))
+    mask = torch.rand((2, 4, 97, 131))
+    mask.view(-1)[::3] = torch.randint(0, 2, mask.view(-1)[::3].size()).float()
+    grad = torch.rand(shape) * 2 - 1
+    random = torch.rand(shape)
+    tied = torch.randint(0, dim, shape).float() / (dim - 1)
+    tied[:, 1, ::2] = tied[:, 0, ::2]
+    tied[:, 2, :, ::3] = random[:, 2, :, ::3]
+    odd = torch.rand(shape) * 1.6 - 0.3
+    odd.view(-1)[::13] = float('nan')
+    grid = torch.linspace(0, 1, dim)
+    curves = torch.stack([grid.view(dim, 1, 1).expand(dim, dim, dim) ** 0.8,
+                          grid.view(1, dim, 1).expand(dim, dim, dim) ** 1.0,
+                          grid.view(1, 1, dim).expand(dim, dim, dim) ** 1.2]).contiguous()
+    outputs = {}
+    for mode, interp in (('trilinear', TrilinearInterpolation()), ('tetrahedral', TetrahedralInterpolation())):
+        packed = PackedLut3D(lut, mode)
+        with torch.no_grad():
+            for name, x in (('random', random), ('tied', tied), ('nan', odd)):
+                outputs[mode, 'forward', name] = interp(lut, x)[1]
+                outputs[mode, 'packed', name] = packed(x)
+            outputs[mode, 'forward', 'uint8'] = interp(lut, (random * 255).round().to(torch.uint8))[1]
+            outputs[mode, 'fanout', 'tied'] = fanout_lut3d(luts, tied, mode)
+            separable = SeparableLut3D(curves, mode)
+            assert separable.classify() == 'separable'
+            outputs[mode, 'separable', 'nan'] = separable(odd)
+        for name, x in (('random', random), ('tied', tied)):
+            lut_var, x_var = lut.clone().requires_grad_(), x.clone().requires_grad_()
+            interp(lut_var, x_var)[1].backward(grad)
+            outputs[mode, 'backward lut', name] = lut_var.grad
+            outputs[mode, 'backward input', name] = x_var.grad
+        luts_var, mask_var, x_var = luts.clone().requires_grad_(), mask.clone().requires_grad_(), tied.clone().requires_grad_()
+        out = mask_lut3d(luts_var, mask_var, x_var, mode)
+        out.backward(grad)
+        outputs[mode, 'mask', 'tied'] = out.detach()
+        outputs[mode, 'mask backward luts', 'tied'] = luts_var.grad
+        outputs[mode, 'mask backward mask', 'tied'] = mask_var.grad
+        outputs[mode, 'mask backward input', 'tied'] = x_var.grad
+    return outputs
+
+def same_bits(a, b):
+    # Bitwise equality, so NaN outputs compare equal to themselves.
+    if a.is_floating_point():
+        a, b = a.contiguous().view(torch.int32), b.contiguous().view(torch.int32)
+    return torch.equal(a, b)
+
+def check_isa():
+    # The vector kernels are meant to give results bit-identical to the scalar
+    # loops. The kernels are chosen when the extensions load, so the scalar
+    # outputs come from a child process started with LUT_CPU_ISA=scalar, using
+    # the same number of threads.
+    fd, path = tempfile.mkstemp(suffix='.pt')
+    os.close(fd)
+    try:
+        subprocess.run([sys.executable, os.path.abspath(__file__), '--isa-outputs', path, str(torch.get_num_threads())],
+                       env=dict(os.environ, LUT_CPU_ISA='scalar'), check=True)
+        scalar = torch.load(path)
+    finally:
+        os.remove(path)
+    vector = isa_outputs()
+    print("{:>12} {:>20} {:>8} {:>10}".format("mode", "output", "input", "bits"))
+    failed = 0
+    for key, value in vector.items():
+        same = same_bits(value, scalar[key])
+        failed += not same
+        print("{:>12} {:>20} {:>8} {:>10}".format(*key, "identical" if same else "DIFFERENT"))
+    return failed == 0
+
+def tetrahedral_cascade(lut, x):
+    # The six-way if/else cascade the tetrahedral kernels used before the
+    # compare-swap network, in tensor ops: the cases in their original order,
+    # with the same <= tie handling, weight expressions and summation order.
+    dim = lut.size(-1)
+    loc = x * (dim - 1)
+    lo = torch.floor(loc).long()
+    hi = torch.clamp(lo + 1, 0, dim - 1)
+    lo = torch.clamp(lo, 0, dim - 1)
+    r, g, b = (loc - lo.to(x.dtype)).unbind(1)
+    ends = (lo.unbind(1), hi.unbind(1))
+
+    def blend(terms):
+        # terms: (weight, corner) with corner '101' = (r_1, g_0, b_1).
+        out = None
+        for w, corner in terms:
+            i = [ends[int(bit)][axis] for axis, bit in enumerate(corner)]
+            term = w.unsqueeze(1) * lut[:, i[0], i[1], i[2]].transpose(0, 1)
+            out = term if out is None else out + term
+        return out
+
+    cases = [((r > g) & (g > b), [(1 - r, '000'), (r - g, '100'), (g - b, '110'), (b, '111')]),
+             ((r > g) & (r > b), [(1 - r, '000'), (r - b, '100'), (b - g, '101'), (g, '111')]),
+             ((r > g) & (g <= b) & (r <= b), [(1 - b, '000'), (b - r, '001'), (r - g, '101'), (g, '111')]),
+             ((r <= g) & (b > g), [(1 - b, '000'), (b - g, '001'), (g - r, '011'), (r, '111')]),
+             ((r <= g) & (b > r), [(1 - g, '000'), (g - b, '010'), (b - r, '011'), (r, '111')])]
+    out = blend([(1 - g, '000'), (g - r, '010'), (r - b, '110'), (b, '111')])
+    for case, terms in reversed(cases):
+        out = torch.where(case.unsqueeze(1), blend(terms), out)
+    return out
+
+def check_cascade():
+    # The tetrahedral forward against the cascade, bit for bit, on inputs where
+    # the fractional deltas tie (k/20 and lattice nodes) and on random colours.
+    torch.manual_seed(0)
+    dim, shape = 33, (2, 3, 97, 131)
+    lut = torch.rand((3, dim, dim, dim)) * 1.4 - 0.2
+    inputs = (('random', torch.rand(shape)),
+              ('k/20', torch.randint(0, 21, shape).float() / 20),
+              ('nodes', torch.randint(0, dim, shape).float() / (dim - 1)))
+    print("{:>8} {:>10}".format("input", "bits"))
+    failed = 0
+    with torch.no_grad():
+        for name, x in inputs:
+            same = same_bits(TetrahedralInterpolation()(lut, x)[1], tetrahedral_cascade(lut, x))
+            failed += not same
+            print("{:>8} {:>10}".format(name, "identical" if same else "DIFFERENT"))
+    return failed == 0
+
+def same_sparse(a, b):
+    a, b = a.coalesce(), b.coalesce()
+    return torch.equal(a.indices(), b.indices()) and same_bits(a.values(), b.values())
+
+def check_sparse():
+    # The sparse gradients are summed from the slice buffers at the nodes of
+    # the cells the pixels reach. They must equal the dense gradient reduced to
+    # its nonzero nodes (sparse_lut_grad), bit for bit.
+    torch.manual_seed(0)
+    dim, shape = 33, (2, 3, 97, 131)
+    lut = torch.rand((3, dim, dim, dim))
+    x = torch.rand(shape) * 0.6
+    x.view(-1)[::7] = torch.randint(0, 20, x.view(-1)[::7].size()).float() / (dim - 1)
+    target = torch.rand(shape)
+    grad = torch.rand(shape) * 2 - 1
+    print("{:>12} {:>10} {:>10}".format("mode", "gradient", "bits"))
+    failed = 0
+    for mode, backend, interp in (('trilinear', trilinear, TrilinearInterpolation()),
+                                  ('tetrahedral', tetrahedral, TetrahedralInterpolation())):
+        lut_sparse, lut_dense = lut.clone().requires_grad_(), lut.clone().requires_grad_()
+        SparseLut3DFunction.apply(lut_sparse, x, mode).backward(grad)
+        interp(lut_dense, x)[1].backward(grad)
+        same = same_sparse(lut_sparse.grad, sparse_lut_grad(lut_dense.grad, backend))
+        failed += not same
+        print("{:>12} {:>10} {:>10}".format(mode, "backward", "identical" if same else "DIFFERENT"))
+
+        lut_sparse, lut_dense = lut.clone().requires_grad_(), lut.clone().requires_grad_()
+        Lut3DLossFunction.apply(lut_sparse, x, target, 'l1', mode, True).backward()
+        Lut3DLossFunction.apply(lut_dense, x, target, 'l1', mode).backward()
+        same = same_sparse(lut_sparse.grad, sparse_lut_grad(lut_dense.grad, backend))
+        failed += not same
+        print("{:>12} {:>10} {:>10}".format(mode, "loss", "identical" if same else "DIFFERENT"))
+    return failed == 0
+
+if __name__=='__main__':
+    if sys.argv[1:2] == ['--isa-outputs']:
+        torch.set_num_threads(int(sys.argv[3]))
+        torch.save(isa_outputs(), sys.argv[2])
+        sys.exit(0)
+
+    print("Vector kernels vs LUT_CPU_ISA=scalar, bit for bit")
+    if not check_isa():
+        sys.exit("vector and scalar kernels disagree")
+    print("Tetrahedral forward vs the six-way if/else cascade, bit for bit")
+    if not check_cascade():
+        sys.exit("tetrahedral forward and cascade disagree")
+    print("Sparse LUT gradients vs the dense gradient, bit for bit")
+    if not check_sparse():
+        sys.exit("sparse and dense LUT gradients disagree")
+    if sys.argv[1:2] == ['--check']:
+        sys.exit(0)
+
+    # 24 MP frame, 33^3 LUT
+    lut = torch.rand((3, 33, 33, 33), dtype=torch.float)
+    img = torch.rand((1, 3, 4000, 6000), dtype=torch.float)
+
+    print("Trilinear forward")
+    bench_threads(forward_fn(TrilinearInterpolation(), lut, img))
+    print("Tetrahedral forward")
+    bench_threads(forward_fn(TetrahedralInterpolation(), lut, img))
+
+    # 8 x 512 x 512 training batch, as in train.py
+    batch = torch.rand((8, 3, 512, 512), dtype=torch.float)
+    print("Trilinear forward + backward")
+    bench_threads(train_step_fn(TrilinearInterpolation(), lut, batch))
+
+    shaper = torch.linspace(0, 1, 64)
+    lut = torch.rand((3, 17, 17, 17), dtype=torch.float)
+    print("1D shaper + 3D LUT, unfused tensor ops")
+    bench_threads(shaper_step_fn(shaper, lut, batch, False))
+    print("1D shaper + 3D LUT, fused")
+    bench_threads(shaper_step_fn(shaper, lut, batch, True))
+
+    basis = torch.rand((3, 3, 33, 33, 33), dtype=torch.float)
+    weights = torch.rand((8, 3), dtype=torch.float)
+    print("Blend of 3 basis LUTs, per-sample LUTs built in Python")
+    bench_threads(blend_step_fn(basis, weights, batch, False))
+    print("Blend of 3 basis LUTs, fused")
+    bench_threads(blend_step_fn(basis, weights, batch, True))
+
+    print("16 images with mixed LUTs (dim 32/33/64), per-image calls vs LUT bank")
+    bench_bank()
+
+    torch.set_num_threads(1)
+    print("LUT layout, uniformly random colours")
+    bench_layouts(torch.rand((1, 3, 2000, 3000), dtype=torch.float))
+    print("LUT layout, natural image")
+    natural = cv2.cvtColor(cv2.imread("C1_Drago1.png"), cv2.COLOR_BGR2RGB).astype(np.float32) / 255.
+    bench_layouts(torch.permute(torch.tensor(natural), (2, 0, 1)).unsqueeze(0).contiguous())
+
+    print("35 previews of a natural uint8 image, per-LUT calls vs fan-out")
+    bench_fanout(torch.permute(torch.tensor(cv2.cvtColor(cv2.imread("C1_Drago1.png"), cv2.COLOR_BGR2RGB)), (2, 0, 1)).unsqueeze(0))
+
+    print("Loading 35_Free_LUTs: colour.read_LUT vs native .cube parser vs mapped binary cache")
+    bench_cube_load(sorted(glob.glob("35_Free_LUTs/*.CUBE")))
+
+    print("uint8 baked table vs interpolation, natural image (break-even in frames)")
+    natural8 = cv2.cvtColor(cv2.imread("C1_Drago1.png"), cv2.COLOR_BGR2RGB)
+    bench_table(torch.permute(torch.tensor(natural8), (2, 0, 1)).unsqueeze(0).contiguous())
+    print("uint8 baked table vs interpolation, uniformly random colours")
+    bench_table(torch.randint(0, 256, (1, 3, 2000, 3000), dtype=torch.uint8))
+
+    print("Separable LUTs: 3D interpolation vs three 1D curves, and the classes of 35_Free_LUTs")
+    bench_separable(torch.rand((1, 3, 2000, 3000), dtype=torch.float), sorted(glob.glob("35_Free_LUTs/*.CUBE")))
+
+    print("Per-call overhead, forward + backward: Python Function vs registered operator")
+    bench_call_overhead()
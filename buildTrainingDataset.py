@@ -1,4 +1,3 @@
-import colour
 from lut3d import *
 import numpy as np
 import cv2
@@ -9,18 +8,14 @@ from tqdm import tqdm
 
 if __name__=='__main__':
     img_dir = './train_img'
-    save_dir = './train_img_np'
-    input_dir = os.path.join(save_dir, "input")
-    output_dir = os.path.join(save_dir, "target")
-    if not os.path.exists(input_dir):
-        os.makedirs(input_dir)
-    if not os.path.exists(output_dir):
-        os.makedirs(output_dir)
+    # Pairs are packed into uint16 shards of shard_size pairs for ShardLoader.
+    save_dir = './train_shards'
+    shard_size = 32
+    if not os.path.exists(save_dir):
+        os.makedirs(save_dir)
+    inputs, targets, shards = [], [], 0
     img_list = glob.glob(os.path.join(img_dir, "*.jpg"))
-    lutRaw = colour.read_LUT("./35_Free_LUTs/Chemical 168.CUBE")
-    lut = lutRaw.table.astype(np.float32)
-    lut = torch.tensor(lut)
-    lut = torch.permute(lut, (3, 0, 1, 2))
+    lut, _, _ = load_cube("./35_Free_LUTs/Chemical 168.CUBE")
     interp = TrilinearInterpolation()
     for img_file in tqdm(img_list):
         basename = os.path.basename(img_file).split('.')[0]
@@ -40,7 +35,9 @@ if __name__=='__main__':
         new_img = torch.permute(new_img, (1,2,0)).numpy()
         new_img = cv2.cvtColor(new_img, cv2.COLOR_RGB2BGR)
         
-        input_path = os.path.join(input_dir, basename)
-        target_path = os.path.join(output_dir, basename)
-        np.save(input_path, imgRaw)
-        np.save(target_path, new_img)
\ No newline at end of file
+        inputs.append(torch.from_numpy(imgRaw))
+        targets.append(torch.from_numpy(new_img))
+        if len(inputs) == shard_size or img_file == img_list[-1]:
+            shard_path = os.path.join(save_dir, "{:05d}.lutshard".format(shards))
+            trilinear.write_shard(shard_path, torch.stack(inputs), torch.stack(targets), 2)
+            inputs, targets, shards = [], [], shards + 1
\ No newline at end of file
@@ -0,0 +1,43 @@
+#ifndef LUT_BANK_H
+#define LUT_BANK_H
+
+#include <torch/extension.h>
+#include <cstdint>
+#include <vector>
+
+// A bank of LUTs of different sizes (e.g. the 32, 33 and 64 point LUTs of
+// 35_Free_LUTs) stored back to back in one arena tensor. LUT i is the planar
+// [3][dim_i][dim_i][dim_i] block at index[i][0] with dim_i = index[i][1], so a
+// batch can pick a different LUT per sample through a [batch] tensor of ids
+// and still be interpolated in one parallel pass over all rows.
+struct LutBankLut
+{
+    int64_t offset;
+    int dim;
+};
+
+// Looks up the LUT of every sample, checking the index against the arena and
+// the ids against the index once, before the kernels run.
+inline std::vector<LutBankLut> lut_bank_select(const torch::Tensor &arena, const torch::Tensor &index, const torch::Tensor &ids, const int batch)
+{
+    TORCH_CHECK(index.scalar_type() == at::kLong && index.dim() == 2 && index.size(1) == 2 && index.is_contiguous(),
+                "LUT bank index must be a contiguous int64 [n, 2] tensor of (offset, dim)");
+    TORCH_CHECK(ids.scalar_type() == at::kLong && ids.numel() == batch, "LUT ids must be an int64 tensor of batch elements");
+
+    const torch::Tensor ids_contiguous = ids.contiguous();
+    const int64_t *entries = index.data_ptr<int64_t>();
+    const int64_t *id = ids_contiguous.data_ptr<int64_t>();
+
+    std::vector<LutBankLut> luts(batch);
+    for (int b = 0; b < batch; ++b)
+    {
+        TORCH_CHECK(id[b] >= 0 && id[b] < index.size(0), "LUT id ", id[b], " is not in the bank");
+        const int64_t offset = entries[id[b] * 2];
+        const int64_t dim = entries[id[b] * 2 + 1];
+        TORCH_CHECK(dim >= 2 && offset >= 0 && offset + dim * dim * dim * 3 <= arena.numel(), "LUT ", id[b], " lies outside the arena");
+        luts[b] = {offset, (int)dim};
+    }
+    return luts;
+}
+
+#endif
@@ -0,0 +1,350 @@
+#ifndef LUT_BATCH_H
+#define LUT_BATCH_H
+
+#include <torch/extension.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "lut_stream.h"
+
+#ifdef LUT_WITH_PNG
+#include <png.h>
+#include <zlib.h>
+#endif
+
+// Applies a LUT to a list of image files as a pipeline of three stages that
+// run at the same time on different images: decode workers read files into
+// image buffers, the calling thread interpolates each buffer in place with
+// the row kernels and the intra-op thread pool, and encode workers write the
+// results. A fixed pool of buffers circulates between the stages through
+// LutStreamQueues, so at most that many images are in memory, a slow stage
+// makes the others wait instead of queueing unboundedly, and buffers are
+// reused instead of allocated per image.
+//
+// Formats are those of lut_stream.h with a header (PPM, .npy) and, when the
+// extension is built with LUT_WITH_PNG and libpng, 8 and 16 bit PNG. Outputs
+// go to output_dir under the input's file name, in the input's format.
+
+struct LutBatchImage
+{
+    int index;
+    bool png;
+    LutStreamImage info;
+    std::vector<char> data;
+};
+
+// Per-stage counters; busy is the time spent working on images, summed over
+// the stage's threads, and depth is sampled whenever an image is queued for
+// the stage.
+struct LutBatchStage
+{
+    std::atomic<int64_t> images{0};
+    std::atomic<int64_t> pixels{0};
+    std::atomic<int64_t> busy_ns{0};
+    std::atomic<int64_t> depth_sum{0};
+    std::atomic<int64_t> depth_max{0};
+
+    void queued(const size_t depth)
+    {
+        depth_sum += depth;
+        int64_t max = depth_max;
+        while ((int64_t)depth > max && !depth_max.compare_exchange_weak(max, depth))
+            ;
+    }
+
+    void done(const LutBatchImage &image, const std::chrono::steady_clock::time_point start)
+    {
+        busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        pixels += (int64_t)image.info.width * image.info.height;
+        ++images;
+    }
+
+    std::map<std::string, double> report(const int threads) const
+    {
+        const double busy = busy_ns * 1e-9;
+        return {{"images", (double)images},
+                {"threads", (double)threads},
+                {"busy_seconds", busy},
+                {"images_per_second", busy > 0 ? images * threads / busy : 0},
+                {"megapixels_per_second", busy > 0 ? pixels * 1e-6 * threads / busy : 0},
+                {"mean_queue_depth", images > 0 ? (double)depth_sum / images : 0},
+                {"max_queue_depth", (double)depth_max}};
+    }
+};
+
+inline std::string lut_batch_output_path(const std::string &input, const std::string &output_dir)
+{
+    const size_t slash = input.find_last_of("/\\");
+    return output_dir + "/" + (slash == std::string::npos ? input : input.substr(slash + 1));
+}
+
+#ifdef LUT_WITH_PNG
+// libpng reports errors by longjmp; the message is kept here and turned into
+// an exception by the caller, outside the frames libpng unwinds.
+struct LutPngError
+{
+    char message[256];
+};
+
+inline void lut_png_error(png_structp png, png_const_charp message)
+{
+    LutPngError *error = static_cast<LutPngError *>(png_get_error_ptr(png));
+    std::snprintf(error->message, sizeof(error->message), "%s", message);
+    png_longjmp(png, 1);
+}
+
+inline void lut_png_warning(png_structp, png_const_charp)
+{
+}
+
+// Decodes to interleaved RGB of 8 or 16 bit native samples; palette, grey and
+// alpha channels are expanded or dropped. Returns false with error set on
+// failure.
+inline bool lut_png_read(FILE *file, LutBatchImage &image, LutPngError &error)
+{
+    thread_local std::vector<png_bytep> rows;
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, &error, lut_png_error, lut_png_warning);
+    png_infop info = png ? png_create_info_struct(png) : nullptr;
+    if (info == nullptr)
+    {
+        png_destroy_read_struct(&png, nullptr, nullptr);
+        std::snprintf(error.message, sizeof(error.message), "out of memory");
+        return false;
+    }
+    if (setjmp(png_jmpbuf(png)))
+    {
+        png_destroy_read_struct(&png, &info, nullptr);
+        return false;
+    }
+
+    png_init_io(png, file);
+    png_read_info(png, info);
+    png_set_expand(png);
+    png_set_strip_alpha(png);
+    png_set_gray_to_rgb(png);
+    if (png_get_bit_depth(png, info) == 16)
+        png_set_swap(png);
+    png_read_update_info(png, info);
+
+    image.info.width = png_get_image_width(png, info);
+    image.info.height = png_get_image_height(png, info);
+    image.info.sample_bytes = png_get_bit_depth(png, info) == 16 ? 2 : 1;
+    image.data.resize(image.info.height * image.info.row_bytes());
+    rows.resize(image.info.height);
+    for (int h = 0; h < image.info.height; ++h)
+        rows[h] = reinterpret_cast<png_bytep>(image.data.data() + h * image.info.row_bytes());
+    png_read_image(png, rows.data());
+    png_read_end(png, nullptr);
+    png_destroy_read_struct(&png, &info, nullptr);
+    return true;
+}
+
+inline bool lut_png_write(FILE *file, LutBatchImage &image, LutPngError &error)
+{
+    thread_local std::vector<png_bytep> rows;
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, &error, lut_png_error, lut_png_warning);
+    png_infop info = png ? png_create_info_struct(png) : nullptr;
+    if (info == nullptr)
+    {
+        png_destroy_write_struct(&png, nullptr);
+        std::snprintf(error.message, sizeof(error.message), "out of memory");
+        return false;
+    }
+    if (setjmp(png_jmpbuf(png)))
+    {
+        png_destroy_write_struct(&png, &info);
+        return false;
+    }
+
+    png_init_io(png, file);
+    // cv2.imwrite's defaults (level 1, SUB filter, RLE strategy): several
+    // times faster than libpng's, for somewhat larger files.
+    png_set_filter(png, PNG_FILTER_TYPE_BASE, PNG_FILTER_SUB);
+    png_set_compression_level(png, 1);
+    png_set_compression_strategy(png, Z_RLE);
+    png_set_IHDR(png, info, image.info.width, image.info.height, image.info.sample_bytes * 8, PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+    if (image.info.sample_bytes == 2)
+        png_set_swap(png);
+    rows.resize(image.info.height);
+    for (int h = 0; h < image.info.height; ++h)
+        rows[h] = reinterpret_cast<png_bytep>(image.data.data() + h * image.info.row_bytes());
+    png_write_image(png, rows.data());
+    png_write_end(png, nullptr);
+    png_destroy_write_struct(&png, &info);
+    return true;
+}
+#endif
+
+// Whether this build reads and writes PNG files.
+inline bool lut_batch_png()
+{
+#ifdef LUT_WITH_PNG
+    return true;
+#else
+    return false;
+#endif
+}
+
+inline void lut_batch_decode(const std::string &path, LutBatchImage &image)
+{
+    image.png = lut_stream_has_suffix(path, ".png");
+    if (image.png)
+    {
+#ifdef LUT_WITH_PNG
+        FILE *file = std::fopen(path.c_str(), "rb");
+        TORCH_CHECK(file != nullptr, "cannot open ", path);
+        image.info = LutStreamImage{0, 0, 1, false, false, ""};
+        LutPngError error;
+        const bool ok = lut_png_read(file, image, error);
+        std::fclose(file);
+        TORCH_CHECK(ok, path, ": ", error.message);
+        return;
+#else
+        TORCH_CHECK(false, path, ": this build has no PNG support (libpng was not found when it was compiled)");
+#endif
+    }
+
+    TORCH_CHECK(lut_stream_has_suffix(path, ".ppm") || lut_stream_has_suffix(path, ".npy"), path, ": unsupported format, expected .png, .ppm or .npy");
+    FILE *file = lut_stream_open(path, image.info, 0, 0, "");
+    const size_t bytes = image.info.height * image.info.row_bytes();
+    image.data.resize(bytes);
+    const bool ok = std::fread(image.data.data(), 1, bytes, file) == bytes;
+    std::fclose(file);
+    TORCH_CHECK(ok, path, " is truncated");
+    lut_stream_fix_samples(image.info, image.data.data(), bytes / image.info.sample_bytes, true);
+}
+
+inline void lut_batch_encode(const std::string &path, LutBatchImage &image)
+{
+    FILE *file = std::fopen(path.c_str(), "wb");
+    TORCH_CHECK(file != nullptr, "cannot create ", path);
+#ifdef LUT_WITH_PNG
+    if (image.png)
+    {
+        LutPngError error;
+        const bool ok = lut_png_write(file, image, error);
+        const bool closed = std::fclose(file) == 0;
+        TORCH_CHECK(ok, path, ": ", error.message);
+        TORCH_CHECK(closed, "error writing ", path);
+        return;
+    }
+#endif
+    const size_t bytes = image.info.height * image.info.row_bytes();
+    lut_stream_fix_samples(image.info, image.data.data(), bytes / image.info.sample_bytes, false);
+    bool ok = std::fwrite(image.info.header.data(), 1, image.info.header.size(), file) == image.info.header.size();
+    ok = ok && std::fwrite(image.data.data(), 1, bytes, file) == bytes;
+    ok = std::fclose(file) == 0 && ok;
+    TORCH_CHECK(ok, "error writing ", path);
+}
+
+// Runs the pipeline over inputs with workers decode and workers encode
+// threads and depth image buffers; fn is called as in lut_stream_dispatch on
+// each whole image. The first error stops the pipeline and is rethrown.
+// Returns the statistics of each stage and the wall time.
+template <typename F>
+inline std::map<std::string, std::map<std::string, double>> lut_batch_apply(const std::vector<std::string> &inputs, const std::string &output_dir,
+                                                                            int workers, int depth, const F &fn)
+{
+    workers = std::max(workers, 1);
+    depth = std::max(depth, 2 * workers + 1);
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<LutBatchImage> images(depth);
+    LutStreamQueue<LutBatchImage> free_images, decoded, applied;
+    for (LutBatchImage &image : images)
+        free_images.push(&image);
+    LutBatchStage decode_stage, apply_stage, encode_stage;
+
+    std::atomic<int> next{0};
+    std::atomic<int> decoders{workers};
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    auto fail = [&]
+    {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error)
+            error = std::current_exception();
+        free_images.close();
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < workers; ++t)
+        threads.emplace_back([&]
+        {
+            try
+            {
+                for (int index = next++; index < (int)inputs.size(); index = next++)
+                {
+                    LutBatchImage *image = free_images.pop();
+                    if (image == nullptr)
+                        break;
+                    const auto begin = std::chrono::steady_clock::now();
+                    image->index = index;
+                    lut_batch_decode(inputs[index], *image);
+                    decode_stage.done(*image, begin);
+                    apply_stage.queued(decoded.push(image));
+                }
+            }
+            catch (...)
+            {
+                fail();
+            }
+            if (--decoders == 0)
+                decoded.close();
+        });
+
+    for (int t = 0; t < workers; ++t)
+        threads.emplace_back([&]
+        {
+            while (LutBatchImage *image = applied.pop())
+            {
+                try
+                {
+                    const auto begin = std::chrono::steady_clock::now();
+                    lut_batch_encode(lut_batch_output_path(inputs[image->index], output_dir), *image);
+                    encode_stage.done(*image, begin);
+                }
+                catch (...)
+                {
+                    fail();
+                }
+                free_images.push(image);
+            }
+        });
+
+    while (LutBatchImage *image = decoded.pop())
+    {
+        try
+        {
+            const auto begin = std::chrono::steady_clock::now();
+            lut_stream_dispatch(image->info, image->data.data(), image->info.height, fn);
+            apply_stage.done(*image, begin);
+            encode_stage.queued(applied.push(image));
+        }
+        catch (...)
+        {
+            fail();
+            free_images.push(image);
+        }
+    }
+    applied.close();
+    for (std::thread &thread : threads)
+        thread.join();
+    if (error)
+        std::rethrow_exception(error);
+
+    const double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return {{"decode", decode_stage.report(workers)},
+            {"apply", apply_stage.report(1)},
+            {"encode", encode_stage.report(workers)},
+            {"total", {{"images", (double)inputs.size()}, {"wall_seconds", wall}, {"images_per_second", inputs.size() / wall}}}};
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef LUT_BLEND_H
+#define LUT_BLEND_H
+
+#include <ATen/Parallel.h>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Per-sample weighted sums of basis LUTs, as in Image-Adaptive-3DLUT, where a
+// CNN predicts weights[batch][n] over a [n][3][dim][dim][dim] basis stack.
+// Interpolation is linear in the LUT, so sample b is interpolated against
+// sum_k weights[b][k] * basis[k], formed in one LUT-sized scratch buffer that
+// is reused by every sample, instead of per-sample LUT tensors in Python.
+// For the backward pass, with G_b the gradient of that blended LUT:
+//
+//   d basis[k]      = sum_b weights[b][k] * G_b
+//   d weights[b][k] = <G_b, basis[k]>
+//
+// The second line holds because sum over the pixels of g . interp(L, x) equals
+// <G_b, L> for any LUT L, so the weights need no extra pass over the image.
+template <typename scalar_t>
+inline void lut_blend_basis(const scalar_t *basis, const scalar_t *weights, const int n, const int64_t lut_size, scalar_t *lut)
+{
+    at::parallel_for(0, lut_size, 4096, [&](int64_t begin, int64_t end)
+    {
+        for (int64_t i = begin; i < end; ++i)
+        {
+            scalar_t v = weights[0] * basis[i];
+            for (int k = 1; k < n; ++k)
+                v += weights[k] * basis[k * lut_size + i];
+            lut[i] = v;
+        }
+    });
+}
+
+// Calls fn(batch_index, lut) for every sample with its blended LUT.
+template <typename scalar_t, typename F>
+inline void lut_blend_samples(const scalar_t *basis, const scalar_t *weights, const int n, const int64_t lut_size, const int batch, const F &fn)
+{
+    std::vector<scalar_t> lut(lut_size);
+    for (int b = 0; b < batch; ++b)
+    {
+        lut_blend_basis(basis, weights + (int64_t)b * n, n, lut_size, lut.data());
+        fn(b, (const scalar_t *)lut.data());
+    }
+}
+
+// Backward counterpart: fn(batch_index, lut, grad) accumulates the gradient of
+// the sample's blended LUT into the zeroed grad, which is then distributed to
+// basis_grad and weights_grad as above. The dot products are summed serially
+// in double, so they do not depend on the thread count.
+template <typename scalar_t, typename F>
+inline void lut_blend_backward_samples(const scalar_t *basis, const scalar_t *weights, const int n, const int64_t lut_size, const int batch,
+                                       scalar_t *basis_grad, scalar_t *weights_grad, const F &fn)
+{
+    std::vector<scalar_t> grad(lut_size);
+    lut_blend_samples(basis, weights, n, lut_size, batch, [&](const int b, const scalar_t *lut)
+    {
+        const scalar_t *w = weights + (int64_t)b * n;
+
+        std::fill(grad.begin(), grad.end(), scalar_t(0));
+        fn(b, lut, grad.data());
+
+        at::parallel_for(0, lut_size, 4096, [&](int64_t begin, int64_t end)
+        {
+            for (int k = 0; k < n; ++k)
+                for (int64_t i = begin; i < end; ++i)
+                    basis_grad[k * lut_size + i] += w[k] * grad[i];
+        });
+
+        for (int k = 0; k < n; ++k)
+        {
+            double dot = 0;
+            for (int64_t i = 0; i < lut_size; ++i)
+                dot += (double)grad[i] * basis[k * lut_size + i];
+            weights_grad[(int64_t)b * n + k] += (scalar_t)dot;
+        }
+    });
+}
+
+#endif
@@ -0,0 +1,109 @@
+#ifndef LUT_CHAIN_H
+#define LUT_CHAIN_H
+
+#include <torch/extension.h>
+#include <vector>
+#include "lut_image.h"
+#include "lut_parallel.h"
+#include "lut_shaper.h"
+
+// One stage of a LUT chain: a [3][dim][dim][dim] 3D LUT, or a 1D curve shared
+// by the channels ([dim]) or per channel ([3][dim]).
+template <typename scalar_t>
+struct LutStage
+{
+    const scalar_t *data;
+    int dim;
+    bool is_3d;
+    int curve_stride;
+};
+
+template <typename scalar_t>
+inline std::vector<LutStage<scalar_t>> lut_chain_stages(const std::vector<torch::Tensor> &stages)
+{
+    TORCH_CHECK(!stages.empty(), "a LUT chain needs at least one stage");
+
+    std::vector<LutStage<scalar_t>> chain;
+    for (const torch::Tensor &stage : stages)
+    {
+        TORCH_CHECK(stage.dim() == 4 || stage.dim() == 2 || stage.dim() == 1,
+                    "chain stages must be [3, d, d, d] LUTs or [d] / [3, d] curves");
+        TORCH_CHECK(stage.is_contiguous(), "chain stages must be contiguous");
+
+        LutStage<scalar_t> s;
+        s.data = stage.data_ptr<scalar_t>();
+        s.dim = stage.size(-1);
+        s.is_3d = stage.dim() == 4;
+        s.curve_stride = stage.dim() == 2 ? s.dim : 0;
+        chain.push_back(s);
+    }
+    return chain;
+}
+
+// Runs one colour through the chain. As in Lut3D and Lut1D every stage clamps
+// its input to [0, 1]; the output of the last stage is not clamped. sample is
+// trilinear_sample or tetrahedral_sample.
+template <typename scalar_t, typename Sample>
+inline void lut_chain_sample(const std::vector<LutStage<scalar_t>> &chain, scalar_t rgb[3], const Sample &sample)
+{
+    for (const LutStage<scalar_t> &s : chain)
+    {
+        if (s.is_3d)
+        {
+            scalar_t in[3];
+            for (int c = 0; c < 3; ++c)
+                in[c] = std::min(std::max(rgb[c], (scalar_t)0), (scalar_t)1);
+            sample(s.data, s.dim, in[0], in[1], in[2], rgb);
+        }
+        else
+        {
+            for (int c = 0; c < 3; ++c)
+                rgb[c] = lut_shaper_sample(s.data + c * s.curve_stride, s.dim, rgb[c]).raw;
+        }
+    }
+}
+
+// Evaluates the chain at the nodes of a [3][dim][dim][dim] lattice, so one
+// lookup in the baked LUT replaces the whole chain.
+template <typename scalar_t, typename Sample>
+inline void lut_chain_bake(const std::vector<LutStage<scalar_t>> &chain, scalar_t *baked, const int dim, const Sample &sample)
+{
+    const int64_t shift = (int64_t)dim * dim * dim;
+    at::parallel_for(0, shift, LUT_PARALLEL_GRAIN_PIXELS / 8, [&](int64_t begin, int64_t end)
+    {
+        for (int64_t n = begin; n < end; ++n)
+        {
+            scalar_t rgb[3] = {(scalar_t)(n / (dim * dim)) / (dim - 1),
+                               (scalar_t)(n / dim % dim) / (dim - 1),
+                               (scalar_t)(n % dim) / (dim - 1)};
+            lut_chain_sample(chain, rgb, sample);
+            for (int c = 0; c < 3; ++c)
+                baked[c * shift + n] = rgb[c];
+        }
+    });
+}
+
+// Applies the chain stage by stage to every pixel of an image.
+template <typename scalar_t, typename Sample>
+inline void lut_chain_image(const std::vector<LutStage<scalar_t>> &chain, const scalar_t *image, scalar_t *output,
+                            const LutImageLayout &image_layout, const LutImageLayout &output_layout,
+                            const int width, const int height, const int batch, const Sample &sample)
+{
+    lut_parallel_rows(batch, height, width, [&](const int batch_index, const int h)
+    {
+        for (int w = 0; w < width; ++w)
+        {
+            const int64_t in = image_layout.offset(batch_index, 0, h, w);
+            const int64_t out = output_layout.offset(batch_index, 0, h, w);
+
+            scalar_t rgb[3];
+            for (int c = 0; c < 3; ++c)
+                rgb[c] = image[in + c * image_layout.channel];
+            lut_chain_sample(chain, rgb, sample);
+            for (int c = 0; c < 3; ++c)
+                output[out + c * output_layout.channel] = rgb[c];
+        }
+    });
+}
+
+#endif
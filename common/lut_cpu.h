@@ -0,0 +1,59 @@
+#ifndef LUT_CPU_H
+#define LUT_CPU_H
+
+#include <cstdlib>
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define LUT_HAVE_X86_SIMD 1
+#include <immintrin.h>
+#define LUT_TARGET_AVX2 __attribute__((target("avx2")))
+#define LUT_TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define LUT_HAVE_X86_SIMD 0
+#endif
+
+// Instruction sets the CPU kernels can be dispatched to, in increasing order.
+enum LutIsa
+{
+    LUT_ISA_SCALAR = 0,
+    LUT_ISA_AVX2 = 1,
+    LUT_ISA_AVX512 = 2
+};
+
+// True when LUT_CPU_ISA=scalar asks for the scalar loops even where the CPU
+// has vector units (SSE is part of x86-64 and is used unconditionally
+// otherwise).
+inline bool lut_isa_forced_scalar()
+{
+    const char *cap = std::getenv("LUT_CPU_ISA");
+    return cap != nullptr && std::strcmp(cap, "scalar") == 0;
+}
+
+// Best instruction set supported by the running CPU, from CPUID. Setting the
+// environment variable LUT_CPU_ISA to scalar, avx2 or avx512 caps the choice,
+// which is how the vector kernels are benchmarked against the scalar path.
+inline LutIsa lut_detect_isa()
+{
+    LutIsa isa = LUT_ISA_SCALAR;
+#if LUT_HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        isa = LUT_ISA_AVX2;
+    if (__builtin_cpu_supports("avx512f"))
+        isa = LUT_ISA_AVX512;
+#endif
+    const char *cap = std::getenv("LUT_CPU_ISA");
+    if (cap != nullptr)
+    {
+        LutIsa limit = isa;
+        if (std::strcmp(cap, "scalar") == 0)
+            limit = LUT_ISA_SCALAR;
+        else if (std::strcmp(cap, "avx2") == 0)
+            limit = LUT_ISA_AVX2;
+        isa = limit < isa ? limit : isa;
+    }
+    return isa;
+}
+
+#endif
@@ -0,0 +1,315 @@
+#ifndef LUT_CUBE_H
+#define LUT_CUBE_H
+
+#include <torch/extension.h>
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define LUT_HAVE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define LUT_HAVE_MMAP 0
+#endif
+
+// Reading and writing 3D LUTs in the Adobe / Resolve .cube text format, and a
+// binary cache of the same LUT that is memory-mapped on load. Both produce the
+// [3][dim][dim][dim] float layout of the kernels (node r * dim^2 + g * dim + b)
+// directly. In a .cube file red changes fastest, so data line
+// i = r + g * dim + b * dim^2 holds the R, G and B outputs of node (r, g, b).
+//
+// Loaders return (lut, domain, title): domain is a [2, 3] tensor of
+// DOMAIN_MIN and DOMAIN_MAX (or LUT_3D_INPUT_RANGE), [0, 1] if absent. The
+// kernels interpolate over [0, 1], so a LUT with another domain expects
+// inputs rescaled to it.
+typedef std::tuple<torch::Tensor, torch::Tensor, std::string> LutFile;
+
+inline torch::Tensor lut_cube_domain(const float *domain_min, const float *domain_max)
+{
+    torch::Tensor domain = torch::empty({2, 3}, torch::kFloat);
+    float *d = domain.data_ptr<float>();
+    for (int c = 0; c < 3; ++c)
+    {
+        d[c] = domain_min[c];
+        d[c + 3] = domain_max[c];
+    }
+    return domain;
+}
+
+// Reads n floats after the keyword at s into v; false if there are fewer.
+inline bool lut_cube_floats(const char *s, float *v, const int n)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        char *end;
+        v[i] = std::strtof(s, &end);
+        if (end == s)
+            return false;
+        s = end;
+    }
+    return true;
+}
+
+inline LutFile lut_read_cube(const std::string &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    TORCH_CHECK(file, "cannot open ", path);
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    const std::string text = buffer.str();
+
+    std::string title;
+    int dim = 0;
+    float domain_min[3] = {0, 0, 0};
+    float domain_max[3] = {1, 1, 1};
+    torch::Tensor lut;
+    float *data = nullptr;
+    int64_t count = 0;
+    int line_number = 0;
+
+    const char *p = text.c_str();
+    const char *end = p + text.size();
+    while (p < end)
+    {
+        const char *eol = static_cast<const char *>(std::memchr(p, '\n', end - p));
+        if (eol == nullptr)
+            eol = end;
+        const std::string line(p, eol);
+        p = eol + 1;
+        ++line_number;
+
+        const size_t start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos || line[start] == '#')
+            continue;
+        const char *s = line.c_str() + start;
+
+        if (std::isdigit((unsigned char)s[0]) || s[0] == '-' || s[0] == '+' || s[0] == '.')
+        {
+            TORCH_CHECK(dim > 0, path, ":", line_number, ": data before LUT_3D_SIZE");
+            TORCH_CHECK(count < (int64_t)dim * dim * dim, path, ":", line_number, ": more than ", dim, "^3 data lines");
+            float rgb[3];
+            TORCH_CHECK(lut_cube_floats(s, rgb, 3), path, ":", line_number, ": expected three values");
+
+            const int64_t shift = (int64_t)dim * dim * dim;
+            const int64_t r = count % dim;
+            const int64_t g = count / dim % dim;
+            const int64_t b = count / ((int64_t)dim * dim);
+            const int64_t node = (r * dim + g) * dim + b;
+            data[node] = rgb[0];
+            data[node + shift] = rgb[1];
+            data[node + shift * 2] = rgb[2];
+            ++count;
+            continue;
+        }
+
+        const size_t key_end = line.find_first_of(" \t\r", start);
+        const std::string key = line.substr(start, key_end == std::string::npos ? std::string::npos : key_end - start);
+        const char *args = line.c_str() + (key_end == std::string::npos ? line.size() : key_end);
+
+        if (key == "TITLE")
+        {
+            const size_t open = line.find('"');
+            const size_t close = line.rfind('"');
+            title = open != std::string::npos && close > open ? line.substr(open + 1, close - open - 1) : std::string(args);
+        }
+        else if (key == "LUT_3D_SIZE")
+        {
+            TORCH_CHECK(dim == 0, path, ":", line_number, ": LUT_3D_SIZE given twice");
+            dim = std::atoi(args);
+            TORCH_CHECK(dim >= 2 && dim <= 256, path, ":", line_number, ": unsupported LUT_3D_SIZE ", dim);
+            lut = torch::empty({3, dim, dim, dim}, torch::kFloat);
+            data = lut.data_ptr<float>();
+        }
+        else if (key == "LUT_1D_SIZE")
+            TORCH_CHECK(false, path, ": 1D .cube LUTs are not supported");
+        else if (key == "DOMAIN_MIN")
+            TORCH_CHECK(lut_cube_floats(args, domain_min, 3), path, ":", line_number, ": DOMAIN_MIN needs three values");
+        else if (key == "DOMAIN_MAX")
+            TORCH_CHECK(lut_cube_floats(args, domain_max, 3), path, ":", line_number, ": DOMAIN_MAX needs three values");
+        else if (key == "LUT_3D_INPUT_RANGE")
+        {
+            float range[2];
+            TORCH_CHECK(lut_cube_floats(args, range, 2), path, ":", line_number, ": LUT_3D_INPUT_RANGE needs two values");
+            for (int c = 0; c < 3; ++c)
+            {
+                domain_min[c] = range[0];
+                domain_max[c] = range[1];
+            }
+        }
+        // Other keywords (LUT_IN_VIDEO_RANGE, ...) do not change the table.
+    }
+
+    TORCH_CHECK(dim > 0, path, ": no LUT_3D_SIZE");
+    TORCH_CHECK(count == (int64_t)dim * dim * dim, path, ": ", count, " data lines, expected ", (int64_t)dim * dim * dim);
+    return LutFile(lut, lut_cube_domain(domain_min, domain_max), title);
+}
+
+inline int lut_write_cube(torch::Tensor lut, torch::Tensor domain, const std::string &title, const std::string &path)
+{
+    TORCH_CHECK(lut.dim() == 4 && lut.size(0) == 3, "LUT must be [3, dim, dim, dim]");
+    TORCH_CHECK(domain.numel() == 6, "domain must be [2, 3]");
+    const torch::Tensor values = lut.to(torch::kFloat).contiguous();
+    const torch::Tensor bounds = domain.to(torch::kFloat).contiguous();
+    const float *data = values.data_ptr<float>();
+    const float *d = bounds.data_ptr<float>();
+    const int dim = lut.size(3);
+    const int64_t shift = (int64_t)dim * dim * dim;
+
+    FILE *file = std::fopen(path.c_str(), "wb");
+    TORCH_CHECK(file != nullptr, "cannot create ", path);
+
+    std::string quoted = title;
+    quoted.erase(std::remove(quoted.begin(), quoted.end(), '"'), quoted.end());
+    std::fprintf(file, "TITLE \"%s\"\n\nLUT_3D_SIZE %d\n\n", quoted.c_str(), dim);
+    std::fprintf(file, "DOMAIN_MIN %.6f %.6f %.6f\nDOMAIN_MAX %.6f %.6f %.6f\n\n", d[0], d[1], d[2], d[3], d[4], d[5]);
+    for (int b = 0; b < dim; ++b)
+        for (int g = 0; g < dim; ++g)
+            for (int r = 0; r < dim; ++r)
+            {
+                const int64_t node = ((int64_t)r * dim + g) * dim + b;
+                std::fprintf(file, "%.6f %.6f %.6f\n", data[node], data[node + shift], data[node + shift * 2]);
+            }
+
+    const bool ok = std::ferror(file) == 0;
+    TORCH_CHECK(std::fclose(file) == 0 && ok, "error writing ", path);
+    return 1;
+}
+
+// Binary cache: a 256-byte header followed by the float32 [3][dim][dim][dim]
+// table. The mapping starts on a page, so the table is 256-byte aligned in it
+// and used in place.
+#define LUT_BINARY_MAGIC "LUT3DBIN"
+#define LUT_BINARY_VERSION 1
+
+struct LutBinaryHeader
+{
+    char magic[8];
+    int32_t version;
+    int32_t dim;
+    float domain_min[3];
+    float domain_max[3];
+    char title[216];
+};
+
+static_assert(sizeof(LutBinaryHeader) == 256, "LUT binary header must be 256 bytes");
+
+inline bool lut_binary_header_valid(const LutBinaryHeader &header)
+{
+    return std::memcmp(header.magic, LUT_BINARY_MAGIC, 8) == 0 && header.version == LUT_BINARY_VERSION &&
+           header.dim >= 2 && header.dim <= 256;
+}
+
+// The file is written under a temporary name in the same directory and then
+// renamed over path. Data-loader workers doing their first load at the same
+// time therefore see either no cache, the previous file or the complete new
+// one, never a truncated file, and existing mappings of the previous file
+// stay valid.
+inline int lut_save_binary(torch::Tensor lut, torch::Tensor domain, const std::string &title, const std::string &path)
+{
+    TORCH_CHECK(lut.dim() == 4 && lut.size(0) == 3, "LUT must be [3, dim, dim, dim]");
+    TORCH_CHECK(domain.numel() == 6, "domain must be [2, 3]");
+    const torch::Tensor values = lut.to(torch::kFloat).contiguous();
+    const torch::Tensor bounds = domain.to(torch::kFloat).contiguous();
+
+    LutBinaryHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, LUT_BINARY_MAGIC, 8);
+    header.version = LUT_BINARY_VERSION;
+    header.dim = lut.size(3);
+    std::memcpy(header.domain_min, bounds.data_ptr<float>(), sizeof(header.domain_min));
+    std::memcpy(header.domain_max, bounds.data_ptr<float>() + 3, sizeof(header.domain_max));
+    std::strncpy(header.title, title.c_str(), sizeof(header.title) - 1);
+
+#if LUT_HAVE_MMAP
+    std::string temp = path + ".XXXXXX";
+    const int fd = ::mkstemp(&temp[0]);
+    TORCH_CHECK(fd >= 0, "cannot create a temporary file for ", path);
+    ::fchmod(fd, 0644);
+    FILE *file = ::fdopen(fd, "wb");
+    if (file == nullptr)
+        ::close(fd);
+#else
+    const std::string temp = path + ".tmp";
+    FILE *file = std::fopen(temp.c_str(), "wb");
+#endif
+    if (file == nullptr)
+        std::remove(temp.c_str());
+    TORCH_CHECK(file != nullptr, "cannot create ", temp);
+
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && std::fwrite(values.data_ptr<float>(), sizeof(float), values.numel(), file) == (size_t)values.numel();
+    ok = std::fclose(file) == 0 && ok;
+#if !LUT_HAVE_MMAP
+    // rename() does not replace an existing file here; nothing maps it.
+    std::remove(path.c_str());
+#endif
+    ok = ok && std::rename(temp.c_str(), path.c_str()) == 0;
+    if (!ok)
+        std::remove(temp.c_str());
+    TORCH_CHECK(ok, "error writing ", path);
+    return 1;
+}
+
+// Maps the file copy-on-write and wraps the table as a tensor without copying
+// it; the mapping is released with the last reference to the tensor. Writes
+// to the tensor stay private to the process. The header and the table are
+// read through one open file, so they always come from the same version of a
+// cache that lut_save_binary replaces concurrently.
+inline LutFile lut_load_binary(const std::string &path)
+{
+    LutBinaryHeader header;
+#if LUT_HAVE_MMAP
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    TORCH_CHECK(fd >= 0, "cannot open ", path);
+    const bool valid = ::pread(fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header) && lut_binary_header_valid(header);
+    if (!valid)
+        ::close(fd);
+#else
+    FILE *file = std::fopen(path.c_str(), "rb");
+    TORCH_CHECK(file != nullptr, "cannot open ", path);
+    const bool valid = std::fread(&header, sizeof(header), 1, file) == 1 && lut_binary_header_valid(header);
+    if (!valid)
+        std::fclose(file);
+#endif
+    TORCH_CHECK(valid, path, " is not a LUT binary of version ", LUT_BINARY_VERSION);
+
+    const int dim = header.dim;
+    const int64_t count = (int64_t)dim * dim * dim * 3;
+    const size_t bytes = sizeof(header) + count * sizeof(float);
+    header.title[sizeof(header.title) - 1] = 0;
+    torch::Tensor domain = lut_cube_domain(header.domain_min, header.domain_max);
+
+#if LUT_HAVE_MMAP
+    struct stat st;
+    const bool sized = ::fstat(fd, &st) == 0 && (size_t)st.st_size >= bytes;
+    void *map = sized ? ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    TORCH_CHECK(sized, path, " is truncated");
+    TORCH_CHECK(map != MAP_FAILED, "cannot map ", path);
+
+    float *data = reinterpret_cast<float *>(static_cast<char *>(map) + sizeof(header));
+    torch::Tensor lut = torch::from_blob(data, {3, dim, dim, dim}, [map, bytes](void *)
+                                         { ::munmap(map, bytes); },
+                                         torch::kFloat);
+#else
+    torch::Tensor lut = torch::empty({3, dim, dim, dim}, torch::kFloat);
+    const bool read = std::fread(lut.data_ptr<float>(), sizeof(float), count, file) == (size_t)count;
+    std::fclose(file);
+    TORCH_CHECK(read, path, " is truncated");
+#endif
+    return LutFile(lut, domain, std::string(header.title));
+}
+
+#endif
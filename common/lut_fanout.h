@@ -0,0 +1,163 @@
+#ifndef LUT_FANOUT_H
+#define LUT_FANOUT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+#include "lut_cpu.h"
+#include "lut_image.h"
+#include "lut_parallel.h"
+
+// Pixels per chunk of a row in the fan-out forward. The cells of a chunk stay
+// in L1 while every LUT is evaluated on them.
+#define LUT_FANOUT_CHUNK 256
+
+// Size of the LUTs evaluated together on a tile of rows, about half of a
+// typical L2.
+#ifndef LUT_FANOUT_GROUP_BYTES
+#define LUT_FANOUT_GROUP_BYTES (1 << 20)
+#endif
+
+// Nodes and weights of the cells of one chunk, one array per corner, so that
+// the blend below reads them as vectors.
+template <typename scalar_t, int n>
+struct LutFanoutCells
+{
+    int id[n][LUT_FANOUT_CHUNK];
+    scalar_t w[n][LUT_FANOUT_CHUNK];
+};
+
+// out[i] = w[0][i] * plane[id[0][i]] + ... + w[n-1][i] * plane[id[n-1][i]],
+// summed in corner order like the forward kernels, for the pixels [begin, end).
+template <typename scalar_t, int n>
+inline void lut_fanout_blend_scalar(const LutFanoutCells<scalar_t, n> &cells, const scalar_t *plane, scalar_t *out, const int begin, const int end)
+{
+    for (int i = begin; i < end; ++i)
+    {
+        scalar_t v = cells.w[0][i] * plane[cells.id[0][i]];
+        for (int k = 1; k < n; ++k)
+            v += cells.w[k][i] * plane[cells.id[k][i]];
+        out[i] = v;
+    }
+}
+
+#if LUT_HAVE_X86_SIMD
+// AVX2 version, 8 pixels per gather. The lanes perform the scalar operations
+// in the same order, so results are identical.
+template <int n>
+LUT_TARGET_AVX2 static int lut_fanout_blend_avx2(const LutFanoutCells<float, n> &cells, const float *plane, float *out, const int count)
+{
+    int i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 v = _mm256_mul_ps(_mm256_loadu_ps(cells.w[0] + i),
+                                 _mm256_i32gather_ps(plane, _mm256_loadu_si256((const __m256i *)(cells.id[0] + i)), 4));
+        for (int k = 1; k < n; ++k)
+            v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_loadu_ps(cells.w[k] + i),
+                                               _mm256_i32gather_ps(plane, _mm256_loadu_si256((const __m256i *)(cells.id[k] + i)), 4)));
+        _mm256_storeu_ps(out + i, v);
+    }
+    return i;
+}
+#endif
+
+template <typename scalar_t, int n>
+inline void lut_fanout_blend(const LutFanoutCells<scalar_t, n> &cells, const scalar_t *plane, scalar_t *out, const int count)
+{
+    lut_fanout_blend_scalar(cells, plane, out, 0, count);
+}
+
+template <>
+inline void lut_fanout_blend<float, 8>(const LutFanoutCells<float, 8> &cells, const float *plane, float *out, const int count)
+{
+    int i = 0;
+#if LUT_HAVE_X86_SIMD
+    static const bool avx2 = lut_detect_isa() >= LUT_ISA_AVX2;
+    if (avx2)
+        i = lut_fanout_blend_avx2(cells, plane, out, count);
+#endif
+    lut_fanout_blend_scalar(cells, plane, out, i, count);
+}
+
+template <>
+inline void lut_fanout_blend<float, 4>(const LutFanoutCells<float, 4> &cells, const float *plane, float *out, const int count)
+{
+    int i = 0;
+#if LUT_HAVE_X86_SIMD
+    static const bool avx2 = lut_detect_isa() >= LUT_ISA_AVX2;
+    if (avx2)
+        i = lut_fanout_blend_avx2(cells, plane, out, count);
+#endif
+    lut_fanout_blend_scalar(cells, plane, out, i, count);
+}
+
+// Stores one cell (TrilinearCell or TetrahedralCell) as pixel i of a chunk.
+template <typename scalar_t, int n, typename Cell>
+inline void lut_fanout_store_cell(LutFanoutCells<scalar_t, n> &cells, const int i, const Cell &cell)
+{
+    for (int k = 0; k < n; ++k)
+    {
+        cells.id[k][i] = cell.id[k];
+        cells.w[k][i] = cell.w[k];
+    }
+}
+
+// One image through count LUTs of the same dim ([count][3][dim][dim][dim]),
+// e.g. a preview per creative LUT. The pixels of a chunk are read and
+// converted once, cells_fn(row, n, cells) finds their cells (nodes and
+// weights with `corners` corners) from the planar [3][n] row, and every LUT of
+// a group is then evaluated on them by lut_fanout_blend, so only the node
+// reads are repeated per LUT. A group holds about LUT_FANOUT_GROUP_BYTES of
+// LUTs and runs over a whole tile of rows before the next one starts, so its
+// nodes stay in L2 instead of every LUT being streamed in again for each
+// chunk. Output k starts at output + k * output_stride and has output_layout;
+// it is bit-identical to a forward call with LUT k.
+template <typename scalar_t, int corners, typename pixel_t, typename F>
+inline void lut_fanout_forward(const scalar_t *luts, const int count, const int dim, const pixel_t *image, pixel_t *output,
+                               const LutImageLayout &image_layout, const LutImageLayout &output_layout, const int64_t output_stride,
+                               const int width, const int height, const int batch, const F &cells_fn)
+{
+    const int shift = dim * dim * dim;
+    const int group = std::max<int64_t>(1, LUT_FANOUT_GROUP_BYTES / ((int64_t)shift * 3 * sizeof(scalar_t)));
+
+    const int64_t rows = (int64_t)batch * height;
+    const int64_t grain = std::max<int64_t>(1, LUT_PARALLEL_GRAIN_PIXELS / std::max(width, 1));
+
+    at::parallel_for(0, rows, grain, [&](int64_t begin, int64_t end)
+    {
+        thread_local std::vector<LutFanoutCells<scalar_t, corners>> storage(1);
+        LutFanoutCells<scalar_t, corners> &cells = storage[0];
+        scalar_t *row = lut_row_buffer<scalar_t>(LUT_FANOUT_CHUNK);
+
+        for (int first = 0; first < count; first += group)
+        {
+            const int last = std::min(count, first + group);
+            for (int64_t r = begin; r < end; ++r)
+            {
+                const int batch_index = r / height;
+                const int h = r % height;
+                const pixel_t *in = image + image_layout.offset(batch_index, 0, h, 0);
+
+                for (int w0 = 0; w0 < width; w0 += LUT_FANOUT_CHUNK)
+                {
+                    const int n = std::min(LUT_FANOUT_CHUNK, width - w0);
+                    for (int c = 0; c < 3; ++c)
+                        for (int i = 0; i < n; ++i)
+                            row[c * n + i] = LutPixel<pixel_t>::template load<scalar_t>(in[c * image_layout.channel + (w0 + i) * image_layout.col]);
+                    cells_fn((const scalar_t *)row, n, cells);
+
+                    for (int k = first; k < last; ++k)
+                    {
+                        const scalar_t *lut = luts + (int64_t)k * shift * 3;
+                        for (int c = 0; c < 3; ++c)
+                            lut_fanout_blend(cells, lut + shift * c, row + n * (c + 3), n);
+                        lut_store_row(row + n * 3, output + k * output_stride + output_layout.offset(batch_index, 0, h, w0), output_layout, n);
+                    }
+                }
+            }
+        }
+    });
+}
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef LUT_HOST_H
+#define LUT_HOST_H
+
+#include <torch/extension.h>
+#include "lut_cube.h"
+#include "lut_loss.h"
+#include "lut_shard.h"
+
+// Lut3D.lut_loss / Lut1D.lut_loss and their gradient (lut_loss.h). The same
+// for both interpolation modes; CUDA tensors are left to the torch expression.
+inline double lut_regularizer_op(torch::Tensor lut, torch::Tensor lut_grad, int channels, int lut_dim, int ndim,
+                                 double mn_weight, double tv_weight)
+{
+    TORCH_CHECK(!lut.is_cuda(), "regularizer runs on CPU tensors");
+    TORCH_CHECK(ndim == 1 || ndim == 3, "ndim must be 1 or 3");
+    TORCH_CHECK(lut_dim >= 2, "lut_dim must be at least 2");
+
+    double loss = 0;
+    AT_DISPATCH_FLOATING_TYPES(lut.scalar_type(), "lut_regularizer_cpp",
+                               ([&]
+                                { loss = lut_regularizer<scalar_t>(
+                                      lut.data_ptr<scalar_t>(),
+                                      lut_grad.data_ptr<scalar_t>(),
+                                      channels, lut_dim, ndim, mn_weight, tv_weight); }));
+
+    return loss;
+}
+
+// Operators that run on the host in every build: reading and writing LUT
+// files, writing and loading training shards, and the LUT regularizer. Both
+// the CPU and the CUDA extension of each module register them through
+// lut_def_host_ops, so load_cube / save_cube, the training data path and
+// lut_loss work on any install, whichever interpolation kernels were
+// compiled. On a CUDA build the shard loader can also pin its batch ring.
+inline void lut_def_host_ops(py::module &m)
+{
+    m.def("read_cube", &lut_read_cube, "Read a .cube file into a [3, dim, dim, dim] LUT");
+    m.def("write_cube", &lut_write_cube, "Write a [3, dim, dim, dim] LUT as a .cube file");
+    m.def("save_binary", &lut_save_binary, "Write a LUT to the binary cache format");
+    m.def("load_binary", &lut_load_binary, "Map a LUT from the binary cache format without copying");
+    m.def("regularizer", &lut_regularizer_op, "Range, monotonicity and smoothness penalty of a LUT and its gradient in one pass");
+    m.def("write_shard", &lut_write_shard, "Write input / target pairs as a uint8 or uint16 training shard");
+    py::class_<LutShardLoader>(m, "ShardLoader")
+        .def(py::init<const std::vector<std::string> &, int, bool, bool, bool, int, int, bool, int64_t>())
+        .def("start_epoch", &LutShardLoader::start_epoch, "Shuffle and start prefetching the batches of an epoch")
+        .def("next", &LutShardLoader::next, "Next (input, target) batch, valid until the following call")
+        .def("size", &LutShardLoader::size, "Number of pairs")
+        .def("batches", &LutShardLoader::batches, "Number of batches per epoch");
+}
+
+#endif
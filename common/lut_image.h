@@ -0,0 +1,172 @@
+#ifndef LUT_IMAGE_H
+#define LUT_IMAGE_H
+
+#include <torch/extension.h>
+#if __has_include(<torch/version.h>)
+#include <torch/version.h>
+#endif
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+#include "lut_parallel.h"
+
+// Element strides of a [batch, 3, height, width] image tensor. Planar NCHW
+// images have col == 1 and channel == height * width; channels-last (NHWC,
+// interleaved RGB) images have channel == 1 and col == 3. The kernels address
+// pixels only through these, so any strided view works without a copy.
+struct LutImageLayout
+{
+    int64_t batch;
+    int64_t channel;
+    int64_t row;
+    int64_t col;
+
+    int64_t offset(const int b, const int c, const int h, const int w) const
+    {
+        return b * batch + c * channel + h * row + w * col;
+    }
+};
+
+inline LutImageLayout lut_image_layout(const torch::Tensor &image)
+{
+    return {image.stride(0), image.stride(1), image.stride(2), image.stride(3)};
+}
+
+// torch.uint16 tensors exist from PyTorch 2.3 on.
+#if defined(TORCH_VERSION_MAJOR) && (TORCH_VERSION_MAJOR > 2 || (TORCH_VERSION_MAJOR == 2 && TORCH_VERSION_MINOR >= 3))
+#define LUT_WITH_UINT16
+#endif
+
+// Conversion between stored pixels and the [0, 1] values the kernels work on.
+// Floating-point pixels are used as is. uint8 and uint16 pixels are divided
+// by their maximum exactly like `img.astype(np.float32) / 255.` and rounded
+// back to the nearest integer, so integer outputs are the float results
+// rounded.
+template <typename pixel_t>
+struct LutPixel
+{
+    template <typename scalar_t>
+    static scalar_t load(const pixel_t v) { return v; }
+
+    template <typename scalar_t>
+    static pixel_t store(const scalar_t v) { return v; }
+};
+
+template <typename pixel_t, int maxval>
+struct LutIntegerPixel
+{
+    template <typename scalar_t>
+    static scalar_t load(const pixel_t v) { return (scalar_t)v / maxval; }
+
+    template <typename scalar_t>
+    static pixel_t store(const scalar_t v)
+    {
+        scalar_t p = v * maxval + (scalar_t)0.5;
+        p = p > 0 ? p : 0;
+        p = p < maxval ? p : maxval;
+        return (pixel_t)p;
+    }
+};
+
+template <>
+struct LutPixel<uint8_t> : LutIntegerPixel<uint8_t, 255>
+{
+};
+
+template <>
+struct LutPixel<uint16_t> : LutIntegerPixel<uint16_t, 65535>
+{
+};
+
+// Calls fn(image_pixels, output_pixels) with the pixel type of the image:
+// scalar_t for floating-point images, uint8_t for kByte and uint16_t for
+// kUInt16 tensors. int16 images are rejected rather than read as uint16: a
+// signed tensor may hold negative samples, and 16-bit images need an explicit
+// torch.uint16 tensor.
+template <typename scalar_t, typename F>
+inline void lut_dispatch_pixels(const torch::Tensor &image, const torch::Tensor &output, const F &fn)
+{
+    switch (image.scalar_type())
+    {
+    case at::kByte:
+        fn(image.data_ptr<uint8_t>(), output.data_ptr<uint8_t>());
+        break;
+#ifdef LUT_WITH_UINT16
+    case at::kUInt16:
+        fn(static_cast<const uint16_t *>(image.data_ptr()), static_cast<uint16_t *>(output.data_ptr()));
+        break;
+#endif
+    case at::kShort:
+        TORCH_CHECK(false, "int16 images are signed, pass 16-bit images as a torch.uint16 tensor (PyTorch >= 2.3)");
+        break;
+    default:
+        fn(image.data_ptr<scalar_t>(), output.data_ptr<scalar_t>());
+    }
+}
+
+// Per-thread [2][3][width] staging buffer: input row, then output row.
+template <typename scalar_t>
+inline scalar_t *lut_row_buffer(const int width)
+{
+    thread_local std::vector<scalar_t> buffer;
+    if (buffer.size() < (size_t)width * 6)
+        buffer.resize((size_t)width * 6);
+    return buffer.data();
+}
+
+// Writes a planar [3][width] row to the image row starting at output.
+template <typename scalar_t, typename pixel_t>
+inline void lut_store_row(const scalar_t *row, pixel_t *output, const LutImageLayout &layout, const int width)
+{
+    for (int c = 0; c < 3; ++c)
+        for (int w = 0; w < width; ++w)
+            output[c * layout.channel + w * layout.col] = LutPixel<pixel_t>::template store<scalar_t>(row[c * width + w]);
+}
+
+// Runs fn(batch_index, in, out, plane) on every image row as a planar scalar_t
+// row: the R values of the row's pixels are consecutive and the G and B values
+// follow at plane and 2 * plane. Rows that already are planar scalar_t data in
+// both tensors are passed in place. Interleaved rows and integer pixels are
+// staged through a [3][width] buffer that stays in cache, so one set of row
+// kernels serves every layout and pixel type and only the caller's pixels
+// travel through memory.
+template <typename scalar_t, typename pixel_t, typename F>
+inline void lut_forward_rows_indexed(const pixel_t *image, pixel_t *output, const LutImageLayout &image_layout, const LutImageLayout &output_layout,
+                                     const int batch, const int height, const int width, const F &fn)
+{
+    const bool in_place = std::is_same<scalar_t, pixel_t>::value && image_layout.col == 1 && output_layout.col == 1 &&
+                          image_layout.channel == output_layout.channel;
+
+    lut_parallel_rows(batch, height, width, [&](const int batch_index, const int h)
+    {
+        const pixel_t *in = image + image_layout.offset(batch_index, 0, h, 0);
+        pixel_t *out = output + output_layout.offset(batch_index, 0, h, 0);
+        if (in_place)
+        {
+            fn(batch_index, reinterpret_cast<const scalar_t *>(in), reinterpret_cast<scalar_t *>(out), image_layout.channel);
+            return;
+        }
+
+        scalar_t *row = lut_row_buffer<scalar_t>(width);
+        for (int c = 0; c < 3; ++c)
+            for (int w = 0; w < width; ++w)
+                row[c * width + w] = LutPixel<pixel_t>::template load<scalar_t>(in[c * image_layout.channel + w * image_layout.col]);
+
+        fn(batch_index, row, row + width * 3, width);
+        lut_store_row(row + width * 3, out, output_layout, width);
+    });
+}
+
+// Same as lut_forward_rows_indexed for kernels that apply one LUT to every
+// sample: fn(in, out, plane).
+template <typename scalar_t, typename pixel_t, typename F>
+inline void lut_forward_rows(const pixel_t *image, pixel_t *output, const LutImageLayout &image_layout, const LutImageLayout &output_layout,
+                             const int batch, const int height, const int width, const F &fn)
+{
+    lut_forward_rows_indexed<scalar_t>(image, output, image_layout, output_layout, batch, height, width, [&](const int, const scalar_t *in, scalar_t *out, const int64_t plane)
+    {
+        fn(in, out, plane);
+    });
+}
+
+#endif
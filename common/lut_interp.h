@@ -0,0 +1,229 @@
+#ifndef LUT_INTERP_H
+#define LUT_INTERP_H
+
+#include <algorithm>
+#include <cmath>
+
+// Lattice nodes and weights of the cell that trilinearly interpolates one
+// colour, in the order 000, 100, 010, 110, 001, 101, 011, 111. id[] are node
+// indices into one [dim][dim][dim] plane of the LUT, d[] the fractional
+// position of the colour inside the cell along r, g and b.
+template <typename scalar_t>
+struct TrilinearCell
+{
+    int id[8];
+    scalar_t w[8];
+    scalar_t d[3];
+};
+
+// Same arithmetic as the body of TriLinearForwardCpu, so kernels built on it
+// give bit-identical results.
+template <typename scalar_t>
+inline TrilinearCell<scalar_t> trilinear_cell(const scalar_t r, const scalar_t g, const scalar_t b, const int dim)
+{
+    scalar_t r_loc = r * (dim - 1);
+    scalar_t g_loc = g * (dim - 1);
+    scalar_t b_loc = b * (dim - 1);
+
+    int r_0 = floor(r_loc);
+    int g_0 = floor(g_loc);
+    int b_0 = floor(b_loc);
+    int r_1 = std::min(std::max(r_0 + 1, 0), dim - 1);
+    int g_1 = std::min(std::max(g_0 + 1, 0), dim - 1);
+    int b_1 = std::min(std::max(b_0 + 1, 0), dim - 1);
+    r_0 = std::min(std::max(r_0, 0), dim - 1);
+    g_0 = std::min(std::max(g_0, 0), dim - 1);
+    b_0 = std::min(std::max(b_0, 0), dim - 1);
+
+    scalar_t r_d = r_loc - r_0;
+    scalar_t g_d = g_loc - g_0;
+    scalar_t b_d = b_loc - b_0;
+
+    TrilinearCell<scalar_t> cell;
+    cell.d[0] = r_d;
+    cell.d[1] = g_d;
+    cell.d[2] = b_d;
+    cell.w[0] = (1 - r_d) * (1 - g_d) * (1 - b_d);
+    cell.w[1] = r_d * (1 - g_d) * (1 - b_d);
+    cell.w[2] = (1 - r_d) * g_d * (1 - b_d);
+    cell.w[3] = r_d * g_d * (1 - b_d);
+    cell.w[4] = (1 - r_d) * (1 - g_d) * b_d;
+    cell.w[5] = r_d * (1 - g_d) * b_d;
+    cell.w[6] = (1 - r_d) * g_d * b_d;
+    cell.w[7] = r_d * g_d * b_d;
+
+    cell.id[0] = (r_0 * dim + g_0) * dim + b_0;
+    cell.id[1] = (r_1 * dim + g_0) * dim + b_0;
+    cell.id[2] = (r_0 * dim + g_1) * dim + b_0;
+    cell.id[3] = (r_1 * dim + g_1) * dim + b_0;
+    cell.id[4] = (r_0 * dim + g_0) * dim + b_1;
+    cell.id[5] = (r_1 * dim + g_0) * dim + b_1;
+    cell.id[6] = (r_0 * dim + g_1) * dim + b_1;
+    cell.id[7] = (r_1 * dim + g_1) * dim + b_1;
+    return cell;
+}
+
+// Interpolates the three outputs of a [3][dim][dim][dim] LUT at a cell, with
+// the same sums as the trilinear forward kernels.
+template <typename scalar_t>
+inline void lut_cell_blend(const TrilinearCell<scalar_t> &cell, const scalar_t *lut, const int shift, scalar_t rgb[3])
+{
+    for (int c = 0; c < 3; ++c)
+    {
+        const scalar_t *plane = lut + shift * c;
+        rgb[c] = cell.w[0] * plane[cell.id[0]] + cell.w[1] * plane[cell.id[1]] +
+                 cell.w[2] * plane[cell.id[2]] + cell.w[3] * plane[cell.id[3]] +
+                 cell.w[4] * plane[cell.id[4]] + cell.w[5] * plane[cell.id[5]] +
+                 cell.w[6] * plane[cell.id[6]] + cell.w[7] * plane[cell.id[7]];
+    }
+}
+
+// Interpolates one colour from a [3][dim][dim][dim] LUT.
+template <typename scalar_t>
+inline void trilinear_sample(const scalar_t *lut, const int dim, const scalar_t r, const scalar_t g, const scalar_t b, scalar_t rgb[3])
+{
+    lut_cell_blend(trilinear_cell(r, g, b, dim), lut, dim * dim * dim, rgb);
+}
+
+// Derivatives of the value interpolated from one LUT plane with respect to
+// the r, g and b inputs (not the in-cell fractions, hence the dim - 1).
+template <typename scalar_t>
+inline void trilinear_slope(const TrilinearCell<scalar_t> &cell, const scalar_t *lut, const int dim, scalar_t slope[3])
+{
+    const scalar_t r_d = cell.d[0];
+    const scalar_t g_d = cell.d[1];
+    const scalar_t b_d = cell.d[2];
+    scalar_t v[8];
+    for (int k = 0; k < 8; ++k)
+        v[k] = lut[cell.id[k]];
+
+    slope[0] = ((1 - g_d) * (1 - b_d) * (v[1] - v[0]) + g_d * (1 - b_d) * (v[3] - v[2]) +
+                (1 - g_d) * b_d * (v[5] - v[4]) + g_d * b_d * (v[7] - v[6])) * (dim - 1);
+    slope[1] = ((1 - r_d) * (1 - b_d) * (v[2] - v[0]) + r_d * (1 - b_d) * (v[3] - v[1]) +
+                (1 - r_d) * b_d * (v[6] - v[4]) + r_d * b_d * (v[7] - v[5])) * (dim - 1);
+    slope[2] = ((1 - r_d) * (1 - g_d) * (v[4] - v[0]) + r_d * (1 - g_d) * (v[5] - v[1]) +
+                (1 - r_d) * g_d * (v[6] - v[2]) + r_d * g_d * (v[7] - v[3])) * (dim - 1);
+}
+
+// Lattice nodes and weights of the tetrahedron that interpolates one colour.
+// id[] are node indices into one [dim][dim][dim] plane of the LUT; the edge
+// from id[k] to id[k + 1] runs along input axis[k] (0 = r, 1 = g, 2 = b).
+template <typename scalar_t>
+struct TetrahedralCell
+{
+    int id[4];
+    scalar_t w[4];
+    int axis[3];
+};
+
+// Axis orders (largest fractional delta first) of the six cases of the
+// original if/else cascade, indexed by the bit mask of its five case
+// conditions: the lowest set bit is the first case that holds, and a zero mask
+// is the final else.
+static const int tetrahedral_orders[32][3] = {
+    {1, 0, 2}, {0, 1, 2}, {0, 2, 1}, {0, 1, 2}, {2, 0, 1}, {0, 1, 2}, {0, 2, 1}, {0, 1, 2},
+    {2, 1, 0}, {0, 1, 2}, {0, 2, 1}, {0, 1, 2}, {2, 0, 1}, {0, 1, 2}, {0, 2, 1}, {0, 1, 2},
+    {1, 2, 0}, {0, 1, 2}, {0, 2, 1}, {0, 1, 2}, {2, 0, 1}, {0, 1, 2}, {0, 2, 1}, {0, 1, 2},
+    {2, 1, 0}, {0, 1, 2}, {0, 2, 1}, {0, 1, 2}, {2, 0, 1}, {0, 1, 2}, {0, 2, 1}, {0, 1, 2}};
+
+// Finds the tetrahedron without the six-way if/else cascade. The cascade's
+// five conditions, with its > and <= comparisons, are evaluated without
+// branching and index a table of the axis order; the tetrahedron is then 000,
+// +step0, +step0+step1, 111 with weights 1 - d0, d0 - d1, d1 - d2, d2. Every
+// input, NaN included, lands in the case the cascade picked, and the weights
+// are the same expressions it evaluated, so forward and backward results are
+// bit-identical to it, with no branch to mispredict.
+template <typename scalar_t>
+inline TetrahedralCell<scalar_t> tetrahedral_cell(const scalar_t r, const scalar_t g, const scalar_t b, const int dim)
+{
+    scalar_t r_loc = r * (dim - 1);
+    scalar_t g_loc = g * (dim - 1);
+    scalar_t b_loc = b * (dim - 1);
+
+    int r_0 = floor(r_loc);
+    int g_0 = floor(g_loc);
+    int b_0 = floor(b_loc);
+    int r_1 = std::min(std::max(r_0 + 1, 0), dim - 1);
+    int g_1 = std::min(std::max(g_0 + 1, 0), dim - 1);
+    int b_1 = std::min(std::max(b_0 + 1, 0), dim - 1);
+    r_0 = std::min(std::max(r_0, 0), dim - 1);
+    g_0 = std::min(std::max(g_0, 0), dim - 1);
+    b_0 = std::min(std::max(b_0, 0), dim - 1);
+
+    const scalar_t d[3] = {r_loc - r_0, g_loc - g_0, b_loc - b_0};
+    const int step[3] = {(r_1 - r_0) * dim * dim, (g_1 - g_0) * dim, b_1 - b_0};
+
+    // The third condition, r_d > g_d && g_d <= b_d && r_d <= b_d, is only
+    // reached when the first two fail, where it reduces to b_d not being NaN.
+    const int r_gt_g = d[0] > d[1];
+    const int r_le_g = d[0] <= d[1];
+    const int mask = (r_gt_g & (d[1] > d[2])) |
+                     (r_gt_g & (d[0] > d[2])) << 1 |
+                     (r_gt_g & (d[2] == d[2])) << 2 |
+                     (r_le_g & (d[2] > d[1])) << 3 |
+                     (r_le_g & (d[2] > d[0])) << 4;
+    const int *order = tetrahedral_orders[mask];
+    const scalar_t d0 = d[order[0]];
+    const scalar_t d1 = d[order[1]];
+    const scalar_t d2 = d[order[2]];
+
+    TetrahedralCell<scalar_t> cell;
+    cell.axis[0] = order[0];
+    cell.axis[1] = order[1];
+    cell.axis[2] = order[2];
+    cell.id[0] = r_0 * dim * dim + g_0 * dim + b_0;
+    cell.id[1] = cell.id[0] + step[order[0]];
+    cell.id[2] = cell.id[1] + step[order[1]];
+    cell.id[3] = r_1 * dim * dim + g_1 * dim + b_1;
+    cell.w[0] = 1 - d0;
+    cell.w[1] = d0 - d1;
+    cell.w[2] = d1 - d2;
+    cell.w[3] = d2;
+    return cell;
+}
+
+// Tetrahedral counterpart of lut_cell_blend, with the same sums as the
+// tetrahedral forward kernels.
+template <typename scalar_t>
+inline void lut_cell_blend(const TetrahedralCell<scalar_t> &cell, const scalar_t *lut, const int shift, scalar_t rgb[3])
+{
+    for (int c = 0; c < 3; ++c)
+    {
+        const scalar_t *plane = lut + shift * c;
+        rgb[c] = cell.w[0] * plane[cell.id[0]] + cell.w[1] * plane[cell.id[1]] +
+                 cell.w[2] * plane[cell.id[2]] + cell.w[3] * plane[cell.id[3]];
+    }
+}
+
+// Interpolates one colour from a [3][dim][dim][dim] LUT.
+template <typename scalar_t>
+inline void tetrahedral_sample(const scalar_t *lut, const int dim, const scalar_t r, const scalar_t g, const scalar_t b, scalar_t rgb[3])
+{
+    lut_cell_blend(tetrahedral_cell(r, g, b, dim), lut, dim * dim * dim, rgb);
+}
+
+// Derivatives of the value interpolated from one LUT plane with respect to
+// the r, g and b inputs: along each edge of the tetrahedron the value changes
+// by the difference of the edge's end nodes.
+template <typename scalar_t>
+inline void tetrahedral_slope(const TetrahedralCell<scalar_t> &cell, const scalar_t *lut, const int dim, scalar_t slope[3])
+{
+    for (int k = 0; k < 3; ++k)
+        slope[cell.axis[k]] = (lut[cell.id[k + 1]] - lut[cell.id[k]]) * (dim - 1);
+}
+
+// Slope of one LUT plane at either kind of cell, for kernels written once for
+// both interpolations (see lut_cell_blend).
+template <typename scalar_t>
+inline void lut_cell_slope(const TrilinearCell<scalar_t> &cell, const scalar_t *lut, const int dim, scalar_t slope[3])
+{
+    trilinear_slope(cell, lut, dim, slope);
+}
+
+template <typename scalar_t>
+inline void lut_cell_slope(const TetrahedralCell<scalar_t> &cell, const scalar_t *lut, const int dim, scalar_t slope[3])
+{
+    tetrahedral_slope(cell, lut, dim, slope);
+}
+
+#endif
@@ -0,0 +1,275 @@
+#ifndef LUT_LAYOUT_H
+#define LUT_LAYOUT_H
+
+#include <ATen/Parallel.h>
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "lut_cpu.h"
+#include "lut_parallel.h"
+
+// Node-interleaved LUT layout [dim][dim][dim][4]: the R, G and B outputs of a
+// lattice node are stored next to each other, followed by one padding value.
+// In the planar [3][dim][dim][dim] layout a pixel touches each of its corners
+// in three planes that are dim^3 values apart; here the three channels of a
+// corner share one 16-byte block, and the b_0/b_1 corners are adjacent, so a
+// pixel reads about four cache lines instead of twelve. Node indices are the
+// same as in the planar layout, times LUT_NODE_STRIDE, so kernels reading
+// either layout use the same cells and weights and give identical results.
+#define LUT_NODE_STRIDE 4
+
+// Number of values in the packed form of a dim^3 LUT.
+inline int64_t lut_packed_size(const int dim)
+{
+    return (int64_t)dim * dim * dim * LUT_NODE_STRIDE;
+}
+
+template <typename scalar_t>
+inline void lut_pack_nodes(const scalar_t *lut, scalar_t *packed, const int dim)
+{
+    const int shift = dim * dim * dim;
+
+    at::parallel_for(0, shift, 4096, [&](int64_t begin, int64_t end)
+    {
+        for (int64_t i = begin; i < end; ++i)
+        {
+            packed[i * LUT_NODE_STRIDE] = lut[i];
+            packed[i * LUT_NODE_STRIDE + 1] = lut[i + shift];
+            packed[i * LUT_NODE_STRIDE + 2] = lut[i + shift * 2];
+            packed[i * LUT_NODE_STRIDE + 3] = 0;
+        }
+    });
+}
+
+// out[c] = w[0] * packed[id[0]][c] + ... + w[n-1] * packed[id[n-1]][c] for
+// the three channels, summed in corner order like the planar kernels.
+template <typename scalar_t, int n>
+inline void lut_node_blend_scalar(const scalar_t *packed, const int *id, const scalar_t *w, scalar_t *out)
+{
+    for (int c = 0; c < 3; ++c)
+    {
+        scalar_t v = w[0] * packed[id[0] * LUT_NODE_STRIDE + c];
+        for (int k = 1; k < n; ++k)
+            v += w[k] * packed[id[k] * LUT_NODE_STRIDE + c];
+        out[c] = v;
+    }
+}
+
+// packed[id[k]][c] += w[k] * g[c] for the n corners of a cell: the backward
+// scatter of one pixel into a node-interleaved gradient, with the same
+// operations on every value as the planar scatter.
+template <typename scalar_t, int n>
+inline void lut_node_scatter_scalar(scalar_t *packed, const int *id, const scalar_t *w, const scalar_t *g)
+{
+    for (int k = 0; k < n; ++k)
+        for (int c = 0; c < 3; ++c)
+            packed[id[k] * LUT_NODE_STRIDE + c] += w[k] * g[c];
+}
+
+template <typename scalar_t, int n>
+inline void lut_node_blend(const scalar_t *packed, const int *id, const scalar_t *w, scalar_t *out)
+{
+    lut_node_blend_scalar<scalar_t, n>(packed, id, w, out);
+}
+
+template <typename scalar_t, int n>
+inline void lut_node_scatter(scalar_t *packed, const int *id, const scalar_t *w, const scalar_t *g)
+{
+    lut_node_scatter_scalar<scalar_t, n>(packed, id, w, g);
+}
+
+#if LUT_HAVE_X86_SIMD
+// SSE version: one node (R, G, B, pad) per 4-wide multiply and add. Each lane
+// performs the scalar operations in the same order, so results are identical.
+// LUT_CPU_ISA=scalar selects the scalar loops, so that the comparison in
+// benchmark.py covers these too.
+inline bool lut_node_use_sse()
+{
+    static const bool sse = !lut_isa_forced_scalar();
+    return sse;
+}
+
+template <int n>
+inline void lut_node_blend_sse(const float *packed, const int *id, const float *w, float *out)
+{
+    __m128 v = _mm_mul_ps(_mm_set1_ps(w[0]), _mm_loadu_ps(packed + id[0] * LUT_NODE_STRIDE));
+    for (int k = 1; k < n; ++k)
+        v = _mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(w[k]), _mm_loadu_ps(packed + id[k] * LUT_NODE_STRIDE)));
+    alignas(16) float res[4];
+    _mm_store_ps(res, v);
+    out[0] = res[0];
+    out[1] = res[1];
+    out[2] = res[2];
+}
+
+template <>
+inline void lut_node_blend<float, 8>(const float *packed, const int *id, const float *w, float *out)
+{
+    if (lut_node_use_sse())
+        lut_node_blend_sse<8>(packed, id, w, out);
+    else
+        lut_node_blend_scalar<float, 8>(packed, id, w, out);
+}
+
+template <>
+inline void lut_node_blend<float, 4>(const float *packed, const int *id, const float *w, float *out)
+{
+    if (lut_node_use_sse())
+        lut_node_blend_sse<4>(packed, id, w, out);
+    else
+        lut_node_blend_scalar<float, 4>(packed, id, w, out);
+}
+
+// SSE scatter: the padding lane adds w[k] * 0 to the padding value.
+template <int n>
+inline void lut_node_scatter_sse(float *packed, const int *id, const float *w, const float *g)
+{
+    const __m128 gv = _mm_setr_ps(g[0], g[1], g[2], 0.f);
+    for (int k = 0; k < n; ++k)
+    {
+        float *node = packed + id[k] * LUT_NODE_STRIDE;
+        _mm_storeu_ps(node, _mm_add_ps(_mm_loadu_ps(node), _mm_mul_ps(_mm_set1_ps(w[k]), gv)));
+    }
+}
+
+template <>
+inline void lut_node_scatter<float, 8>(float *packed, const int *id, const float *w, const float *g)
+{
+    if (lut_node_use_sse())
+        lut_node_scatter_sse<8>(packed, id, w, g);
+    else
+        lut_node_scatter_scalar<float, 8>(packed, id, w, g);
+}
+
+template <>
+inline void lut_node_scatter<float, 4>(float *packed, const int *id, const float *w, const float *g)
+{
+    if (lut_node_use_sse())
+        lut_node_scatter_sse<4>(packed, id, w, g);
+    else
+        lut_node_scatter_scalar<float, 4>(packed, id, w, g);
+}
+#endif
+
+// Gradient buffer of one slice of lut_parallel_accumulate_luts: count
+// node-interleaved LUT gradients, LUT k at packed + k * lut_packed_size(dim).
+// When cells is set, the slice also lists the cells its pixels reached (see
+// lut_node_grad_cell), so that a sparse gradient can be read from the nodes
+// of those cells only; listed flags the ones already in the list.
+template <typename scalar_t>
+struct LutNodeGrad
+{
+    scalar_t *packed;
+    std::vector<int> *cells;
+    uint8_t *listed;
+};
+
+// Buffer to scatter a pixel of the cell with 000 node node into. Adds the cell
+// to the slice's list the first time it is reached.
+template <typename scalar_t>
+inline scalar_t *lut_node_grad_cell(LutNodeGrad<scalar_t> &grad, const int node)
+{
+    if (grad.cells != nullptr && !grad.listed[node])
+    {
+        grad.listed[node] = 1;
+        grad.cells->push_back(node);
+    }
+    return grad.packed;
+}
+
+// Single-LUT scatter of one pixel, see lut_node_scatter.
+template <typename scalar_t, int n>
+inline void lut_node_grad_scatter(LutNodeGrad<scalar_t> &grad, const int *id, const scalar_t *w, const scalar_t *g)
+{
+    lut_node_scatter<scalar_t, n>(lut_node_grad_cell(grad, id[0]), id, w, g);
+}
+
+// Slice buffers filled by lut_node_slices: slices buffers of size values
+// each, and per slice the cells it reached when they were listed.
+template <typename scalar_t>
+struct LutNodeSlices
+{
+    int64_t slices = 0;
+    int64_t size = 0;
+    std::unique_ptr<scalar_t[]> packed;
+    std::vector<std::vector<int>> cells;
+};
+
+// Cuts the batch * height rows into the slices of lut_parallel_accumulate and
+// scatters every slice into a zeroed node-interleaved buffer of count LUT
+// gradients through fn(batch_index, h, grad). A pixel then updates n blocks of
+// four values instead of 3 * n values spread over three planes. With
+// list_cells the slices also list the cells they reach.
+template <typename scalar_t, typename F>
+inline LutNodeSlices<scalar_t> lut_node_slices(const int dim, const int count, const bool list_cells, const int batch, const int height, const int width, const F &fn)
+{
+    const int64_t rows = (int64_t)batch * height;
+    LutNodeSlices<scalar_t> slices;
+    slices.size = lut_packed_size(dim) * count;
+    slices.slices = lut_grad_slices(slices.size * (int64_t)sizeof(scalar_t), batch, height, width);
+    slices.packed.reset(new scalar_t[slices.slices * slices.size]);
+    slices.cells.resize(list_cells ? slices.slices : 0);
+
+    at::parallel_for(0, slices.slices, 1, [&](int64_t begin, int64_t end)
+    {
+        // Cleared again below, so only the cells of one slice are ever set.
+        thread_local std::vector<uint8_t> listed;
+        if (list_cells)
+            listed.resize((size_t)dim * dim * dim, 0);
+
+        for (int64_t k = begin; k < end; ++k)
+        {
+            LutNodeGrad<scalar_t> grad = {slices.packed.get() + k * slices.size, list_cells ? &slices.cells[k] : nullptr, listed.data()};
+            std::fill(grad.packed, grad.packed + slices.size, scalar_t(0));
+            for (int64_t row = rows * k / slices.slices; row < rows * (k + 1) / slices.slices; ++row)
+                fn((int)(row / height), (int)(row % height), grad);
+            if (list_cells)
+                for (const int cell : slices.cells[k])
+                    listed[cell] = 0;
+        }
+    });
+    return slices;
+}
+
+// Accumulates the gradient of count [3][dim][dim][dim] LUTs stored one after
+// the other from the node-interleaved slice buffers of lut_node_slices. The
+// ordered reduction reads them in that layout and adds them into the planar
+// lut_grad, so no pass over the lattice packs or unpacks a buffer. Each value
+// receives the same additions in the same order as with planar slice buffers,
+// so the gradient is bit-identical to scattering into them.
+template <typename scalar_t, typename F>
+inline void lut_parallel_accumulate_luts(scalar_t *lut_grad, const int dim, const int count, const int batch, const int height, const int width, const F &fn)
+{
+    const int64_t shift = (int64_t)dim * dim * dim;
+    const int64_t packed_size = lut_packed_size(dim);
+    const LutNodeSlices<scalar_t> slices = lut_node_slices<scalar_t>(dim, count, false, batch, height, width, fn);
+
+    at::parallel_for(0, shift, 4096, [&](int64_t begin, int64_t end)
+    {
+        for (int l = 0; l < count; ++l)
+        {
+            for (int64_t i = begin; i < end; ++i)
+            {
+                const scalar_t *node = slices.packed.get() + l * packed_size + i * LUT_NODE_STRIDE;
+                for (int c = 0; c < 3; ++c)
+                {
+                    scalar_t &grad = lut_grad[(l * 3 + c) * shift + i];
+                    scalar_t acc = grad;
+                    for (int64_t k = 0; k < slices.slices; ++k)
+                        acc += node[k * slices.size + c];
+                    grad = acc;
+                }
+            }
+        }
+    });
+}
+
+// Single-LUT form of lut_parallel_accumulate_luts.
+template <typename scalar_t, typename F>
+inline void lut_parallel_accumulate_nodes(scalar_t *lut_grad, const int dim, const int batch, const int height, const int width, const F &fn)
+{
+    lut_parallel_accumulate_luts(lut_grad, dim, 1, batch, height, width, fn);
+}
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef LUT_LOSS_H
+#define LUT_LOSS_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "lut_image.h"
+#include "lut_interp.h"
+#include "lut_layout.h"
+#include "lut_parallel.h"
+#include "lut_sparse.h"
+
+// Loss of the interpolated image against a target, and its LUT gradient, in
+// one pass over the pixels. Per pixel the output is interpolated, compared
+// with the target and the loss gradient scattered into the LUT gradient right
+// away, so neither the output image nor its gradient is ever stored. With
+// N = batch * 3 * height * width and d = output - target:
+//
+//   L1: loss = sum |d| / N,  dL/doutput = sign(d) / N
+//   L2: loss = sum d^2 / N,  dL/doutput = 2 d / N
+//
+// i.e. the reduction='mean' semantics of torch.nn.L1Loss / MSELoss. Inputs
+// are clamped to [0, 1] first, as in Lut3D.forward. Per-row losses are summed
+// in double in row order, so the loss does not depend on the thread count.
+// The LUT gradient is added to lut_grad or, when sparse_grad is set, returned
+// in it over the nodes it reaches (see lut_sparse.h).
+#define LUT_LOSS_L1 1
+#define LUT_LOSS_L2 2
+
+template <typename scalar_t, int corners, typename F>
+inline double lut_loss_backward(const scalar_t *lut, const scalar_t *image, const scalar_t *target, scalar_t *lut_grad, LutSparseGrad<scalar_t> *sparse_grad,
+                                const LutImageLayout &image_layout, const LutImageLayout &target_layout, const int norm,
+                                const int dim, const int shift, const int width, const int height, const int batch, const F &cell_fn)
+{
+    const int64_t count = (int64_t)batch * height * width * 3;
+    const scalar_t scale = (scalar_t)(norm == LUT_LOSS_L1 ? 1 : 2) / count;
+    std::vector<double> row_loss((int64_t)batch * height);
+
+    lut_parallel_accumulate_grad(lut_grad, sparse_grad, dim, batch, height, width, [&](const int batch_index, const int h, LutNodeGrad<scalar_t> &grad)
+    {
+        double loss = 0;
+        for (int w = 0; w < width; ++w)
+        {
+            const int64_t index = image_layout.offset(batch_index, 0, h, w);
+            const int64_t target_index = target_layout.offset(batch_index, 0, h, w);
+            scalar_t x[3];
+            for (int c = 0; c < 3; ++c)
+                x[c] = std::min(std::max(image[index + c * image_layout.channel], scalar_t(0)), scalar_t(1));
+
+            const auto cell = cell_fn(x[0], x[1], x[2]);
+            scalar_t rgb[3];
+            lut_cell_blend(cell, lut, shift, rgb);
+
+            scalar_t g[3];
+            for (int c = 0; c < 3; ++c)
+            {
+                const scalar_t d = rgb[c] - target[target_index + c * target_layout.channel];
+                if (norm == LUT_LOSS_L1)
+                {
+                    loss += std::abs(d);
+                    g[c] = d > 0 ? scale : d < 0 ? -scale : scalar_t(0);
+                }
+                else
+                {
+                    loss += (double)d * d;
+                    g[c] = scale * d;
+                }
+            }
+            lut_node_grad_scatter<scalar_t, corners>(grad, cell.id, cell.w, g);
+        }
+        row_loss[(int64_t)batch_index * height + h] = loss;
+    });
+
+    double loss = 0;
+    for (const double l : row_loss)
+        loss += l;
+    return loss / count;
+}
+
+// Regularizer of Lut3D.lut_loss / Lut1D.lut_loss and its gradient in one pass
+// over the lattice. lut holds channels planes of dim^ndim nodes (ndim 3 for a
+// [3, dim, dim, dim] LUT, 1 for a [dim] or [3, dim] curve). With dx the
+// difference of a node and its next neighbour along one axis and M the
+// number of such differences per axis:
+//
+//   loss = sum min(v, 0)^2 + sum max(v - 1, 0)^2
+//        + sum over axes (mn_weight * sum relu(dx) + tv_weight * sum dx^2) / M
+//
+// which is less.sum() + upper.sum() + mn + tv of the Python code. Each node
+// gathers the gradient of the differences it takes part in from its
+// neighbours, so slices (one channel and one index of the slowest axis) are
+// written by one task each and need no private buffers. Per-slice losses are
+// summed in slice order. lut_grad is overwritten.
+template <typename scalar_t>
+inline double lut_regularizer(const scalar_t *lut, scalar_t *lut_grad, const int channels, const int dim, const int ndim,
+                              const double mn_weight, const double tv_weight)
+{
+    const int64_t plane = ndim == 3 ? (int64_t)dim * dim * dim : dim;
+    const int slices = ndim == 3 ? dim : 1;
+    const int rows = ndim == 3 ? dim : 1;
+    const int64_t count = (int64_t)channels * (dim - 1) * (plane / dim);
+    const scalar_t mn_scale = (scalar_t)(mn_weight / count);
+    const scalar_t tv_scale = (scalar_t)(2 * tv_weight / count);
+    const int64_t strides[3] = {1, dim, (int64_t)dim * dim};
+    std::vector<double> slice_range(channels * slices), slice_mn(channels * slices), slice_tv(channels * slices);
+
+    lut_parallel_rows(channels, slices, rows * dim, [&](const int c, const int k)
+    {
+        double range = 0, mn = 0, tv = 0;
+        for (int j = 0; j < rows; ++j)
+        {
+            // One row of nodes along the fastest axis; each term is its own
+            // loop over the row, summed in scalar_t so that the compiler can
+            // vectorize it, and the row sums are added up in double.
+            const int64_t p = c * plane + (int64_t)k * strides[2] + (int64_t)j * strides[1];
+            const scalar_t *v = lut + p;
+            scalar_t *g = lut_grad + p;
+            scalar_t row_range = 0, row_mn = 0, row_tv = 0;
+            for (int i = 0; i < dim; ++i)
+            {
+                const scalar_t out = std::min(v[i], scalar_t(0)) + std::max(v[i] - 1, scalar_t(0));
+                row_range += out * out;
+                g[i] = 2 * out;
+            }
+
+            // Differences with the next node along the row, and with the next
+            // and previous rows / slices for the other axes. Only the forward
+            // differences add to the loss, so every difference is counted once.
+            const int coord[3] = {0, j, k};
+            for (int a = 0; a < ndim; ++a)
+            {
+                const int64_t s = strides[a];
+                const int end = a == 0 ? dim - 1 : dim;
+                if (a == 0 || coord[a] < dim - 1)
+                {
+                    for (int i = 0; i < end; ++i)
+                    {
+                        const scalar_t dx = v[i] - v[i + s];
+                        row_mn += std::max(dx, scalar_t(0));
+                        row_tv += dx * dx;
+                        g[i] += (dx > 0 ? mn_scale : scalar_t(0)) + tv_scale * dx;
+                    }
+                }
+                if (a == 0 || coord[a] > 0)
+                {
+                    for (int i = a == 0 ? 1 : 0; i < dim; ++i)
+                    {
+                        const scalar_t dx = v[i - s] - v[i];
+                        g[i] -= (dx > 0 ? mn_scale : scalar_t(0)) + tv_scale * dx;
+                    }
+                }
+            }
+            range += row_range;
+            mn += row_mn;
+            tv += row_tv;
+        }
+        slice_range[c * slices + k] = range;
+        slice_mn[c * slices + k] = mn;
+        slice_tv[c * slices + k] = tv;
+    });
+
+    double range = 0, mn = 0, tv = 0;
+    for (int s = 0; s < channels * slices; ++s)
+    {
+        range += slice_range[s];
+        mn += slice_mn[s];
+        tv += slice_tv[s];
+    }
+    return range + (mn_weight * mn + tv_weight * tv) / count;
+}
+
+#endif
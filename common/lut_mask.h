@@ -0,0 +1,173 @@
+#ifndef LUT_MASK_H
+#define LUT_MASK_H
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "lut_fanout.h"
+#include "lut_image.h"
+#include "lut_interp.h"
+#include "lut_layout.h"
+#include "lut_parallel.h"
+
+// Spatially varying blends of n LUTs of the same dim, e.g. a skin or sky mask
+// choosing between two gradings. mask is a [batch][channels][height][width]
+// weight map with either one channel per LUT (weights w_k = mask_k), or one
+// channel fewer, in which case LUT 0 takes the rest (w_0 = 1 - sum mask_k,
+// w_k = mask_{k-1}): for two LUTs and a [batch, 1, h, w] mask m this is
+// (1 - m) * lut_0 + m * lut_1. Interpolation is linear in the LUT, so a pixel
+// interpolated against sum_k w_k lut_k is sum_k w_k interp(lut_k); the cell is
+// found once per pixel and each LUT adds its corners with the pixel's weight,
+// so the image is read and the output written once.
+//
+// For the backward pass, with g the output gradient of a pixel:
+//
+//   d lut_k  += w_k * g scattered over the cell, as in the backward kernels
+//   d mask_k  = <g, interp(lut_k)>        (or <g, interp(lut_k+1) - interp(lut_0)>)
+//   d image   = sum_k w_k * slope(lut_k)^T g
+template <typename scalar_t>
+inline void lut_mask_weights(const scalar_t *mask, const int64_t stride, const int n, const int channels, scalar_t *w)
+{
+    if (channels == n)
+    {
+        for (int k = 0; k < n; ++k)
+            w[k] = mask[k * stride];
+        return;
+    }
+
+    scalar_t rest = 1;
+    for (int k = 1; k < n; ++k)
+    {
+        w[k] = mask[(k - 1) * stride];
+        rest -= w[k];
+    }
+    w[0] = rest;
+}
+
+// The forward runs on chunks of a row like lut_fanout_forward: the cells of
+// the chunk are found once by cells_fn, each LUT is evaluated on them with
+// lut_fanout_blend and added with its per-pixel weight. A LUT whose weight is
+// zero over the whole chunk is skipped. The output equals
+// sum_k w_k * forward(lut_k) summed in LUT order.
+template <typename scalar_t, int corners, typename pixel_t, typename F>
+inline void lut_mask_forward(const scalar_t *luts, const int n, const scalar_t *mask, const int mask_channels, const pixel_t *image, pixel_t *output,
+                             const LutImageLayout &mask_layout, const LutImageLayout &image_layout, const LutImageLayout &output_layout,
+                             const int dim, const int width, const int height, const int batch, const F &cells_fn)
+{
+    const int shift = dim * dim * dim;
+
+    lut_parallel_rows(batch, height, width, [&](const int batch_index, const int h)
+    {
+        thread_local std::vector<LutFanoutCells<scalar_t, corners>> storage(1);
+        thread_local std::vector<scalar_t> buffer;
+        LutFanoutCells<scalar_t, corners> &cells = storage[0];
+        buffer.resize((size_t)LUT_FANOUT_CHUNK * (9 + n) + n);
+        scalar_t *row = buffer.data();
+        scalar_t *value = row + LUT_FANOUT_CHUNK * 3;
+        scalar_t *rgb = value + LUT_FANOUT_CHUNK * 3;
+        scalar_t *weights = rgb + LUT_FANOUT_CHUNK * 3;
+        scalar_t *w = weights + LUT_FANOUT_CHUNK * n;
+
+        const pixel_t *in = image + image_layout.offset(batch_index, 0, h, 0);
+        for (int w0 = 0; w0 < width; w0 += LUT_FANOUT_CHUNK)
+        {
+            const int count = std::min(LUT_FANOUT_CHUNK, width - w0);
+            for (int c = 0; c < 3; ++c)
+                for (int i = 0; i < count; ++i)
+                    row[c * count + i] = LutPixel<pixel_t>::template load<scalar_t>(in[c * image_layout.channel + (w0 + i) * image_layout.col]);
+            cells_fn((const scalar_t *)row, count, cells);
+
+            for (int i = 0; i < count; ++i)
+            {
+                lut_mask_weights(mask + mask_layout.offset(batch_index, 0, h, w0 + i), mask_layout.channel, n, mask_channels, w);
+                for (int k = 0; k < n; ++k)
+                    weights[k * LUT_FANOUT_CHUNK + i] = w[k];
+            }
+
+            std::fill(rgb, rgb + count * 3, scalar_t(0));
+            for (int k = 0; k < n; ++k)
+            {
+                const scalar_t *wk = weights + k * LUT_FANOUT_CHUNK;
+                if (std::all_of(wk, wk + count, [](const scalar_t v) { return v == 0; }))
+                    continue;
+
+                const scalar_t *lut = luts + (int64_t)k * shift * 3;
+                for (int c = 0; c < 3; ++c)
+                {
+                    lut_fanout_blend(cells, lut + shift * c, value + c * count, count);
+                    for (int i = 0; i < count; ++i)
+                        rgb[c * count + i] += wk[i] * value[c * count + i];
+                }
+            }
+            lut_store_row(rgb, output + output_layout.offset(batch_index, 0, h, w0), output_layout, count);
+        }
+    });
+}
+
+// mask_grad and input_grad may be null when they are not needed. The LUT
+// gradients are accumulated into luts_grad.
+template <typename scalar_t, int corners, typename F>
+inline void lut_mask_backward(const scalar_t *luts, const int n, const scalar_t *mask, const int mask_channels, const scalar_t *image, const scalar_t *image_grad,
+                              scalar_t *luts_grad, scalar_t *mask_grad, scalar_t *input_grad,
+                              const LutImageLayout &mask_layout, const LutImageLayout &image_layout, const LutImageLayout &grad_layout,
+                              const LutImageLayout &mask_grad_layout, const LutImageLayout &input_grad_layout,
+                              const int dim, const int shift, const int width, const int height, const int batch, const F &cell_fn)
+{
+    const int64_t lut_size = (int64_t)shift * 3;
+
+    lut_parallel_accumulate_luts(luts_grad, dim, n, batch, height, width, [&](const int batch_index, const int h, LutNodeGrad<scalar_t> &grad)
+    {
+        std::vector<scalar_t> w(n), dot(n);
+        for (int x = 0; x < width; ++x)
+        {
+            const int64_t index = image_layout.offset(batch_index, 0, h, x);
+            const int64_t grad_index = grad_layout.offset(batch_index, 0, h, x);
+            const auto cell = cell_fn(image[index], image[index + image_layout.channel], image[index + image_layout.channel * 2]);
+            const scalar_t g[3] = {image_grad[grad_index], image_grad[grad_index + grad_layout.channel], image_grad[grad_index + grad_layout.channel * 2]};
+            lut_mask_weights(mask + mask_layout.offset(batch_index, 0, h, x), mask_layout.channel, n, mask_channels, w.data());
+            scalar_t *packed = lut_node_grad_cell(grad, cell.id[0]);
+
+            scalar_t coord[3] = {0, 0, 0};
+            for (int k = 0; k < n; ++k)
+            {
+                const scalar_t *lut = luts + k * lut_size;
+                if (mask_grad != nullptr)
+                {
+                    scalar_t value[3];
+                    lut_cell_blend(cell, lut, shift, value);
+                    dot[k] = g[0] * value[0] + g[1] * value[1] + g[2] * value[2];
+                }
+                if (w[k] == 0)
+                    continue;
+
+                const scalar_t wg[3] = {w[k] * g[0], w[k] * g[1], w[k] * g[2]};
+                lut_node_scatter<scalar_t, corners>(packed + k * lut_packed_size(dim), cell.id, cell.w, wg);
+
+                if (input_grad == nullptr)
+                    continue;
+                for (int c = 0; c < 3; ++c)
+                {
+                    scalar_t slope[3];
+                    lut_cell_slope(cell, lut + shift * c, dim, slope);
+                    for (int a = 0; a < 3; ++a)
+                        coord[a] += slope[a] * wg[c];
+                }
+            }
+
+            if (mask_grad != nullptr)
+            {
+                const int64_t mask_index = mask_grad_layout.offset(batch_index, 0, h, x);
+                for (int k = 0; k < mask_channels; ++k)
+                    mask_grad[mask_index + k * mask_grad_layout.channel] = mask_channels == n ? dot[k] : dot[k + 1] - dot[0];
+            }
+            if (input_grad != nullptr)
+            {
+                const int64_t input_index = input_grad_layout.offset(batch_index, 0, h, x);
+                for (int a = 0; a < 3; ++a)
+                    input_grad[input_index + a * input_grad_layout.channel] = coord[a];
+            }
+        }
+    });
+}
+
+#endif
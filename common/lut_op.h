@@ -0,0 +1,147 @@
+#ifndef LUT_OP_H
+#define LUT_OP_H
+
+#include <torch/extension.h>
+#include <torch/library.h>
+
+// Dispatcher operators with C++ autograd, shared by the trilinear and
+// tetrahedral CPU extensions. Each module defines
+//
+//   <module>::interpolate(Tensor lut, Tensor image) -> Tensor
+//   <module>::interpolate.out(Tensor lut, Tensor image, *, Tensor(a!) out) -> Tensor(a!)
+//
+// and registers per dispatch key: lut_interpolate_cpu and lut_interpolate_out
+// for CPU, lut_interpolate for Autograd, and lut_interpolate_meta for Meta,
+// instantiated on its own forward / backward bindings. Shapes come from the
+// tensors, so a call is one dispatcher hop with no Python in between, and
+// TorchScript models can call them as torch.ops.<module>.interpolate.
+
+typedef int (*LutForwardFn)(torch::Tensor lut, torch::Tensor image, torch::Tensor output,
+                            int lut_dim, int shift, float binsize, int width, int height, int batch);
+
+typedef int (*LutBackwardFn)(torch::Tensor image, torch::Tensor image_grad, torch::Tensor lut_grad,
+                             int lut_dim, int shift, float binsize, int width, int height, int batch);
+
+typedef int (*LutBackwardInputFn)(torch::Tensor lut, torch::Tensor image, torch::Tensor image_grad, torch::Tensor lut_grad, torch::Tensor input_grad,
+                                  int lut_dim, int shift, float binsize, int width, int height, int batch);
+
+// The integer arguments of the bindings, inferred from a [3, dim, dim, dim]
+// LUT and a [batch, 3, height, width] image.
+struct LutOpShape
+{
+    int dim;
+    int shift;
+    float binsize;
+    int width;
+    int height;
+    int batch;
+};
+
+inline void lut_op_check(const torch::Tensor &lut, const torch::Tensor &image)
+{
+    TORCH_CHECK(lut.dim() == 4 && lut.size(0) == 3, "LUT must be [3, dim, dim, dim]");
+    TORCH_CHECK(image.dim() == 4 && image.size(1) == 3, "Can only interpolate 3D images!");
+}
+
+inline LutOpShape lut_op_shape(const torch::Tensor &lut, const torch::Tensor &image)
+{
+    lut_op_check(lut, image);
+    TORCH_CHECK(lut.device().is_cpu() && image.device().is_cpu(), "the registered operators run on the CPU");
+
+    const int dim = lut.size(3);
+    return {dim, dim * dim * dim, 1.000001f / (dim - 1), (int)image.size(3), (int)image.size(2), (int)image.size(0)};
+}
+
+// CPU kernel of interpolate, without autograd.
+template <LutForwardFn forward_fn>
+torch::Tensor lut_interpolate_cpu(const torch::Tensor &lut, const torch::Tensor &image)
+{
+    const LutOpShape s = lut_op_shape(lut, image);
+    torch::Tensor output = torch::empty_like(image);
+    forward_fn(lut.contiguous(), image, output, s.dim, s.shift, s.binsize, s.width, s.height, s.batch);
+    return output;
+}
+
+// Meta kernel of interpolate: the output has the image's shape, dtype and
+// layout, so models can be traced with meta tensors.
+inline torch::Tensor lut_interpolate_meta(const torch::Tensor &lut, const torch::Tensor &image)
+{
+    lut_op_check(lut, image);
+    return torch::empty_like(image);
+}
+
+// The forward redispatches op_name ("<module>::interpolate") below autograd,
+// to the CPU or Meta kernel.
+template <const char *op_name, LutBackwardFn backward_fn, LutBackwardInputFn backward_input_fn>
+class LutInterpolationFunction : public torch::autograd::Function<LutInterpolationFunction<op_name, backward_fn, backward_input_fn>>
+{
+public:
+    static torch::Tensor forward(torch::autograd::AutogradContext *ctx, torch::Tensor lut, torch::Tensor image)
+    {
+        static const auto op = c10::Dispatcher::singleton()
+                                   .findSchemaOrThrow(op_name, "")
+                                   .typed<torch::Tensor(const torch::Tensor &, const torch::Tensor &)>();
+        at::AutoDispatchBelowADInplaceOrView guard;
+        torch::Tensor output = op.call(lut, image);
+
+        ctx->save_for_backward({lut, image});
+        return output;
+    }
+
+    // Only the gradients autograd asks for are returned. Integer images carry
+    // no gradient, and give none to the LUT, as in lut3d.py. The kernels
+    // scatter the LUT gradient while computing the image gradient, so an
+    // image-only backward scatters into a scratch gradient that is dropped.
+    static torch::autograd::variable_list backward(torch::autograd::AutogradContext *ctx, torch::autograd::variable_list grad_outputs)
+    {
+        const torch::autograd::variable_list saved = ctx->get_saved_variables();
+        const torch::Tensor &lut = saved[0];
+        const torch::Tensor &image = saved[1];
+        const LutOpShape s = lut_op_shape(lut, image);
+        const bool need_lut_grad = ctx->needs_input_grad(0);
+        const bool need_input_grad = ctx->needs_input_grad(1) && image.is_floating_point();
+
+        torch::Tensor lut_grad;
+        torch::Tensor input_grad;
+        if (need_lut_grad)
+            lut_grad = torch::zeros_like(lut, at::MemoryFormat::Contiguous);
+        if (!image.is_floating_point())
+            return {lut_grad, input_grad};
+
+        if (need_input_grad)
+        {
+            const torch::Tensor scatter = need_lut_grad ? lut_grad : torch::zeros_like(lut, at::MemoryFormat::Contiguous);
+            input_grad = torch::empty_like(image);
+            backward_input_fn(lut.contiguous(), image, grad_outputs[0], scatter, input_grad, s.dim, s.shift, s.binsize, s.width, s.height, s.batch);
+        }
+        else if (need_lut_grad)
+            backward_fn(image, grad_outputs[0], lut_grad, s.dim, s.shift, s.binsize, s.width, s.height, s.batch);
+
+        return {lut_grad, input_grad};
+    }
+};
+
+// Autograd kernel of interpolate.
+template <const char *op_name, LutBackwardFn backward_fn, LutBackwardInputFn backward_input_fn>
+torch::Tensor lut_interpolate(const torch::Tensor &lut, const torch::Tensor &image)
+{
+    return LutInterpolationFunction<op_name, backward_fn, backward_input_fn>::apply(lut, image);
+}
+
+// Writes into a preallocated output (e.g. a reused frame buffer) of the
+// image's shape and dtype; like the out= variants of torch ops it is not
+// differentiable.
+template <LutForwardFn forward_fn>
+torch::Tensor &lut_interpolate_out(const torch::Tensor &lut, const torch::Tensor &image, torch::Tensor &out)
+{
+    TORCH_CHECK(!(torch::GradMode::is_enabled() && (lut.requires_grad() || image.requires_grad())),
+                "interpolate.out does not support automatic differentiation");
+    TORCH_CHECK(out.sizes() == image.sizes() && out.scalar_type() == image.scalar_type(),
+                "out must have the shape and dtype of the image");
+
+    const LutOpShape s = lut_op_shape(lut, image);
+    forward_fn(lut.contiguous(), image, out, s.dim, s.shift, s.binsize, s.width, s.height, s.batch);
+    return out;
+}
+
+#endif
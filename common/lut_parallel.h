@@ -0,0 +1,109 @@
+#ifndef LUT_PARALLEL_H
+#define LUT_PARALLEL_H
+
+#include <ATen/Parallel.h>
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+
+// Minimum number of pixels handed to one task of the intra-op thread pool.
+// Images smaller than this run on the calling thread, like the serial loop.
+#define LUT_PARALLEL_GRAIN_PIXELS 16384
+
+// Upper bound on the scratch memory of the private LUT gradient buffers used by
+// lut_parallel_accumulate. At dim=64 one float buffer is about 3 MB.
+#define LUT_GRAD_SCRATCH_BYTES (64 << 20)
+
+// Number of row slices lut_parallel_accumulate cuts the image into. It is a
+// constant rather than the thread count, so the slice boundaries and the
+// order of the reduction, and with them the gradient, are the same on every
+// machine. Threads beyond this count stay idle during the scatter.
+#define LUT_GRAD_SLICES 16
+
+// Calls fn(batch_index, h) for every image row. The batch * height rows are
+// split into contiguous tiles over ATen's thread pool, so the number of
+// workers follows torch.set_num_threads. Every pixel is still computed by the
+// same code, so results are identical to the serial loop nest.
+template <typename F>
+inline void lut_parallel_rows(const int batch, const int height, const int width, const F &fn)
+{
+    const int64_t rows = (int64_t)batch * height;
+    const int64_t grain = std::max<int64_t>(1, LUT_PARALLEL_GRAIN_PIXELS / std::max(width, 1));
+
+    at::parallel_for(0, rows, grain, [&](int64_t begin, int64_t end)
+    {
+        for (int64_t row = begin; row < end; ++row)
+            fn((int)(row / height), (int)(row % height));
+    });
+}
+
+// Number of slices for a gradient of slice_bytes over batch * height rows of
+// width pixels: LUT_GRAD_SLICES, fewer for small images (see
+// LUT_PARALLEL_GRAIN_PIXELS) or when the buffers would exceed
+// LUT_GRAD_SCRATCH_BYTES. It depends only on the shapes.
+inline int64_t lut_grad_slices(const int64_t slice_bytes, const int batch, const int height, const int width)
+{
+    const int64_t rows = (int64_t)batch * height;
+    const int64_t max_by_memory = std::max<int64_t>(1, LUT_GRAD_SCRATCH_BYTES / std::max<int64_t>(slice_bytes, 1));
+    const int64_t max_by_work = std::max<int64_t>(1, rows * width / LUT_PARALLEL_GRAIN_PIXELS);
+    return std::max<int64_t>(1, std::min({(int64_t)LUT_GRAD_SLICES, max_by_memory, max_by_work, rows}));
+}
+
+// Accumulates a LUT-shaped gradient from every image row without atomics.
+// The batch * height rows are cut into nbuf = lut_grad_slices contiguous
+// slices, and slice k scatters into its own zeroed buffer through
+// fn(row_begin, row_end, grad), where rows are numbered
+// batch_index * height + h. The slices run in parallel, and the buffers are
+// then added into lut_grad in slice order. Neither step depends on the number
+// of threads or their scheduling, so the gradient is bit-identical for any
+// torch.set_num_threads. With a single slice fn scatters straight into
+// lut_grad, exactly like the serial loop.
+template <typename scalar_t, typename F>
+inline void lut_parallel_accumulate_slices(scalar_t *lut_grad, const int64_t grad_size, const int batch, const int height, const int width, const F &fn)
+{
+    const int64_t rows = (int64_t)batch * height;
+    const int64_t nbuf = lut_grad_slices(grad_size * (int64_t)sizeof(scalar_t), batch, height, width);
+
+    if (nbuf <= 1)
+    {
+        fn((int64_t)0, rows, lut_grad);
+        return;
+    }
+
+    std::unique_ptr<scalar_t[]> scratch(new scalar_t[nbuf * grad_size]);
+
+    at::parallel_for(0, nbuf, 1, [&](int64_t begin, int64_t end)
+    {
+        for (int64_t k = begin; k < end; ++k)
+        {
+            scalar_t *grad = scratch.get() + k * grad_size;
+            std::fill(grad, grad + grad_size, scalar_t(0));
+            fn(rows * k / nbuf, rows * (k + 1) / nbuf, grad);
+        }
+    });
+
+    at::parallel_for(0, grad_size, 4096, [&](int64_t begin, int64_t end)
+    {
+        for (int64_t i = begin; i < end; ++i)
+        {
+            scalar_t acc = lut_grad[i];
+            for (int64_t k = 0; k < nbuf; ++k)
+                acc += scratch[k * grad_size + i];
+            lut_grad[i] = acc;
+        }
+    });
+}
+
+// Row-by-row form of lut_parallel_accumulate_slices: fn(batch_index, h, grad)
+// is called for every image row.
+template <typename scalar_t, typename F>
+inline void lut_parallel_accumulate(scalar_t *lut_grad, const int64_t grad_size, const int batch, const int height, const int width, const F &fn)
+{
+    lut_parallel_accumulate_slices(lut_grad, grad_size, batch, height, width, [&](const int64_t begin, const int64_t end, scalar_t *grad)
+    {
+        for (int64_t row = begin; row < end; ++row)
+            fn((int)(row / height), (int)(row % height), grad);
+    });
+}
+
+#endif
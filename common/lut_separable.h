@@ -0,0 +1,139 @@
+#ifndef LUT_SEPARABLE_H
+#define LUT_SEPARABLE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "lut_cpu.h"
+#include "lut_parallel.h"
+
+// Many LUTs are per-channel curves: output R depends only on input R, and so
+// on. Plane c of such a LUT is constant over every slice of nodes with the
+// same index along input axis c, and interpolating it, trilinear or
+// tetrahedral alike, reduces to linear interpolation of one curve per channel:
+// the corner weights of the other two axes sum to one. The forward then reads
+// 2 curve values per channel instead of 8 (or 4) lattice nodes.
+//
+// A LUT is classified once from the min / max of plane c over each slice
+// along axis c. Curve value i is the midpoint of slice i, which makes
+// max (hi - lo) / 2 the smallest possible max distance of a node from its
+// curve; within tol of the curves (or of the identity) the 1D result differs
+// from the 3D forward by at most tol, since both are convex combinations of
+// nodes.
+#define LUT_SEPARABLE_IDENTITY 0
+#define LUT_SEPARABLE_CURVES 1
+#define LUT_SEPARABLE_FULL 2
+
+// Classifies a [3, dim, dim, dim] LUT and writes its [3][dim] curves. Node
+// (r, g, b) of a plane is at (r * dim + g) * dim + b, so input axis c has
+// stride dim^(2 - c). Slices are scanned in parallel, one task per (c, i).
+template <typename scalar_t>
+inline int lut_separable_classify(const scalar_t *lut, const int dim, const double tol, scalar_t *curves)
+{
+    const int64_t shift = (int64_t)dim * dim * dim;
+    const int64_t strides[3] = {(int64_t)dim * dim, dim, 1};
+    std::vector<double> curve_error(3 * dim), identity_error(3 * dim);
+
+    lut_parallel_rows(3, dim, dim * dim, [&](const int c, const int i)
+    {
+        // The other two axes, the one with the smaller stride innermost.
+        const int64_t outer = strides[c == 0 ? 1 : 0];
+        const int64_t inner = strides[c == 2 ? 1 : 2];
+        const scalar_t *slice = lut + c * shift + i * strides[c];
+        scalar_t lo = slice[0], hi = slice[0];
+        for (int j = 0; j < dim; ++j)
+            for (int k = 0; k < dim; ++k)
+            {
+                const scalar_t v = slice[j * outer + k * inner];
+                lo = std::min(lo, v);
+                hi = std::max(hi, v);
+            }
+
+        const double node = (double)i / (dim - 1);
+        curves[c * dim + i] = lo + (hi - lo) / 2;
+        curve_error[c * dim + i] = ((double)hi - lo) / 2;
+        identity_error[c * dim + i] = std::max(hi - node, node - lo);
+    });
+
+    const double curve_max = *std::max_element(curve_error.begin(), curve_error.end());
+    const double identity_max = *std::max_element(identity_error.begin(), identity_error.end());
+    if (identity_max <= tol)
+        return LUT_SEPARABLE_IDENTITY;
+    return curve_max <= tol ? LUT_SEPARABLE_CURVES : LUT_SEPARABLE_FULL;
+}
+
+// Applies the [3][dim] curves to pixels [begin, end) of a planar row, with the
+// cell arithmetic of trilinear_cell along each axis, so inputs outside [0, 1]
+// clamp the same way.
+template <typename scalar_t>
+inline void lut_separable_row_scalar(const scalar_t *curves, const int dim, const scalar_t *image, scalar_t *output, const int64_t plane,
+                                     const int begin, const int end)
+{
+    for (int c = 0; c < 3; ++c)
+    {
+        const scalar_t *curve = curves + c * dim;
+        const scalar_t *in = image + c * plane;
+        scalar_t *out = output + c * plane;
+        for (int w = begin; w < end; ++w)
+        {
+            const scalar_t loc = in[w] * (dim - 1);
+            int lo = floor(loc);
+            const int hi = std::min(std::max(lo + 1, 0), dim - 1);
+            lo = std::min(std::max(lo, 0), dim - 1);
+            const scalar_t d = loc - lo;
+            out[w] = (1 - d) * curve[lo] + d * curve[hi];
+        }
+    }
+}
+
+#if LUT_HAVE_X86_SIMD
+// AVX2 version, 8 pixels per iteration with the curve values gathered from L1.
+// The lanes perform the scalar operations in the same order, so results are
+// identical.
+LUT_TARGET_AVX2 static int lut_separable_row_avx2(const float *curves, const int dim, const float *image, float *output, const int64_t plane,
+                                                  const int width)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 scale = _mm256_set1_ps((float)(dim - 1));
+    const __m256i low = _mm256_setzero_si256();
+    const __m256i high = _mm256_set1_epi32(dim - 1);
+    const __m256i step = _mm256_set1_epi32(1);
+
+    int w = 0;
+    for (; w + 8 <= width; w += 8)
+        for (int c = 0; c < 3; ++c)
+        {
+            const __m256 loc = _mm256_mul_ps(_mm256_loadu_ps(image + c * plane + w), scale);
+            __m256i lo = _mm256_cvttps_epi32(_mm256_floor_ps(loc));
+            const __m256i hi = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(lo, step), low), high);
+            lo = _mm256_min_epi32(_mm256_max_epi32(lo, low), high);
+            const __m256 d = _mm256_sub_ps(loc, _mm256_cvtepi32_ps(lo));
+            const float *curve = curves + c * dim;
+            const __m256 v = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(one, d), _mm256_i32gather_ps(curve, lo, 4)),
+                                           _mm256_mul_ps(d, _mm256_i32gather_ps(curve, hi, 4)));
+            _mm256_storeu_ps(output + c * plane + w, v);
+        }
+    return w;
+}
+#endif
+
+template <typename scalar_t>
+inline void lut_separable_row(const scalar_t *curves, const int dim, const scalar_t *image, scalar_t *output, const int64_t plane, const int width)
+{
+    lut_separable_row_scalar(curves, dim, image, output, plane, 0, width);
+}
+
+template <>
+inline void lut_separable_row<float>(const float *curves, const int dim, const float *image, float *output, const int64_t plane, const int width)
+{
+    int w = 0;
+#if LUT_HAVE_X86_SIMD
+    static const bool avx2 = lut_detect_isa() >= LUT_ISA_AVX2;
+    if (avx2)
+        w = lut_separable_row_avx2(curves, dim, image, output, plane, width);
+#endif
+    lut_separable_row_scalar(curves, dim, image, output, plane, w, width);
+}
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef LUT_SHAPER_H
+#define LUT_SHAPER_H
+
+#include <algorithm>
+#include <cmath>
+
+// 1D shaper curve applied to each channel before the 3D LUT: lut1d.Lut1D
+// followed by the clamp to [0, 1] of saveLut.Mymodel. The arithmetic follows
+// the tensor ops of Lut1D step by step, so a fused pass gives the same values
+// as running the two modules one after the other.
+template <typename scalar_t>
+struct ShaperSample
+{
+    int lo;
+    int hi;
+    scalar_t d;
+    // Curve value, the same after the clamp, and whether the clamp passes
+    // gradient.
+    scalar_t raw;
+    scalar_t value;
+    bool inside;
+};
+
+template <typename scalar_t>
+inline ShaperSample<scalar_t> lut_shaper_sample(const scalar_t *curve, const int dim, scalar_t x)
+{
+    x = std::min(std::max(x, (scalar_t)0), (scalar_t)1);
+    const scalar_t loc = x * (dim - 1);
+
+    ShaperSample<scalar_t> s;
+    s.lo = floor(loc);
+    s.hi = std::min(std::max(s.lo + 1, 0), dim - 1);
+    s.d = loc - s.lo;
+
+    s.raw = (1 - s.d) * curve[s.lo] + s.d * curve[s.hi];
+    s.inside = s.raw >= 0 && s.raw <= 1;
+    s.value = std::min(std::max(s.raw, (scalar_t)0), (scalar_t)1);
+    return s;
+}
+
+// Shapes one row into a planar [3][width] buffer. curve_stride is 0 when the
+// three channels share one curve and dim when each has its own.
+template <typename scalar_t>
+inline void lut_shaper_row(const scalar_t *curve, const int dim, const int curve_stride, const scalar_t *image, const int64_t channel, const int64_t col,
+                           scalar_t *row, const int width)
+{
+    for (int c = 0; c < 3; ++c)
+        for (int w = 0; w < width; ++w)
+            row[c * width + w] = lut_shaper_sample(curve + c * curve_stride, dim, image[c * channel + w * col]).value;
+}
+
+#endif
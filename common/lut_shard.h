@@ -0,0 +1,425 @@
+#ifndef LUT_SHARD_H
+#define LUT_SHARD_H
+
+#include <torch/extension.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+#include "lut_cube.h" // LUT_HAVE_MMAP
+#include "lut_image.h"
+
+// Training shards: pairs of [height, width, 3] input / target images stored as
+// uint8 or uint16 samples in one file, in place of two float32 .npy files per
+// pair (a quarter / half of the size). Layout:
+//
+//   LutShardHeader                          64 bytes
+//   LutShardEntry[count]                    offset and size of each pair
+//   padding to a 4096-byte boundary
+//   pairs: input samples, then target samples, interleaved RGB, row-major
+//
+// Samples are little-endian and normalized by their maximum (255 or 65535),
+// as in LutPixel.
+#define LUT_SHARD_MAGIC "LUTSHARD"
+#define LUT_SHARD_VERSION 1
+
+struct LutShardHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t sample_bytes;
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t index_offset;
+    uint64_t data_offset;
+    char padding[24];
+};
+
+struct LutShardEntry
+{
+    uint64_t offset;
+    uint32_t height;
+    uint32_t width;
+};
+
+static_assert(sizeof(LutShardHeader) == 64, "shard header must be 64 bytes");
+static_assert(sizeof(LutShardEntry) == 16, "shard index entries must be 16 bytes");
+
+// Quantizes an [n, height, width, 3] tensor (float in [0, 1], uint8, or
+// uint16 stored as int16) to sample_t, for one pair slot of every record.
+template <typename sample_t>
+inline void lut_shard_quantize(const torch::Tensor &images, std::vector<sample_t> &samples)
+{
+    const int64_t count = images.numel();
+    samples.resize(count);
+    if (images.scalar_type() == (sizeof(sample_t) == 1 ? at::kByte : at::kShort))
+    {
+        std::memcpy(samples.data(), images.data_ptr(), count * sizeof(sample_t));
+        return;
+    }
+    TORCH_CHECK(images.is_floating_point(), "shard images must be float, or integers of the shard's sample type");
+    const torch::Tensor values = images.to(torch::kFloat);
+    const float *v = values.data_ptr<float>();
+    for (int64_t i = 0; i < count; ++i)
+        samples[i] = LutPixel<sample_t>::template store<float>(v[i]);
+}
+
+// Writes inputs and targets ([n, height, width, 3], same shape) as one shard
+// with sample_bytes (1 or 2) per sample.
+inline int lut_write_shard(const std::string &path, torch::Tensor inputs, torch::Tensor targets, int sample_bytes)
+{
+    TORCH_CHECK(inputs.dim() == 4 && inputs.size(3) == 3, "shard images must be [n, height, width, 3]");
+    TORCH_CHECK(inputs.sizes() == targets.sizes(), "inputs and targets must have the same shape");
+    TORCH_CHECK(sample_bytes == 1 || sample_bytes == 2, "sample_bytes must be 1 (uint8) or 2 (uint16)");
+    inputs = inputs.contiguous();
+    targets = targets.contiguous();
+
+    const uint32_t count = inputs.size(0);
+    const uint32_t height = inputs.size(1);
+    const uint32_t width = inputs.size(2);
+    const uint64_t image_bytes = (uint64_t)height * width * 3 * sample_bytes;
+
+    LutShardHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, LUT_SHARD_MAGIC, 8);
+    header.version = LUT_SHARD_VERSION;
+    header.sample_bytes = sample_bytes;
+    header.count = count;
+    header.index_offset = sizeof(header);
+    header.data_offset = (sizeof(header) + count * sizeof(LutShardEntry) + 4095) / 4096 * 4096;
+
+    std::vector<LutShardEntry> index(count);
+    for (uint32_t i = 0; i < count; ++i)
+        index[i] = {header.data_offset + i * 2 * image_bytes, height, width};
+
+    std::vector<char> data(2 * count * image_bytes);
+    auto pack = [&](const torch::Tensor &images, const int slot)
+    {
+        auto copy = [&](const auto &samples)
+        {
+            for (uint32_t i = 0; i < count; ++i)
+                std::memcpy(data.data() + (2 * i + slot) * image_bytes, (const char *)samples.data() + i * image_bytes, image_bytes);
+        };
+        if (sample_bytes == 1)
+        {
+            std::vector<uint8_t> samples;
+            lut_shard_quantize(images, samples);
+            copy(samples);
+        }
+        else
+        {
+            std::vector<uint16_t> samples;
+            lut_shard_quantize(images, samples);
+            copy(samples);
+        }
+    };
+    pack(inputs, 0);
+    pack(targets, 1);
+
+    FILE *file = std::fopen(path.c_str(), "wb");
+    TORCH_CHECK(file != nullptr, "cannot create ", path);
+    const std::vector<char> padding(header.data_offset - sizeof(header) - count * sizeof(LutShardEntry), 0);
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && std::fwrite(index.data(), sizeof(LutShardEntry), count, file) == count;
+    ok = ok && std::fwrite(padding.data(), 1, padding.size(), file) == padding.size();
+    ok = ok && std::fwrite(data.data(), 1, data.size(), file) == data.size();
+    TORCH_CHECK(std::fclose(file) == 0 && ok, "error writing ", path);
+    return 1;
+}
+
+// Read-only mapping of a whole file, unmapped on destruction.
+class LutMappedFile
+{
+public:
+    explicit LutMappedFile(const std::string &path)
+    {
+#if LUT_HAVE_MMAP
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        TORCH_CHECK(fd >= 0, "cannot open ", path);
+        struct stat st;
+        const bool sized = ::fstat(fd, &st) == 0;
+        size_ = sized ? st.st_size : 0;
+        void *map = size_ > 0 ? ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        TORCH_CHECK(map != MAP_FAILED, "cannot map ", path);
+        data_ = static_cast<const char *>(map);
+#else
+        FILE *file = std::fopen(path.c_str(), "rb");
+        TORCH_CHECK(file != nullptr, "cannot open ", path);
+        char chunk[1 << 16];
+        size_t n;
+        while ((n = std::fread(chunk, 1, sizeof(chunk), file)) > 0)
+            copy_.insert(copy_.end(), chunk, chunk + n);
+        std::fclose(file);
+        data_ = copy_.data();
+        size_ = copy_.size();
+#endif
+    }
+
+    ~LutMappedFile()
+    {
+#if LUT_HAVE_MMAP
+        ::munmap(const_cast<char *>(data_), size_);
+#endif
+    }
+
+    LutMappedFile(const LutMappedFile &) = delete;
+    LutMappedFile &operator=(const LutMappedFile &) = delete;
+
+    const char *data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+#if !LUT_HAVE_MMAP
+    std::vector<char> copy_;
+#endif
+};
+
+// Shuffled batches of (input, target) pairs from a set of mapped shards.
+// start_epoch() shuffles (deterministically from seed and the epoch number)
+// and starts the worker threads, which convert pairs straight from the
+// mappings into a ring of prefetched batch tensors allocated once (pinned
+// if requested). next() returns the batches in order as views of the ring;
+// a batch stays valid until the following next() call, after which its slot
+// is refilled. Batches are [batch, height, width, 3] (NHWC) or
+// [batch, 3, height, width] (NCHW), float in [0, 1] when normalize is set and
+// the stored samples (uint8, or uint16 as int16) otherwise.
+class LutShardLoader
+{
+public:
+    LutShardLoader(const std::vector<std::string> &paths, int batch_size, bool nchw, bool normalize, bool shuffle,
+                   int workers, int prefetch, bool pin_memory, int64_t seed)
+        : batch_size_(batch_size), nchw_(nchw), normalize_(normalize), shuffle_(shuffle),
+          workers_(std::max(workers, 1)), seed_(seed)
+    {
+        TORCH_CHECK(!paths.empty(), "no shards given");
+        TORCH_CHECK(batch_size > 0, "batch_size must be positive");
+        for (const std::string &path : paths)
+        {
+            files_.emplace_back(new LutMappedFile(path));
+            const LutMappedFile &file = *files_.back();
+            LutShardHeader header;
+            TORCH_CHECK(file.size() >= sizeof(header), path, " is not a shard");
+            std::memcpy(&header, file.data(), sizeof(header));
+            TORCH_CHECK(std::memcmp(header.magic, LUT_SHARD_MAGIC, 8) == 0 && header.version == LUT_SHARD_VERSION,
+                        path, " is not a shard of version ", LUT_SHARD_VERSION);
+            TORCH_CHECK(header.index_offset + header.count * sizeof(LutShardEntry) <= file.size(), path, " is truncated");
+            if (records_.empty())
+                sample_bytes_ = header.sample_bytes;
+            TORCH_CHECK(header.sample_bytes == (uint32_t)sample_bytes_, path, " has ", header.sample_bytes, "-byte samples, other shards ", sample_bytes_);
+
+            const LutShardEntry *index = reinterpret_cast<const LutShardEntry *>(file.data() + header.index_offset);
+            for (uint32_t i = 0; i < header.count; ++i)
+            {
+                if (records_.empty())
+                {
+                    height_ = index[i].height;
+                    width_ = index[i].width;
+                }
+                TORCH_CHECK((int)index[i].height == height_ && (int)index[i].width == width_, path, ": pair ", i, " is ",
+                            index[i].height, "x", index[i].width, ", other pairs ", height_, "x", width_);
+                TORCH_CHECK(index[i].offset + 2 * image_bytes() <= file.size(), path, " is truncated");
+                records_.push_back(file.data() + index[i].offset);
+            }
+        }
+        TORCH_CHECK(!records_.empty(), "the shards hold no pairs");
+
+        const at::ScalarType type = normalize ? at::kFloat : sample_bytes_ == 1 ? at::kByte : at::kShort;
+        const std::vector<int64_t> shape = nchw ? std::vector<int64_t>{batch_size, 3, height_, width_}
+                                                : std::vector<int64_t>{batch_size, height_, width_, 3};
+        slots_.resize(std::max(prefetch, workers_ + 1));
+        for (Slot &slot : slots_)
+        {
+            slot.input = torch::empty(shape, torch::TensorOptions().dtype(type).pinned_memory(pin_memory));
+            slot.target = torch::empty(shape, torch::TensorOptions().dtype(type).pinned_memory(pin_memory));
+        }
+        order_.resize(records_.size());
+    }
+
+    ~LutShardLoader() { stop(); }
+
+    int64_t size() const { return records_.size(); }
+    int64_t batches() const { return (size() + batch_size_ - 1) / batch_size_; }
+
+    void start_epoch(int64_t epoch)
+    {
+        stop();
+        std::iota(order_.begin(), order_.end(), 0);
+        if (shuffle_)
+        {
+            std::mt19937_64 rng(seed_ * 1000003 + epoch);
+            std::shuffle(order_.begin(), order_.end(), rng);
+        }
+        next_batch_ = 0;
+        handed_ = 0;
+        stopping_ = false;
+        error_ = nullptr;
+        for (Slot &slot : slots_)
+            slot.filled = -1;
+        for (int t = 0; t < workers_; ++t)
+            threads_.emplace_back([this]
+                                  { work(); });
+    }
+
+    std::tuple<torch::Tensor, torch::Tensor> next()
+    {
+        TORCH_CHECK(!threads_.empty(), "call start_epoch() before next()");
+        TORCH_CHECK(handed_ < batches(), "the epoch has no more batches");
+        const int64_t batch = handed_;
+        Slot &slot = slots_[batch % slots_.size()];
+        {
+            py::gil_scoped_release release;
+            std::unique_lock<std::mutex> lock(mutex_);
+            ++handed_; // releases the previous batch's slot
+            changed_.notify_all();
+            changed_.wait(lock, [&]
+                          { return slot.filled == batch || error_; });
+        }
+        if (error_)
+        {
+            stop();
+            std::rethrow_exception(error_);
+        }
+        const int64_t rows = std::min<int64_t>(batch_size_, size() - batch * batch_size_);
+        return std::make_tuple(slot.input.narrow(0, 0, rows), slot.target.narrow(0, 0, rows));
+    }
+
+private:
+    struct Slot
+    {
+        torch::Tensor input;
+        torch::Tensor target;
+        int64_t filled;
+    };
+
+    int64_t image_bytes() const { return (int64_t)height_ * width_ * 3 * sample_bytes_; }
+
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        changed_.notify_all();
+        for (std::thread &thread : threads_)
+            thread.join();
+        threads_.clear();
+    }
+
+    // Batch b goes to slot b % slots once batch b - slots has been released,
+    // i.e. once next() has been called for batch b - slots + 1.
+    void work()
+    {
+        try
+        {
+            for (;;)
+            {
+                int64_t batch;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    if (stopping_ || next_batch_ >= batches())
+                        return;
+                    batch = next_batch_++;
+                    changed_.wait(lock, [&]
+                                  { return stopping_ || handed_ > batch - (int64_t)slots_.size() + 1; });
+                    if (stopping_)
+                        return;
+                }
+
+                Slot &slot = slots_[batch % slots_.size()];
+                const int64_t rows = std::min<int64_t>(batch_size_, size() - batch * batch_size_);
+                for (int64_t i = 0; i < rows; ++i)
+                {
+                    const char *record = records_[order_[batch * batch_size_ + i]];
+                    fill(slot.input, i, record);
+                    fill(slot.target, i, record + image_bytes());
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    slot.filled = batch;
+                }
+                changed_.notify_all();
+            }
+        }
+        catch (...)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!error_)
+                    error_ = std::current_exception();
+            }
+            changed_.notify_all();
+        }
+    }
+
+    void fill(const torch::Tensor &batch, const int64_t i, const char *record) const
+    {
+        if (sample_bytes_ == 1)
+            fill_as(batch, i, reinterpret_cast<const uint8_t *>(record));
+        else
+            fill_as(batch, i, reinterpret_cast<const uint16_t *>(record));
+    }
+
+    template <typename sample_t>
+    void fill_as(const torch::Tensor &batch, const int64_t i, const sample_t *samples) const
+    {
+        if (normalize_)
+            convert(samples, batch.data_ptr<float>() + i * height_ * width_ * 3, [](const sample_t v)
+                    { return LutPixel<sample_t>::template load<float>(v); });
+        else if (!nchw_)
+            std::memcpy((char *)batch.data_ptr() + i * image_bytes(), samples, image_bytes());
+        else
+            convert(samples, reinterpret_cast<sample_t *>((char *)batch.data_ptr() + i * image_bytes()), [](const sample_t v)
+                    { return v; });
+    }
+
+    // Interleaved HWC samples to the batch layout, one image.
+    template <typename sample_t, typename out_t, typename F>
+    void convert(const sample_t *samples, out_t *out, const F &value) const
+    {
+        const int64_t plane = (int64_t)height_ * width_;
+        if (!nchw_)
+            for (int64_t k = 0; k < plane * 3; ++k)
+                out[k] = value(samples[k]);
+        else
+            for (int64_t p = 0; p < plane; ++p)
+                for (int c = 0; c < 3; ++c)
+                    out[c * plane + p] = value(samples[p * 3 + c]);
+    }
+
+    const int batch_size_;
+    const bool nchw_;
+    const bool normalize_;
+    const bool shuffle_;
+    const int workers_;
+    const int64_t seed_;
+    int sample_bytes_ = 1;
+    int height_ = 0;
+    int width_ = 0;
+    std::vector<std::unique_ptr<LutMappedFile>> files_;
+    std::vector<const char *> records_;
+    std::vector<int64_t> order_;
+    std::vector<Slot> slots_;
+    std::vector<std::thread> threads_;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    int64_t next_batch_ = 0;
+    int64_t handed_ = 0;
+    bool stopping_ = false;
+    std::exception_ptr error_;
+};
+
+#endif
@@ -0,0 +1,256 @@
+#ifndef LUT_SPARSE_H
+#define LUT_SPARSE_H
+
+#include <ATen/Parallel.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "lut_layout.h"
+
+// Sparse LUT gradients. A batch only reaches the lattice cells its colours
+// fall in, so at dim=64 most of the dim^3 nodes get no gradient. The sparse
+// backward (lut_parallel_accumulate_sparse) scatters into the same slice
+// buffers as the dense one, but every slice also lists the cells it reaches.
+// The gradient is then summed at the nodes of those cells only, so no dense
+// gradient is reduced and no pass over the lattice looks for the touched
+// nodes, and the optimizer step only visits them. Nodes whose gradient is
+// zero in every channel (reached with a zero weight) are left out, which is
+// the same as treating them as untouched. lut_sparse_nodes finds the same
+// nodes in a dense gradient.
+
+// Number of nodes per task when scanning or updating the lattice.
+#define LUT_SPARSE_GRAIN 4096
+
+// Ascending indices of the nodes of a [3][shift] gradient that are nonzero in
+// any channel. Blocks of nodes are scanned in parallel and concatenated in
+// block order.
+template <typename scalar_t>
+inline std::vector<int64_t> lut_sparse_nodes(const scalar_t *lut_grad, const int64_t shift)
+{
+    const int64_t blocks = (shift + LUT_SPARSE_GRAIN - 1) / LUT_SPARSE_GRAIN;
+    std::vector<std::vector<int64_t>> found(blocks);
+
+    at::parallel_for(0, blocks, 1, [&](int64_t begin, int64_t end)
+    {
+        for (int64_t block = begin; block < end; ++block)
+        {
+            const int64_t last = std::min(shift, (block + 1) * LUT_SPARSE_GRAIN);
+            for (int64_t i = block * LUT_SPARSE_GRAIN; i < last; ++i)
+                if (lut_grad[i] != 0 || lut_grad[i + shift] != 0 || lut_grad[i + shift * 2] != 0)
+                    found[block].push_back(i);
+        }
+    });
+
+    std::vector<int64_t> nodes;
+    for (const auto &block : found)
+        nodes.insert(nodes.end(), block.begin(), block.end());
+    return nodes;
+}
+
+// Single-LUT gradient over the nodes it reaches: ascending nodes and their
+// values, [3][nodes.size()] (channel-major).
+template <typename scalar_t>
+struct LutSparseGrad
+{
+    std::vector<int64_t> nodes;
+    std::vector<scalar_t> values;
+};
+
+// Ascending nodes of the listed cells: every corner of a cell that lies in the
+// lattice, once.
+inline std::vector<int64_t> lut_sparse_cell_nodes(const std::vector<std::vector<int>> &cells, const int dim)
+{
+    const int plane = dim * dim;
+    thread_local std::vector<uint8_t> seen;
+    seen.resize((size_t)plane * dim, 0);
+
+    std::vector<int64_t> nodes;
+    for (const std::vector<int> &slice : cells)
+    {
+        for (const int cell : slice)
+        {
+            const int r = cell / plane, g = cell / dim % dim, b = cell % dim;
+            for (int corner = 0; corner < 8; ++corner)
+            {
+                const int dr = corner & 1, dg = corner >> 1 & 1, db = corner >> 2;
+                if (r + dr >= dim || g + dg >= dim || b + db >= dim)
+                    continue;
+                const int node = cell + dr * plane + dg * dim + db;
+                if (!seen[node])
+                {
+                    seen[node] = 1;
+                    nodes.push_back(node);
+                }
+            }
+        }
+    }
+
+    for (const int64_t node : nodes)
+        seen[node] = 0;
+    std::sort(nodes.begin(), nodes.end());
+    return nodes;
+}
+
+// Sparse form of lut_parallel_accumulate_nodes: the slices of
+// lut_node_slices list the cells they reach, and the gradient is summed at the
+// nodes of those cells in slice order, as the dense reduction does from a
+// zero gradient. The values are bit-identical to the dense gradient at the
+// same nodes.
+template <typename scalar_t, typename F>
+inline void lut_parallel_accumulate_sparse(LutSparseGrad<scalar_t> &sparse, const int dim, const int batch, const int height, const int width, const F &fn)
+{
+    const LutNodeSlices<scalar_t> slices = lut_node_slices<scalar_t>(dim, 1, true, batch, height, width, fn);
+    const std::vector<int64_t> reached = lut_sparse_cell_nodes(slices.cells, dim);
+    const int64_t n = reached.size();
+    std::vector<scalar_t> values(n * 3);
+    std::vector<uint8_t> nonzero(n);
+
+    at::parallel_for(0, n, LUT_SPARSE_GRAIN, [&](int64_t begin, int64_t end)
+    {
+        for (int64_t e = begin; e < end; ++e)
+        {
+            const scalar_t *node = slices.packed.get() + reached[e] * LUT_NODE_STRIDE;
+            for (int c = 0; c < 3; ++c)
+            {
+                scalar_t acc = 0;
+                for (int64_t k = 0; k < slices.slices; ++k)
+                    acc += node[k * slices.size + c];
+                values[c * n + e] = acc;
+                nonzero[e] |= acc != 0;
+            }
+        }
+    });
+
+    sparse.nodes.clear();
+    for (int64_t e = 0; e < n; ++e)
+        if (nonzero[e])
+            sparse.nodes.push_back(reached[e]);
+
+    const int64_t m = sparse.nodes.size();
+    sparse.values.resize(m * 3);
+    for (int c = 0; c < 3; ++c)
+    {
+        int64_t j = 0;
+        for (int64_t e = 0; e < n; ++e)
+            if (nonzero[e])
+                sparse.values[c * m + j++] = values[c * n + e];
+    }
+}
+
+// Single-LUT gradient accumulated into the dense lut_grad, or into sparse when
+// it is set.
+template <typename scalar_t, typename F>
+inline void lut_parallel_accumulate_grad(scalar_t *lut_grad, LutSparseGrad<scalar_t> *sparse, const int dim, const int batch, const int height, const int width, const F &fn)
+{
+    if (sparse != nullptr)
+        lut_parallel_accumulate_sparse(*sparse, dim, batch, height, width, fn);
+    else
+        lut_parallel_accumulate_nodes(lut_grad, dim, batch, height, width, fn);
+}
+
+// Coalesced COO indices of a [3, dim, dim, dim] gradient over the given
+// nodes: [4][3 * n] with rows (channel, r, g, b), entries in lexicographic
+// order (channel-major, then node), the order of LutSparseGrad::values.
+inline void lut_sparse_indices(const std::vector<int64_t> &nodes, const int dim, int64_t *indices)
+{
+    const int64_t n = nodes.size();
+    const int64_t count = n * 3;
+
+    at::parallel_for(0, n, LUT_SPARSE_GRAIN, [&](int64_t begin, int64_t end)
+    {
+        for (int64_t k = begin; k < end; ++k)
+        {
+            const int64_t node = nodes[k];
+            for (int c = 0; c < 3; ++c)
+            {
+                const int64_t e = c * n + k;
+                indices[e] = c;
+                indices[count + e] = node / ((int64_t)dim * dim);
+                indices[count * 2 + e] = node / dim % dim;
+                indices[count * 3 + e] = node % dim;
+            }
+        }
+    });
+}
+
+// COO form of a dense [3, dim, dim, dim] gradient over the given nodes, with
+// the indices of lut_sparse_indices and values [3 * n] in the same order.
+template <typename scalar_t>
+inline void lut_sparse_coo(const scalar_t *lut_grad, const std::vector<int64_t> &nodes, const int dim,
+                           int64_t *indices, scalar_t *values)
+{
+    const int64_t shift = (int64_t)dim * dim * dim;
+    const int64_t n = nodes.size();
+
+    lut_sparse_indices(nodes, dim, indices);
+    at::parallel_for(0, n, LUT_SPARSE_GRAIN, [&](int64_t begin, int64_t end)
+    {
+        for (int64_t k = begin; k < end; ++k)
+            for (int c = 0; c < 3; ++c)
+                values[c * n + k] = lut_grad[c * shift + nodes[k]];
+    });
+}
+
+// Offset into a contiguous tensor of entry e of a [ndim][count] COO index.
+inline int64_t lut_sparse_offset(const int64_t *indices, const int64_t *strides, const int ndim, const int64_t count, const int64_t e)
+{
+    int64_t offset = 0;
+    for (int d = 0; d < ndim; ++d)
+        offset += indices[d * count + e] * strides[d];
+    return offset;
+}
+
+// Adam step on the entries of a sparse gradient (indices == nullptr: every
+// entry of a dense one), with the update of torch.optim.Adam:
+//
+//   m = beta1 m + (1 - beta1) g,  v = beta2 v + (1 - beta2) g^2
+//   p -= lr / (1 - beta1^step) * m / (sqrt(v) / sqrt(1 - beta2^step) + eps)
+//
+// Moments of entries that get no gradient are not decayed (the lazy update of
+// torch.optim.SparseAdam), so the cost follows the number of entries. The
+// indices of a coalesced gradient are unique, so entries are updated in
+// parallel without conflicts.
+template <typename scalar_t>
+inline void lut_sparse_adam(scalar_t *param, scalar_t *exp_avg, scalar_t *exp_avg_sq,
+                            const int64_t *indices, const int64_t *strides, const int ndim, const scalar_t *values, const int64_t count,
+                            const int64_t step, const double lr, const double beta1, const double beta2, const double eps)
+{
+    const scalar_t b1 = beta1, b2 = beta2;
+    const scalar_t step_size = lr / (1 - std::pow(beta1, (double)step));
+    const scalar_t bias2_sqrt = std::sqrt(1 - std::pow(beta2, (double)step));
+    const scalar_t epsilon = eps;
+
+    at::parallel_for(0, count, LUT_SPARSE_GRAIN, [&](int64_t begin, int64_t end)
+    {
+        for (int64_t e = begin; e < end; ++e)
+        {
+            const int64_t i = indices ? lut_sparse_offset(indices, strides, ndim, count, e) : e;
+            const scalar_t g = values[e];
+            const scalar_t m = b1 * exp_avg[i] + (1 - b1) * g;
+            const scalar_t v = b2 * exp_avg_sq[i] + (1 - b2) * g * g;
+            exp_avg[i] = m;
+            exp_avg_sq[i] = v;
+            param[i] -= step_size * m / (std::sqrt(v) / bias2_sqrt + epsilon);
+        }
+    });
+}
+
+// Plain SGD step p -= lr * g on the entries of a sparse (or dense) gradient.
+template <typename scalar_t>
+inline void lut_sparse_sgd(scalar_t *param, const int64_t *indices, const int64_t *strides, const int ndim,
+                           const scalar_t *values, const int64_t count, const double lr)
+{
+    const scalar_t rate = lr;
+
+    at::parallel_for(0, count, LUT_SPARSE_GRAIN, [&](int64_t begin, int64_t end)
+    {
+        for (int64_t e = begin; e < end; ++e)
+        {
+            const int64_t i = indices ? lut_sparse_offset(indices, strides, ndim, count, e) : e;
+            param[i] -= rate * values[e];
+        }
+    });
+}
+
+#endif
@@ -0,0 +1,389 @@
+#ifndef LUT_STREAM_H
+#define LUT_STREAM_H
+
+#include <torch/extension.h>
+#include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "lut_image.h"
+
+// Applies a LUT to an image file that does not fit in memory, writing the
+// result to another file of the same format. The image is processed in strips
+// of whole rows through LUT_STREAM_BUFFERS strip buffers: a reader thread
+// fills a free buffer, the calling thread interpolates it in place with the
+// usual row kernels (and the intra-op thread pool), and a writer thread writes
+// it out and hands the buffer back. Reading, interpolating and writing of
+// consecutive strips overlap, and memory use is the buffers, whatever the
+// image size.
+//
+// Formats: binary PPM (P6, maxval 255 or 65535), .npy arrays of shape
+// [height, width, 3] in C order (uint8, uint16 or float32) and headerless raw
+// interleaved RGB, whose size and sample type are given by the caller.
+// Samples are normalized like the tensor path: integers by their maximum,
+// floats clamped to [0, 1].
+#define LUT_STREAM_BUFFERS 3
+
+struct LutStreamImage
+{
+    int width;
+    int height;
+    int sample_bytes; // 1, 2 or 4
+    bool is_float;
+    bool big_endian;
+    std::string header; // copied to the output unchanged
+
+    int64_t row_bytes() const { return (int64_t)width * 3 * sample_bytes; }
+};
+
+inline bool lut_stream_has_suffix(const std::string &path, const char *suffix)
+{
+    const size_t n = std::strlen(suffix);
+    if (path.size() < n)
+        return false;
+    for (size_t i = 0; i < n; ++i)
+        if (std::tolower((unsigned char)path[path.size() - n + i]) != suffix[i])
+            return false;
+    return true;
+}
+
+inline void lut_stream_sample_type(LutStreamImage &image, const std::string &type, const std::string &path)
+{
+    if (type == "uint8" || type == "u1")
+        image.sample_bytes = 1;
+    else if (type == "uint16" || type == "u2")
+        image.sample_bytes = 2;
+    else if (type == "float32" || type == "f4")
+        image.sample_bytes = 4, image.is_float = true;
+    else
+        TORCH_CHECK(false, path, ": unsupported sample type '", type, "', expected uint8, uint16 or float32");
+}
+
+// Reads a whitespace-separated PPM header field, skipping # comments.
+inline int lut_stream_ppm_field(FILE *file, std::string &header, const std::string &path)
+{
+    int c = std::fgetc(file);
+    while (c != EOF && (std::isspace(c) || c == '#'))
+    {
+        header += (char)c;
+        if (c == '#')
+            while ((c = std::fgetc(file)) != EOF && c != '\n')
+                header += (char)c;
+        else
+            c = std::fgetc(file);
+    }
+    int value = 0;
+    TORCH_CHECK(c != EOF && std::isdigit(c), path, ": malformed PPM header");
+    while (c != EOF && std::isdigit(c))
+    {
+        header += (char)c;
+        value = value * 10 + (c - '0');
+        c = std::fgetc(file);
+    }
+    TORCH_CHECK(c != EOF && std::isspace(c), path, ": malformed PPM header");
+    header += (char)c;
+    return value;
+}
+
+// Value of 'key': in a .npy header dict, up to the next ',' or '}' outside
+// parentheses.
+inline std::string lut_stream_npy_field(const std::string &dict, const char *key, const std::string &path)
+{
+    const size_t at = dict.find(std::string("'") + key + "'");
+    TORCH_CHECK(at != std::string::npos, path, ": .npy header has no '", key, "'");
+    size_t begin = dict.find(':', at) + 1;
+    size_t end = begin;
+    for (int depth = 0; end < dict.size() && (depth > 0 || (dict[end] != ',' && dict[end] != '}')); ++end)
+        depth += dict[end] == '(' ? 1 : dict[end] == ')' ? -1 : 0;
+    std::string value = dict.substr(begin, end - begin);
+    value.erase(std::remove_if(value.begin(), value.end(), [](char c)
+                               { return std::isspace((unsigned char)c) || c == '\''; }),
+                value.end());
+    return value;
+}
+
+// Opens path and reads its header, leaving the file at the first pixel.
+// raw_width, raw_height and raw_type describe files that are neither .ppm nor
+// .npy.
+inline FILE *lut_stream_open(const std::string &path, LutStreamImage &image, const int raw_width, const int raw_height, const std::string &raw_type)
+{
+    FILE *file = std::fopen(path.c_str(), "rb");
+    TORCH_CHECK(file != nullptr, "cannot open ", path);
+    image = LutStreamImage{0, 0, 1, false, false, ""};
+
+    try
+    {
+        if (lut_stream_has_suffix(path, ".ppm"))
+        {
+            char magic[2];
+            TORCH_CHECK(std::fread(magic, 1, 2, file) == 2 && magic[0] == 'P' && magic[1] == '6', path, " is not a binary (P6) PPM");
+            image.header = "P6";
+            image.width = lut_stream_ppm_field(file, image.header, path);
+            image.height = lut_stream_ppm_field(file, image.header, path);
+            const int maxval = lut_stream_ppm_field(file, image.header, path);
+            TORCH_CHECK(maxval == 255 || maxval == 65535, path, ": PPM maxval ", maxval, " is not supported, expected 255 or 65535");
+            image.sample_bytes = maxval == 255 ? 1 : 2;
+            image.big_endian = true;
+        }
+        else if (lut_stream_has_suffix(path, ".npy"))
+        {
+            char preamble[10];
+            TORCH_CHECK(std::fread(preamble, 1, 10, file) == 10 && std::memcmp(preamble, "\x93NUMPY", 6) == 0, path, " is not a .npy file");
+            uint32_t length = (uint8_t)preamble[8] | (uint8_t)preamble[9] << 8;
+            image.header.assign(preamble, 10);
+            if (preamble[6] >= 2)
+            {
+                char extra[2];
+                TORCH_CHECK(std::fread(extra, 1, 2, file) == 2, path, ": truncated .npy header");
+                length |= (uint32_t)(uint8_t)extra[0] << 16 | (uint32_t)(uint8_t)extra[1] << 24;
+                image.header.append(extra, 2);
+            }
+            std::string dict(length, ' ');
+            TORCH_CHECK(std::fread(&dict[0], 1, length, file) == length, path, ": truncated .npy header");
+            image.header += dict;
+
+            const std::string descr = lut_stream_npy_field(dict, "descr", path);
+            TORCH_CHECK(descr.size() == 3, path, ": unsupported .npy dtype ", descr);
+            lut_stream_sample_type(image, descr.substr(1), path);
+            image.big_endian = descr[0] == '>';
+            TORCH_CHECK(lut_stream_npy_field(dict, "fortran_order", path) == "False", path, ": Fortran-ordered .npy arrays are not supported");
+            const std::string shape = lut_stream_npy_field(dict, "shape", path);
+            TORCH_CHECK(std::sscanf(shape.c_str(), "(%d,%d,3)", &image.height, &image.width) == 2 && shape.find(",3)") != std::string::npos,
+                        path, ": expected a [height, width, 3] array, got shape ", shape);
+        }
+        else
+        {
+            TORCH_CHECK(raw_width > 0 && raw_height > 0, path, ": raw images need a width and a height");
+            image.width = raw_width;
+            image.height = raw_height;
+            lut_stream_sample_type(image, raw_type, path);
+        }
+        TORCH_CHECK(image.width > 0 && image.height > 0, path, ": empty image");
+    }
+    catch (...)
+    {
+        std::fclose(file);
+        throw;
+    }
+    return file;
+}
+
+// Converts a strip between file byte order and native little-endian samples,
+// and clamps float samples to [0, 1].
+inline void lut_stream_fix_samples(const LutStreamImage &image, char *data, const int64_t count, const bool loading)
+{
+    if (image.big_endian && image.sample_bytes > 1)
+        for (int64_t i = 0; i < count; ++i)
+            std::reverse(data + i * image.sample_bytes, data + (i + 1) * image.sample_bytes);
+    if (image.is_float && loading)
+    {
+        float *v = reinterpret_cast<float *>(data);
+        for (int64_t i = 0; i < count; ++i)
+            v[i] = std::min(std::max(v[i], 0.0f), 1.0f);
+    }
+}
+
+struct LutStreamStrip
+{
+    std::vector<char> data;
+    int row;
+    int rows;
+};
+
+// Blocking queue of buffers; pop() returns nullptr once the queue is closed
+// and empty, which is how the stages tell each other to stop. Queues are
+// bounded by the fixed number of buffers circulating between them. push()
+// returns the depth after the push, for pipeline statistics.
+template <typename T>
+class LutStreamQueue
+{
+public:
+    size_t push(T *item)
+    {
+        size_t depth;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            items_.push_back(item);
+            depth = items_.size();
+        }
+        ready_.notify_one();
+        return depth;
+    }
+
+    T *pop()
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_.wait(lock, [&]
+                    { return !items_.empty() || closed_; });
+        if (items_.empty())
+            return nullptr;
+        T *item = items_.front();
+        items_.pop_front();
+        return item;
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        ready_.notify_all();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<T *> items_;
+    bool closed_ = false;
+};
+
+// Runs the three-stage pipeline; fn(data, rows) interpolates a strip of
+// interleaved native samples in place. The first error of any stage stops all
+// of them and is rethrown here.
+template <typename F>
+inline void lut_stream_strips(const LutStreamImage &image, FILE *input, FILE *output, const int64_t budget, const F &fn)
+{
+    const int64_t row_bytes = image.row_bytes();
+    const int rows = (int)std::min<int64_t>(image.height, std::max<int64_t>(1, budget / LUT_STREAM_BUFFERS / row_bytes));
+    std::vector<LutStreamStrip> strips(LUT_STREAM_BUFFERS);
+    LutStreamQueue<LutStreamStrip> free_strips, read_strips, done_strips;
+    for (LutStreamStrip &strip : strips)
+    {
+        strip.data.resize(rows * row_bytes);
+        free_strips.push(&strip);
+    }
+
+    std::mutex error_mutex;
+    std::exception_ptr error;
+    auto fail = [&]
+    {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error)
+            error = std::current_exception();
+        free_strips.close();
+    };
+
+    std::thread reader([&]
+    {
+        try
+        {
+            for (int row = 0; row < image.height; row += rows)
+            {
+                LutStreamStrip *strip = free_strips.pop();
+                if (strip == nullptr)
+                    break;
+                strip->row = row;
+                strip->rows = std::min(rows, image.height - row);
+                const size_t bytes = strip->rows * row_bytes;
+                TORCH_CHECK(std::fread(strip->data.data(), 1, bytes, input) == bytes, "input image is truncated at row ", row);
+                lut_stream_fix_samples(image, strip->data.data(), bytes / image.sample_bytes, true);
+                read_strips.push(strip);
+            }
+        }
+        catch (...)
+        {
+            fail();
+        }
+        read_strips.close();
+    });
+
+    std::thread writer([&]
+    {
+        try
+        {
+            while (LutStreamStrip *strip = done_strips.pop())
+            {
+                const size_t bytes = strip->rows * row_bytes;
+                lut_stream_fix_samples(image, strip->data.data(), bytes / image.sample_bytes, false);
+                TORCH_CHECK(std::fwrite(strip->data.data(), 1, bytes, output) == bytes, "error writing output rows ", strip->row, "-", strip->row + strip->rows - 1);
+                free_strips.push(strip);
+            }
+        }
+        catch (...)
+        {
+            fail();
+            while (done_strips.pop() != nullptr)
+                ;
+        }
+    });
+
+    try
+    {
+        while (LutStreamStrip *strip = read_strips.pop())
+        {
+            fn(strip->data.data(), strip->rows);
+            done_strips.push(strip);
+        }
+    }
+    catch (...)
+    {
+        fail();
+        while (read_strips.pop() != nullptr)
+            ;
+    }
+    done_strips.close();
+    reader.join();
+    writer.join();
+    if (error)
+        std::rethrow_exception(error);
+}
+
+// Calls fn(image, output, layout, width, rows) with image == output the rows
+// interleaved rows of native samples at data, as uint8_t, uint16_t or float
+// pixels according to the sample type of image.
+template <typename F>
+inline void lut_stream_dispatch(const LutStreamImage &image, char *data, const int rows, const F &fn)
+{
+    const int width = image.width;
+    const LutImageLayout layout = {rows * image.row_bytes() / image.sample_bytes, 1, (int64_t)width * 3, 3};
+    if (image.is_float)
+        fn(reinterpret_cast<const float *>(data), reinterpret_cast<float *>(data), layout, width, rows);
+    else if (image.sample_bytes == 2)
+        fn(reinterpret_cast<const uint16_t *>(data), reinterpret_cast<uint16_t *>(data), layout, width, rows);
+    else
+        fn(reinterpret_cast<const uint8_t *>(data), reinterpret_cast<uint8_t *>(data), layout, width, rows);
+}
+
+// Streams input_path through fn (see lut_stream_dispatch) into output_path,
+// one strip at a time. At most budget bytes of strip buffers are used (one row
+// per buffer at least).
+template <typename F>
+inline int lut_stream_apply(const std::string &input_path, const std::string &output_path, const int raw_width, const int raw_height,
+                            const std::string &raw_type, const int64_t budget, const F &fn)
+{
+    LutStreamImage image;
+    FILE *input = lut_stream_open(input_path, image, raw_width, raw_height, raw_type);
+    FILE *output = std::fopen(output_path.c_str(), "wb");
+    if (output == nullptr)
+        std::fclose(input);
+    TORCH_CHECK(output != nullptr, "cannot create ", output_path);
+
+    try
+    {
+        TORCH_CHECK(std::fwrite(image.header.data(), 1, image.header.size(), output) == image.header.size(), "error writing ", output_path);
+        lut_stream_strips(image, input, output, budget, [&](char *data, const int rows)
+        {
+            lut_stream_dispatch(image, data, rows, fn);
+        });
+    }
+    catch (...)
+    {
+        std::fclose(input);
+        std::fclose(output);
+        throw;
+    }
+    std::fclose(input);
+    TORCH_CHECK(std::fclose(output) == 0, "error writing ", output_path);
+    return 1;
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef LUT_TABLE_H
+#define LUT_TABLE_H
+
+#include <torch/extension.h>
+#include <cstdint>
+#include "lut_image.h"
+#include "lut_parallel.h"
+
+// Dense table of a LUT for 8-bit images: one entry per input colour, indexed
+// like the LUT nodes (r * 256 * 256 + g * 256 + b). An entry holds the output
+// bytes R | G << 8 | B << 16 in a uint32, so a pixel is one aligned load.
+// The table is 64 MB; torch has no uint32 dtype, so it lives in an int32
+// tensor of LUT_TABLE_SIZE elements.
+#define LUT_TABLE_SIZE (256 * 256 * 256)
+
+// Fills the table by running row_fn(image, output, plane, width), the planar
+// row kernel of the uint8 forward pass, over all 256 blue values of every
+// (r, g) pair, with the same uint8 load and rounding. Each entry is therefore
+// exactly what forward returns for that colour.
+template <typename scalar_t, typename F>
+inline void lut_table_bake(uint32_t *table, const F &row_fn)
+{
+    lut_parallel_rows(256, 256, 256, [&](const int r, const int g)
+    {
+        scalar_t *row = lut_row_buffer<scalar_t>(256);
+        for (int b = 0; b < 256; ++b)
+        {
+            row[b] = LutPixel<uint8_t>::template load<scalar_t>(r);
+            row[b + 256] = LutPixel<uint8_t>::template load<scalar_t>(g);
+            row[b + 512] = LutPixel<uint8_t>::template load<scalar_t>(b);
+        }
+
+        const scalar_t *out = row + 256 * 3;
+        row_fn(row, row + 256 * 3, 256, 256);
+
+        uint32_t *entry = table + ((r << 16) | (g << 8));
+        for (int b = 0; b < 256; ++b)
+            entry[b] = (uint32_t)LutPixel<uint8_t>::template store<scalar_t>(out[b]) |
+                       (uint32_t)LutPixel<uint8_t>::template store<scalar_t>(out[b + 256]) << 8 |
+                       (uint32_t)LutPixel<uint8_t>::template store<scalar_t>(out[b + 512]) << 16;
+    });
+}
+
+// Forward pass of a baked table on a uint8 image: a gather per pixel.
+inline void lut_table_forward(const uint32_t *table, const uint8_t *image, uint8_t *output, const LutImageLayout &image_layout, const LutImageLayout &output_layout, const int width, const int height, const int batch)
+{
+    lut_parallel_rows(batch, height, width, [&](const int batch_index, const int h)
+    {
+        const uint8_t *in = image + image_layout.offset(batch_index, 0, h, 0);
+        uint8_t *out = output + output_layout.offset(batch_index, 0, h, 0);
+
+        for (int w = 0; w < width; ++w)
+        {
+            const uint8_t *pixel = in + w * image_layout.col;
+            const uint32_t v = table[pixel[0] << 16 | pixel[image_layout.channel] << 8 | pixel[image_layout.channel * 2]];
+
+            uint8_t *o = out + w * output_layout.col;
+            o[0] = v;
+            o[output_layout.channel] = v >> 8;
+            o[output_layout.channel * 2] = v >> 16;
+        }
+    });
+}
+
+// Checked entry points shared by the trilinear and tetrahedral modules.
+inline uint32_t *lut_table_data(const torch::Tensor &table)
+{
+    TORCH_CHECK(table.scalar_type() == at::kInt && table.numel() == LUT_TABLE_SIZE && table.is_contiguous(),
+                "baked table must be a contiguous int32 tensor of 256^3 elements");
+    return reinterpret_cast<uint32_t *>(table.data_ptr<int32_t>());
+}
+
+inline int lut_table_forward_image(const torch::Tensor &table, const torch::Tensor &image, const torch::Tensor &output, const int width, const int height, const int batch)
+{
+    TORCH_CHECK(image.scalar_type() == at::kByte && output.scalar_type() == at::kByte, "baked table forward needs uint8 images");
+    lut_table_forward(lut_table_data(table), image.data_ptr<uint8_t>(), output.data_ptr<uint8_t>(),
+                      lut_image_layout(image), lut_image_layout(output), width, height, batch);
+    return 1;
+}
+
+#endif
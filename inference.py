@@ -12,10 +12,9 @@ def inference(lut, img_file):
     if not os.path.exists(save_dir):
         os.makedirs(save_dir)
     img = cv2.imread(img_file)
-    img = cv2.cvtColor(img, cv2.COLOR_BGR2RGB).astype(np.float32)
-    img /= 255.
-    img = np.expand_dims(img, 0)
-    img = torch.tensor(img)
+    img = cv2.cvtColor(img, cv2.COLOR_BGR2RGB)
+    # NCHW view of the HWC array; the kernels read it in place.
+    img = torch.from_numpy(img).unsqueeze(0)
     img = torch.permute(img, (0,3,1,2))
     
     with torch.no_grad():
@@ -23,8 +22,9 @@ def inference(lut, img_file):
         imgS = new_img.cpu().detach()
         imgS = torch.squeeze(imgS)
         imgS = torch.permute(imgS, (1,2,0)).numpy()
-        imgS *= 255
-        imgS = imgS.astype(np.uint8)
+        # Back to BGR for cv2, so the output colours match the PNGs written by
+        # batch_lut3d.
+        imgS = cv2.cvtColor(np.ascontiguousarray(imgS), cv2.COLOR_RGB2BGR)
         cv2.imwrite(os.path.join(save_dir, basenmae), imgS)
         
 
@@ -36,5 +36,17 @@ if __name__=='__main__':
     test_img_dir = 'test_imgs'
     file_list = glob.glob(os.path.join(test_img_dir, "*"))
     file_list = list(filter(lambda x: x.endswith("jpg") or x.endswith("png") or x.endswith("jpeg"), file_list))
-    for file in tqdm(file_list):
-        inference(lut, file)
+    # PNGs go through the pipelined C++ engine when the build reads PNG
+    # itself; JPEGs, and PNGs otherwise, take the cv2 loop.
+    png_list = [file for file in file_list if file.endswith("png")] if batch_png() else []
+    if png_list:
+        if not os.path.exists('test_output'):
+            os.makedirs('test_output')
+        stats = batch_lut3d(lut.LUT, png_list, 'test_output')
+        for stage in ('decode', 'apply', 'encode'):
+            print("{:>7}: {:6.1f} images/s, mean queue depth {:.1f}".format(
+                stage, stats[stage]['images_per_second'], stats[stage]['mean_queue_depth']))
+    # Classified once; curve-only LUTs then take the 1D path on every image.
+    applied = SeparableLut3D(lut.LUT)
+    for file in tqdm([file for file in file_list if file not in png_list]):
+        inference(applied, file)
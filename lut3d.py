@@ -1,24 +1,62 @@
+import os
 import torch
 import torch.nn as nn
 import trilinear
 import tetrahedral
+from lut_regularizer import LutRegularizerFunction, regularizer_backend
+
+def image_arg(x: torch.Tensor):
+    # The CPU kernels address pixels through the tensor's strides, so NCHW,
+    # channels-last (e.g. a permuted HWC numpy array) and other views are used
+    # in place. The CUDA kernels expect planar contiguous images.
+    return x.contiguous() if x.is_cuda else x
+
+def sparse_lut_coo(indices: torch.Tensor, values: torch.Tensor, size):
+    # Coalesced COO tensor for SparseLutAdam / SparseLutSGD (or
+    # torch.optim.SparseAdam); the backends return sorted, unique indices.
+    return torch.sparse_coo_tensor(indices, values, size)._coalesced_(True)
+
+def sparse_lut_grad(d_lut: torch.Tensor, backend=trilinear):
+    # Sparse form of a dense LUT gradient, over its nodes with a nonzero value.
+    indices, values = backend.sparse_grad(d_lut.contiguous(), d_lut.size()[-1])
+    return sparse_lut_coo(indices, values, d_lut.size())
 
 class Lut3D(nn.Module):
-    def __init__(self, dim=17):
+    def __init__(self, dim=17, sparse_grad=False):
         super(Lut3D, self).__init__()
 
         self.LUT = torch.ones((3,dim,dim,dim), dtype=torch.float)
         self.LUT = nn.Parameter(self.LUT, requires_grad=True)
-        self.interpolation = TrilinearInterpolation()
+        # With sparse_grad the CPU backward returns the LUT gradient as a
+        # sparse tensor over the touched nodes, see SparseLutAdam.
+        self.sparse_grad = sparse_grad
 
     def forward(self, x):
-        x = torch.clamp(x, 0, 1)
-        _, output = self.interpolation(self.LUT, x)
+        # uint8 / uint16 images are interpolated natively and are
+        # already within range.
+        if x.is_floating_point():
+            x = torch.clamp(x, 0, 1)
+        if x.is_cuda:
+            return self.interpolate_cuda(x)
+        if self.sparse_grad and x.is_floating_point():
+            return self.interpolate_sparse(x)
+        # Registered operator with C++ autograd (common/lut_op.h): no Python
+        # on the call path, and scriptable with torch.jit.script.
+        return torch.ops.trilinear.interpolate(self.LUT, x)
 
+    @torch.jit.unused
+    def interpolate_cuda(self, x):
+        _, output = TrilinearInterpolationFunction.apply(self.LUT, x)
         return output
+
+    @torch.jit.unused
+    def interpolate_sparse(self, x):
+        return SparseLut3DFunction.apply(self.LUT, x)
     
     @staticmethod
     def lut_loss(lut):
+        if not lut.is_cuda and regularizer_backend() is not None:
+            return LutRegularizerFunction.apply(lut, 3)
         less = (lut[(lut < 0)]) ** 2
         upper = (lut[(lut > 1)] - 1) ** 2
         dx = lut[:, :-1, :, :] - lut[:, 1:, :, :]
@@ -31,7 +69,8 @@ class Lut3D(nn.Module):
 class TrilinearInterpolationFunction(torch.autograd.Function):
     @staticmethod
     def forward(ctx, lut: torch.Tensor, x: torch.Tensor):
-        output = x.new(x.size()).contiguous()
+        x = image_arg(x)
+        output = torch.empty_like(x)
         dim = lut.size()[-1]
         shift = dim ** 3
         binsize = 1.000001 / (dim-1)
@@ -42,7 +81,7 @@ class TrilinearInterpolationFunction(torch.autograd.Function):
         assert C == 3, "Can only interpolate 3D images!"
         
         trilinear.forward(lut.contiguous(), 
-                            x.contiguous(), 
+                            x, 
                             output,
                             dim, 
                             shift, 
@@ -69,9 +108,26 @@ class TrilinearInterpolationFunction(torch.autograd.Function):
         binsize = float(float_package[0])
         d_lut = lut_grad.detach().clone() 
         
-        if ctx.needs_input_grad[0]:
-            assert 1 == trilinear.backward(x.contiguous(), 
-                                        x_grad.contiguous(), 
+        if ctx.needs_input_grad[1] and x.is_floating_point() and not x.is_cuda:
+            # The CPU backward also returns the gradient of the image, in the
+            # same pass over the pixels as the LUT gradient.
+            d_x = torch.empty_like(x)
+            assert 1 == trilinear.backward_input(lut.contiguous(),
+                                        x,
+                                        image_arg(x_grad),
+                                        d_lut,
+                                        d_x,
+                                        dim,
+                                        shift,
+                                        binsize,
+                                        W,
+                                        H,
+                                        batch)
+            return d_lut, d_x
+
+        if ctx.needs_input_grad[0] and x.is_floating_point():
+            assert 1 == trilinear.backward(image_arg(x), 
+                                        image_arg(x_grad), 
                                         d_lut.contiguous(),
                                         dim, 
                                         shift, 
@@ -94,7 +150,8 @@ class TrilinearInterpolation(torch.nn.Module):
 class TetrahedralInterpolationFunction(torch.autograd.Function):
     @staticmethod
     def forward(ctx, lut: torch.Tensor, x: torch.Tensor):
-        output = x.new(x.size()).contiguous()
+        x = image_arg(x)
+        output = torch.empty_like(x)
         dim = lut.size()[-1]
         shift = dim ** 3
         binsize = 1.000001 / (dim-1)
@@ -105,7 +162,7 @@ class TetrahedralInterpolationFunction(torch.autograd.Function):
         assert C == 3, "Can only interpolate 3D images!"
         
         tetrahedral.forward(lut.contiguous(), 
-                            x.contiguous(), 
+                            x, 
                             output,
                             dim, 
                             shift, 
@@ -131,9 +188,25 @@ class TetrahedralInterpolationFunction(torch.autograd.Function):
         dim, shift, W, H, batch = int(dim), int(shift), int(W), int(H), int(batch)
         binsize = float(float_package[0])
         d_lut = lut_grad.detach().clone() 
-        if ctx.needs_input_grad[0]:
-            assert 1 == trilinear.backward(x.contiguous(), 
-                                        x_grad.contiguous(), 
+
+        if ctx.needs_input_grad[1] and x.is_floating_point() and not x.is_cuda:
+            d_x = torch.empty_like(x)
+            assert 1 == tetrahedral.backward_input(lut.contiguous(),
+                                        x,
+                                        image_arg(x_grad),
+                                        d_lut,
+                                        d_x,
+                                        dim,
+                                        shift,
+                                        binsize,
+                                        W,
+                                        H,
+                                        batch)
+            return d_lut, d_x
+
+        if ctx.needs_input_grad[0] and x.is_floating_point():
+            assert 1 == tetrahedral.backward(image_arg(x), 
+                                        image_arg(x_grad), 
                                         d_lut.contiguous(),
                                         dim, 
                                         shift, 
@@ -150,3 +223,636 @@ class TetrahedralInterpolation(torch.nn.Module):
 
     def forward(self, lut, x):
         return TetrahedralInterpolationFunction.apply(lut, x)
+
+
+class ShaperLut3DFunction(torch.autograd.Function):
+    """Per-channel 1D shaper ([dim1] shared or [3, dim1]), clamp and 3D LUT in one pass (CPU).
+
+    Same values as Lut1D -> clamp -> Lut3D; the backward returns the gradients
+    of both LUTs, pulling the image gradient back through the 3D interpolation
+    to reach the shaper.
+    """
+    @staticmethod
+    def forward(ctx, shaper: torch.Tensor, lut: torch.Tensor, x: torch.Tensor, mode='trilinear'):
+        backend = trilinear if mode == 'trilinear' else tetrahedral
+        x = image_arg(x)
+        output = torch.empty_like(x)
+        shaper_dim = shaper.size()[-1]
+        dim = lut.size()[-1]
+        shift = dim ** 3
+        binsize = 1.000001 / (dim-1)
+        batch = x.size(0)
+        C = x.size(1)
+        H = x.size(2)
+        W = x.size(3)
+        assert C == 3, "Can only interpolate 3D images!"
+
+        backend.shaper_forward(shaper.contiguous(), lut.contiguous(), x, output,
+                               shaper_dim, dim, shift, binsize, W, H, batch)
+
+        ctx.backend = backend
+        ctx.save_for_backward(shaper, lut, x)
+        return output
+
+    @staticmethod
+    def backward(ctx, x_grad: torch.Tensor):
+        shaper, lut, x = ctx.saved_tensors
+        shaper_dim = shaper.size()[-1]
+        dim = lut.size()[-1]
+        shift = dim ** 3
+        binsize = 1.000001 / (dim-1)
+        d_shaper = torch.zeros_like(shaper, memory_format=torch.contiguous_format)
+        d_lut = torch.zeros_like(lut, memory_format=torch.contiguous_format)
+
+        assert 1 == ctx.backend.shaper_backward(shaper.contiguous(), lut.contiguous(), x, image_arg(x_grad),
+                                                d_shaper, d_lut, shaper_dim, dim, shift, binsize,
+                                                x.size(3), x.size(2), x.size(0))
+        return d_shaper, d_lut, None, None
+
+
+class BlendLut3DFunction(torch.autograd.Function):
+    """Interpolates sample b against sum_n weights[b, n] * basis[n] (CPU).
+
+    basis is [N, 3, dim, dim, dim] and weights [B, N], as predicted by the
+    classifier of Image-Adaptive-3DLUT. The blended LUTs never exist as
+    tensors; the backward returns the gradients of the basis and the weights
+    (and of x, when it requires one).
+    """
+    @staticmethod
+    def forward(ctx, basis: torch.Tensor, weights: torch.Tensor, x: torch.Tensor, mode='trilinear'):
+        backend = trilinear if mode == 'trilinear' else tetrahedral
+        x = image_arg(x)
+        output = torch.empty_like(x)
+        dim = basis.size()[-1]
+        shift = dim ** 3
+        binsize = 1.000001 / (dim-1)
+        batch = x.size(0)
+        C = x.size(1)
+        H = x.size(2)
+        W = x.size(3)
+        assert C == 3, "Can only interpolate 3D images!"
+        assert weights.size() == (batch, basis.size(0)), "weights must be [batch, N]"
+
+        backend.blend_forward(basis.contiguous(), weights.contiguous(), x, output,
+                              dim, shift, binsize, W, H, batch)
+
+        ctx.backend = backend
+        ctx.save_for_backward(basis, weights, x)
+        return output
+
+    @staticmethod
+    def backward(ctx, x_grad: torch.Tensor):
+        basis, weights, x = ctx.saved_tensors
+        dim = basis.size()[-1]
+        shift = dim ** 3
+        binsize = 1.000001 / (dim-1)
+        d_basis = torch.zeros_like(basis, memory_format=torch.contiguous_format)
+        d_weights = torch.zeros_like(weights, memory_format=torch.contiguous_format)
+        d_x = torch.empty_like(x) if ctx.needs_input_grad[2] else None
+
+        assert 1 == ctx.backend.blend_backward(basis.contiguous(), weights.contiguous(), x, image_arg(x_grad),
+                                               d_basis, d_weights, d_x, dim, shift, binsize,
+                                               x.size(3), x.size(2), x.size(0))
+        return d_basis, d_weights, d_x, None
+
+
+class SparseLut3DFunction(torch.autograd.Function):
+    """Lut3D interpolation whose backward returns a sparse LUT gradient (CPU).
+
+    The forward is that of forward. The backward scatters like backward, but
+    lists the lattice cells the pixels reach and sums the gradient at their
+    nodes only (backward_sparse), so no dense LUT gradient is built and
+    SparseLutAdam only updates those nodes.
+    """
+    @staticmethod
+    def forward(ctx, lut: torch.Tensor, x: torch.Tensor, mode='trilinear'):
+        backend = trilinear if mode == 'trilinear' else tetrahedral
+        x = image_arg(x)
+        output = torch.empty_like(x)
+        dim = lut.size()[-1]
+        shift = dim ** 3
+        binsize = 1.000001 / (dim-1)
+        batch = x.size(0)
+        C = x.size(1)
+        H = x.size(2)
+        W = x.size(3)
+        assert C == 3, "Can only interpolate 3D images!"
+
+        backend.forward(lut.contiguous(), x, output, dim, shift, binsize, W, H, batch)
+
+        ctx.backend = backend
+        ctx.save_for_backward(lut, x)
+        return output
+
+    @staticmethod
+    def backward(ctx, x_grad: torch.Tensor):
+        lut, x = ctx.saved_tensors
+        dim = lut.size()[-1]
+        shift = dim ** 3
+        binsize = 1.000001 / (dim-1)
+        d_x = torch.empty_like(x) if ctx.needs_input_grad[1] else None
+
+        indices, values = ctx.backend.backward_sparse(lut.contiguous(), x, image_arg(x_grad), d_x,
+                                                      dim, shift, binsize, x.size(3), x.size(2), x.size(0))
+        return sparse_lut_coo(indices, values, lut.size()), d_x, None
+
+
+class Lut3DLossFunction(torch.autograd.Function):
+    """Mean L1 / L2 loss of Lut3D(x) against target and its LUT gradient in one pass (CPU).
+
+    Equals criterion(lut(x), target) with criterion nn.L1Loss / nn.MSELoss, but the
+    interpolated image and its gradient are never materialized: the LUT
+    gradient is accumulated while the loss is computed, and the backward only
+    scales it. x is clamped to [0, 1] as in Lut3D.forward and receives no
+    gradient. With sparse=True the LUT gradient is a sparse tensor over the
+    touched nodes.
+    """
+    @staticmethod
+    def forward(ctx, lut: torch.Tensor, x: torch.Tensor, target: torch.Tensor, norm='l1', mode='trilinear', sparse=False):
+        backend = trilinear if mode == 'trilinear' else tetrahedral
+        x = image_arg(x)
+        dim = lut.size()[-1]
+        shift = dim ** 3
+        binsize = 1.000001 / (dim-1)
+        batch = x.size(0)
+        C = x.size(1)
+        H = x.size(2)
+        W = x.size(3)
+        assert C == 3, "Can only interpolate 3D images!"
+        assert norm in ('l1', 'l2'), "norm must be 'l1' or 'l2'"
+
+        if sparse:
+            loss, indices, values = backend.loss_backward_sparse(lut.contiguous(), x, image_arg(target),
+                                                                 1 if norm == 'l1' else 2, dim, shift, binsize, W, H, batch)
+            d_lut = sparse_lut_coo(indices, values, lut.size())
+        else:
+            d_lut = torch.zeros_like(lut, memory_format=torch.contiguous_format)
+            loss = backend.loss_backward(lut.contiguous(), x, image_arg(target), d_lut,
+                                         1 if norm == 'l1' else 2, dim, shift, binsize, W, H, batch)
+
+        ctx.save_for_backward(d_lut)
+        return lut.new_tensor(loss)
+
+    @staticmethod
+    def backward(ctx, loss_grad: torch.Tensor):
+        d_lut, = ctx.saved_tensors
+        return d_lut * loss_grad, None, None, None, None, None
+
+
+class SparseLutAdam(torch.optim.Optimizer):
+    """Adam for LUT parameters that only updates the entries of a sparse gradient.
+
+    Sparse gradients (Lut3D(sparse_grad=True), Lut3DLossFunction with
+    sparse=True) update only the touched nodes, and the moments of the other
+    nodes are left as they are, like torch.optim.SparseAdam; the step then
+    costs time in proportion to the nodes the batch reaches rather than to
+    dim^3. Dense gradients, e.g. once Lut3D.lut_loss is added, take a regular
+    Adam step. Parameters must be contiguous CPU tensors.
+    """
+    def __init__(self, params, lr=1e-3, betas=(0.9, 0.999), eps=1e-8):
+        super(SparseLutAdam, self).__init__(params, dict(lr=lr, betas=betas, eps=eps))
+
+    @torch.no_grad()
+    def step(self, closure=None):
+        loss = None
+        if closure is not None:
+            with torch.enable_grad():
+                loss = closure()
+        for group in self.param_groups:
+            beta1, beta2 = group['betas']
+            for p in group['params']:
+                if p.grad is None:
+                    continue
+                state = self.state[p]
+                if len(state) == 0:
+                    state['step'] = 0
+                    state['exp_avg'] = torch.zeros_like(p, memory_format=torch.contiguous_format)
+                    state['exp_avg_sq'] = torch.zeros_like(p, memory_format=torch.contiguous_format)
+                state['step'] += 1
+                grad = p.grad.coalesce() if p.grad.is_sparse else p.grad
+                assert 1 == trilinear.sparse_adam(p, state['exp_avg'], state['exp_avg_sq'],
+                                                  grad.indices() if grad.is_sparse else None,
+                                                  grad.values() if grad.is_sparse else grad,
+                                                  state['step'], group['lr'], beta1, beta2, group['eps'])
+        return loss
+
+
+class SparseLutSGD(torch.optim.Optimizer):
+    """Plain SGD that only updates the entries of a sparse gradient (see SparseLutAdam)."""
+    def __init__(self, params, lr=1e-3):
+        super(SparseLutSGD, self).__init__(params, dict(lr=lr))
+
+    @torch.no_grad()
+    def step(self, closure=None):
+        loss = None
+        if closure is not None:
+            with torch.enable_grad():
+                loss = closure()
+        for group in self.param_groups:
+            for p in group['params']:
+                if p.grad is None:
+                    continue
+                grad = p.grad.coalesce() if p.grad.is_sparse else p.grad
+                assert 1 == trilinear.sparse_sgd(p, grad.indices() if grad.is_sparse else None,
+                                                 grad.values() if grad.is_sparse else grad, group['lr'])
+        return loss
+
+
+def fanout_lut3d(luts, x: torch.Tensor, mode='trilinear'):
+    """Applies each of K LUTs of the same dim to x in one pass (CPU).
+
+    luts is a [K, 3, dim, dim, dim] tensor or a list of [3, dim, dim, dim]
+    LUTs; returns [K, B, 3, H, W] with the dtype of x, where output k equals
+    the forward pass with LUT k. Pixels are read and their cells found once
+    per group of LUTs instead of once per LUT.
+    """
+    backend = trilinear if mode == 'trilinear' else tetrahedral
+    if not torch.is_tensor(luts):
+        luts = torch.stack([lut.detach() for lut in luts])
+    luts = luts.detach().contiguous()
+    x = image_arg(x)
+    assert x.size(1) == 3, "Can only interpolate 3D images!"
+    if x.is_floating_point():
+        x = torch.clamp(x, 0, 1)
+    output = x.new_empty((luts.size(0),) + tuple(x.size()))
+    backend.fanout_forward(luts, x, output, luts.size(-1), x.size(3), x.size(2), x.size(0))
+    return output
+
+
+class MaskLut3DFunction(torch.autograd.Function):
+    """Interpolates each pixel against a mask-weighted blend of K LUTs (CPU).
+
+    luts is [K, 3, dim, dim, dim] and mask [B, K, H, W] with one weight per
+    LUT, or [B, K - 1, H, W], where LUT 0 takes 1 - sum of the others: for two
+    LUTs and a [B, 1, H, W] mask m the output is (1 - m) * lut_0(x) + m * lut_1(x),
+    as for local grading with a skin or sky mask. The image is read and the
+    output written once, and the backward returns the gradients of the LUTs,
+    the mask and x.
+    """
+    @staticmethod
+    def forward(ctx, luts: torch.Tensor, mask: torch.Tensor, x: torch.Tensor, mode='trilinear'):
+        backend = trilinear if mode == 'trilinear' else tetrahedral
+        x = image_arg(x)
+        output = torch.empty_like(x)
+        dim = luts.size()[-1]
+        batch = x.size(0)
+        C = x.size(1)
+        H = x.size(2)
+        W = x.size(3)
+        assert C == 3, "Can only interpolate 3D images!"
+        assert mask.size(0) == batch and mask.size()[2:] == x.size()[2:], "mask must be [B, K or K - 1, H, W]"
+
+        backend.mask_forward(luts.contiguous(), mask, x, output, dim, W, H, batch)
+
+        ctx.backend = backend
+        ctx.save_for_backward(luts, mask, x)
+        return output
+
+    @staticmethod
+    def backward(ctx, x_grad: torch.Tensor):
+        luts, mask, x = ctx.saved_tensors
+        d_luts = torch.zeros_like(luts, memory_format=torch.contiguous_format)
+        d_mask = torch.empty_like(mask) if ctx.needs_input_grad[1] else None
+        d_x = torch.empty_like(x) if ctx.needs_input_grad[2] else None
+
+        assert 1 == ctx.backend.mask_backward(luts.contiguous(), mask, x, image_arg(x_grad), d_luts, d_mask, d_x,
+                                              luts.size(-1), x.size(3), x.size(2), x.size(0))
+        return d_luts, d_mask, d_x, None
+
+
+def mask_lut3d(luts, mask: torch.Tensor, x: torch.Tensor, mode='trilinear'):
+    """Clamps x and applies MaskLut3DFunction; luts may be a list of [3, dim, dim, dim] LUTs."""
+    if not torch.is_tensor(luts):
+        luts = torch.stack(list(luts))
+    if x.is_floating_point():
+        x = torch.clamp(x, 0, 1)
+    return MaskLut3DFunction.apply(luts, mask, x, mode)
+
+
+def stream_lut3d(lut: torch.Tensor, src, dst, mode='trilinear', width=0, height=0, dtype='', budget=64 << 20):
+    """Applies lut to the image file src and writes the result to dst (CPU).
+
+    src is a binary PPM (8 or 16 bit), a [H, W, 3] .npy array (uint8, uint16
+    or float32) or raw interleaved RGB, for which width, height and dtype
+    ('uint8', 'uint16' or 'float32') must be given; dst gets the same format.
+    The image is never fully loaded: strips of rows go through at most budget
+    bytes of buffers, with reading and writing overlapped with interpolation,
+    so images larger than memory can be processed.
+    """
+    backend = trilinear if mode == 'trilinear' else tetrahedral
+    dim = lut.size(-1)
+    backend.stream_forward(lut.detach(), src, dst, dim, dim ** 3, 1.000001 / (dim - 1), width, height, dtype, budget)
+
+
+def batch_lut3d(lut: torch.Tensor, files, output_dir, mode='trilinear', workers=2, depth=0):
+    """Applies lut to every image file in files, writing the results to output_dir (CPU).
+
+    Decoding, interpolation and encoding run as overlapping stages: workers
+    threads decode and workers threads encode while the LUT is applied to the
+    images in between, through a pool of depth (default 2 * workers + 1)
+    reused image buffers. Reads PNG (8/16 bit, when built with libpng), PPM
+    and [H, W, 3] .npy files, and writes each in its own format. Returns the
+    per-stage statistics: images, busy seconds, throughput and the depth of
+    the queue in front of the stage. CUDA builds, which have no batch engine,
+    process the files one by one with batch_lut3d_sequential.
+    """
+    backend = trilinear if mode == 'trilinear' else tetrahedral
+    if not hasattr(backend, 'batch_forward'):
+        # CUDA builds have no batch engine.
+        return batch_lut3d_sequential(lut, files, output_dir, mode)
+    dim = lut.size(-1)
+    return backend.batch_forward(lut.detach(), list(files), output_dir, dim, dim ** 3, 1.000001 / (dim - 1), workers, depth)
+
+
+def batch_png(mode='trilinear'):
+    """Whether batch_lut3d decodes and encodes PNG files in the C++ engine,
+    i.e. the extension is a CPU build compiled against libpng."""
+    backend = trilinear if mode == 'trilinear' else tetrahedral
+    return hasattr(backend, 'batch_forward') and backend.batch_png()
+
+
+def batch_lut3d_sequential(lut: torch.Tensor, files, output_dir, mode='trilinear'):
+    """batch_lut3d for builds without the batch engine.
+
+    Each file is decoded with cv2 (PNG, PPM) or numpy (.npy), interpolated
+    by the Function of mode on the LUT's device, as Lut3D does, and written
+    in its own format, one stage after the other. Integer images are
+    converted to float and rounded back. Returns the same statistics, with
+    one thread per stage and empty queues.
+    """
+    import time
+    import numpy as np
+    import cv2
+    function = TrilinearInterpolationFunction if mode == 'trilinear' else TetrahedralInterpolationFunction
+    lut = lut.detach()
+    busy = {'decode': 0.0, 'apply': 0.0, 'encode': 0.0}
+    images = 0
+    pixels = 0
+    start = time.perf_counter()
+    for path in files:
+        assert path.endswith(('.png', '.ppm', '.npy')), path + ": unsupported format, expected .png, .ppm or .npy"
+        begin = time.perf_counter()
+        if path.endswith('.npy'):
+            img = np.load(path)
+        else:
+            img = cv2.imread(path, cv2.IMREAD_COLOR | cv2.IMREAD_ANYDEPTH)
+            assert img is not None, path + ": cannot decode"
+            img = cv2.cvtColor(img, cv2.COLOR_BGR2RGB)
+        decoded = time.perf_counter()
+
+        maxval = float(np.iinfo(img.dtype).max) if np.issubdtype(img.dtype, np.integer) else 1.0
+        x = torch.from_numpy(img.astype(np.float32) / maxval).permute(2, 0, 1).unsqueeze(0)
+        with torch.no_grad():
+            _, y = function.apply(lut, torch.clamp(x.to(lut.device), 0, 1))
+        y = y[0].permute(1, 2, 0).cpu().numpy()
+        if maxval != 1.0:
+            y = np.clip(np.floor(y * maxval + 0.5), 0, maxval).astype(img.dtype)
+        applied = time.perf_counter()
+
+        dst = os.path.join(output_dir, os.path.basename(path))
+        if path.endswith('.npy'):
+            np.save(dst, y)
+        else:
+            assert cv2.imwrite(dst, cv2.cvtColor(y, cv2.COLOR_RGB2BGR)), "error writing " + dst
+        encoded = time.perf_counter()
+
+        busy['decode'] += decoded - begin
+        busy['apply'] += applied - decoded
+        busy['encode'] += encoded - applied
+        images += 1
+        pixels += img.shape[0] * img.shape[1]
+
+    wall = time.perf_counter() - start
+    stats = {stage: {'images': images, 'threads': 1, 'busy_seconds': seconds,
+                     'images_per_second': images / seconds if seconds > 0 else 0,
+                     'megapixels_per_second': pixels * 1e-6 / seconds if seconds > 0 else 0,
+                     'mean_queue_depth': 0, 'max_queue_depth': 0}
+             for stage, seconds in busy.items()}
+    stats['total'] = {'images': len(files), 'wall_seconds': wall, 'images_per_second': len(files) / wall if wall > 0 else 0}
+    return stats
+
+
+def bake_lut_chain(stages, dim=33, mode='trilinear', test_dim=64):
+    """Compose 3D LUTs ([3,d,d,d]) and 1D curves ([d] or [3,d]) into one [3,dim,dim,dim] LUT (CPU).
+
+    Each stage clamps its input to [0, 1] like Lut3D / Lut1D, and the chain is
+    evaluated at the lattice nodes with the chosen interpolation. Also returns
+    the max / mean absolute error of the baked LUT against the exact chain on
+    a test_dim^3 grid of cell centres.
+    """
+    backend = trilinear if mode == 'trilinear' else tetrahedral
+    stages = [stage.detach().contiguous() for stage in stages]
+    baked = stages[0].new_empty((3, dim, dim, dim))
+    backend.bake(stages, baked, dim)
+
+    axis = (torch.arange(test_dim, dtype=baked.dtype) + 0.5) / test_dim
+    r, g, b = torch.meshgrid(axis, axis, axis, indexing='ij')
+    grid = torch.stack((r, g, b)).reshape(1, 3, test_dim * test_dim, test_dim)
+    exact = torch.empty_like(grid)
+    backend.chain_forward(stages, grid, exact, test_dim, test_dim * test_dim, 1)
+    approx = torch.empty_like(grid)
+    backend.forward(baked, grid, approx, dim, dim ** 3, 1.000001 / (dim - 1), test_dim, test_dim * test_dim, 1)
+
+    error = (exact - approx).abs()
+    return baked, {'max_error': error.max().item(), 'mean_error': error.mean().item()}
+
+
+class PackedLut3D(object):
+    """Inference handle holding a node-interleaved copy ([dim,dim,dim,4]) of a LUT.
+
+    The packed table is rebuilt only when the source LUT changes in place
+    (tracked by its version counter), so one handle can serve every frame.
+    """
+    def __init__(self, lut: torch.Tensor, mode='trilinear'):
+        self.lut = lut
+        self.backend = trilinear if mode == 'trilinear' else tetrahedral
+        self.packed = None
+        self.version = None
+
+    def pack(self):
+        lut = self.lut.detach()
+        if self.packed is None or self.version != lut._version:
+            dim = lut.size()[-1]
+            self.packed = lut.new_empty((dim, dim, dim, 4))
+            self.backend.pack_lut(lut.contiguous(), self.packed, dim)
+            self.version = lut._version
+        return self.packed
+
+    def __call__(self, x: torch.Tensor):
+        packed = self.pack()
+        x = image_arg(x)
+        output = torch.empty_like(x)
+        dim = self.lut.size()[-1]
+        batch = x.size(0)
+        H = x.size(2)
+        W = x.size(3)
+        assert x.size(1) == 3, "Can only interpolate 3D images!"
+
+        self.backend.forward_packed(packed, x, output, dim, W, H, batch)
+        return output
+
+
+class TableLut3D(object):
+    """Inference handle holding a dense 256^3 table of a LUT for uint8 images.
+
+    Baking interpolates every one of the 2^24 input colours once (in parallel)
+    into a 64 MB table of RGB8 entries; forward is then one table read per
+    pixel and equals the interpolated uint8 output exactly. The table is
+    re-baked only when the LUT changes, so the cost is paid once per video or
+    dataset rather than per frame.
+    """
+    def __init__(self, lut: torch.Tensor, mode='trilinear'):
+        self.lut = lut
+        self.backend = trilinear if mode == 'trilinear' else tetrahedral
+        self.table = None
+        self.version = None
+
+    def bake(self):
+        lut = self.lut.detach()
+        if self.table is None or self.version != lut._version:
+            dim = lut.size()[-1]
+            if self.table is None:
+                self.table = torch.empty(256 ** 3, dtype=torch.int32)
+            self.backend.bake_table(lut.contiguous(), self.table, dim, dim ** 3)
+            self.version = lut._version
+        return self.table
+
+    def __call__(self, x: torch.Tensor):
+        assert x.dtype == torch.uint8, "The baked table only serves uint8 images!"
+        assert x.size(1) == 3, "Can only interpolate 3D images!"
+        table = self.bake()
+        output = torch.empty_like(x)
+        self.backend.forward_table(table, x, output, x.size(3), x.size(2), x.size(0))
+        return output
+
+
+class SeparableLut3D(object):
+    """Inference handle that applies a LUT the cheapest way its content allows.
+
+    classify() sorts the LUT into 'identity' (every node within tol of its
+    input colour), 'separable' (output channel c depends only on input
+    channel c, i.e. three 1D curves, within tol) or 'full', and extracts the
+    [3, dim] curves. Calls then return a clamped copy, run three 1D lookups per
+    pixel, or run the regular 3D forward. Either shortcut differs from the 3D
+    forward by at most tol plus float rounding. The result is kept in .kind
+    and .curves and recomputed only when the LUT changes in place. CUDA
+    builds have no classify; there every LUT is 'full' and goes through the
+    interpolation Function, as in Lut3D.
+    """
+    kinds = ('identity', 'separable', 'full')
+
+    def __init__(self, lut: torch.Tensor, mode='trilinear', tol=1e-5):
+        self.lut = lut
+        self.backend = trilinear if mode == 'trilinear' else tetrahedral
+        self.tol = tol
+        self.kind = None
+        self.curves = None
+        self.version = None
+
+    def classify(self):
+        if not hasattr(self.backend, 'classify'):
+            self.kind = 'full'
+            return self.kind
+        lut = self.lut.detach()
+        if self.kind is None or self.version != lut._version:
+            dim = lut.size()[-1]
+            self.curves = lut.new_empty((3, dim))
+            self.kind = self.kinds[self.backend.classify(lut.contiguous(), self.curves, dim, self.tol)]
+            self.version = lut._version
+        return self.kind
+
+    def __call__(self, x: torch.Tensor):
+        kind = self.classify()
+        x = image_arg(x)
+        assert x.size(1) == 3, "Can only interpolate 3D images!"
+        if kind == 'identity':
+            return torch.clamp(x, 0, 1) if x.is_floating_point() else x.clone()
+        if not hasattr(self.backend, 'forward_separable'):
+            function = TrilinearInterpolationFunction if self.backend is trilinear else TetrahedralInterpolationFunction
+            with torch.no_grad():
+                _, output = function.apply(self.lut.detach(), torch.clamp(x, 0, 1))
+            return output
+
+        output = torch.empty_like(x)
+        dim = self.lut.size()[-1]
+        batch = x.size(0)
+        H = x.size(2)
+        W = x.size(3)
+        if kind == 'separable':
+            self.backend.forward_separable(self.curves, x, output, dim, W, H, batch)
+        else:
+            self.backend.forward(self.lut.detach().contiguous(), x, output, dim, dim ** 3, 1.000001 / (dim-1), W, H, batch)
+        return output
+
+
+class LutBank(object):
+    """LUTs of mixed sizes packed back to back in one arena, for batches where
+    every image uses its own LUT (CPU).
+
+    add() returns the id of a [3, dim, dim, dim] LUT; calling the bank with a
+    batch and a [B] tensor of ids interpolates sample b with LUT ids[b] in one
+    parallel pass over all rows. The arena is rebuilt on the first call after
+    LUTs are added.
+    """
+    def __init__(self, luts=(), mode='trilinear', dtype=torch.float):
+        self.backend = trilinear if mode == 'trilinear' else tetrahedral
+        self.dtype = dtype
+        self.luts = []
+        self.arena = None
+        self.index = None
+        for lut in luts:
+            self.add(lut)
+
+    def add(self, lut: torch.Tensor):
+        assert lut.dim() == 4 and lut.size(0) == 3, "LUT must be [3, dim, dim, dim]"
+        self.luts.append(lut.detach().to(self.dtype))
+        self.arena = None
+        return len(self.luts) - 1
+
+    def pack(self):
+        if self.arena is None:
+            dims = [lut.size(-1) for lut in self.luts]
+            sizes = [3 * dim ** 3 for dim in dims]
+            offsets = [sum(sizes[:i]) for i in range(len(sizes))]
+            self.arena = torch.cat([lut.reshape(-1) for lut in self.luts])
+            self.index = torch.tensor(list(zip(offsets, dims)), dtype=torch.int64)
+        return self.arena, self.index
+
+    def __call__(self, x: torch.Tensor, ids):
+        arena, index = self.pack()
+        x = image_arg(x)
+        ids = torch.as_tensor(ids, dtype=torch.int64)
+        assert x.size(1) == 3, "Can only interpolate 3D images!"
+        if x.is_floating_point():
+            x = torch.clamp(x, 0, 1)
+        output = torch.empty_like(x)
+        self.backend.bank_forward(arena, index, ids, x, output, x.size(3), x.size(2), x.size(0))
+        return output
+
+
+def load_cube(path, cache=True):
+    """Reads a .cube file into a [3, dim, dim, dim] float LUT in the kernels' layout.
+
+    Returns (lut, domain, title), domain being a [2, 3] tensor of DOMAIN_MIN
+    and DOMAIN_MAX. With cache, the LUT is also saved as path + '.lutbin' and
+    later loads map that file instead of parsing the text, as long as it is
+    not older than the .cube. A mapped LUT shares the page cache with other
+    processes; writing to it stays private to this process.
+    """
+    binary = path + '.lutbin'
+    if cache and os.path.exists(binary) and os.path.getmtime(binary) >= os.path.getmtime(path):
+        return trilinear.load_binary(binary)
+    lut, domain, title = trilinear.read_cube(path)
+    if cache:
+        try:
+            trilinear.save_binary(lut, domain, title, binary)
+        except RuntimeError:
+            pass  # read-only directory: parse again next time
+    return lut, domain, title
+
+
+def save_cube(lut: torch.Tensor, path, title='', domain=None):
+    """Writes a [3, dim, dim, dim] LUT as a .cube file (red fastest, as the format requires)."""
+    if domain is None:
+        domain = torch.tensor([[0., 0., 0.], [1., 1., 1.]])
+    trilinear.write_cube(lut.detach().cpu(), domain, title, path)
@@ -0,0 +1,34 @@
+import torch
+
+def regularizer_backend():
+    # The compiled extension when it is built and has the regularizer op,
+    # else None. Imported on first use, so importing this module (and lut1d)
+    # needs only torch.
+    try:
+        import trilinear
+    except ImportError:
+        return None
+    return trilinear if hasattr(trilinear, 'regularizer') else None
+
+class LutRegularizerFunction(torch.autograd.Function):
+    """Range penalty + monotonicity + total variation of a LUT in one pass (CPU).
+
+    Same value as Lut3D.lut_loss (ndim=3, [3, dim, dim, dim]) or, with tv=0,
+    Lut1D.lut_loss (ndim=1, [dim] or [3, dim]), without the masks and shifted
+    difference tensors. The gradient is computed in the same pass and the
+    backward only scales it. Needs regularizer_backend().
+    """
+    @staticmethod
+    def forward(ctx, lut: torch.Tensor, ndim=3, mn=1., tv=1.):
+        dim = lut.size()[-1]
+        channels = lut.numel() // dim ** ndim
+        d_lut = torch.empty_like(lut, memory_format=torch.contiguous_format)
+        loss = regularizer_backend().regularizer(lut.contiguous(), d_lut, channels, dim, ndim, mn, tv)
+
+        ctx.save_for_backward(d_lut)
+        return lut.new_tensor(loss)
+
+    @staticmethod
+    def backward(ctx, loss_grad: torch.Tensor):
+        d_lut, = ctx.saved_tensors
+        return d_lut * loss_grad, None, None, None
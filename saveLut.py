@@ -4,7 +4,6 @@ import torch
 import cv2
 import os
 from lut1d import *
-import colour
 
 class Mymodel(nn.Module):
     def __init__(self):
@@ -13,10 +12,8 @@ class Mymodel(nn.Module):
         self.lut3d = Lut3D(17)
     
     def forward(self, x):
-        x = self.lut1d(x)
-        x = torch.clamp(x, 0, 1)
-        x = self.lut3d(x)
-        return x
+        # Lut1D -> clamp -> Lut3D, fused into one pass over the pixels.
+        return ShaperLut3DFunction.apply(self.lut1d.LUT, self.lut3d.LUT, x)
 
 def inference(lut, img_file):
     basenmae = os.path.basename(img_file)
@@ -46,8 +43,6 @@ if __name__=='__main__':
     save_params = os.path.join(save_dir, "model.pth")
     model.load_state_dict(torch.load(save_params))
     
-    lut = model.lut3d.LUT.data.numpy()
-    lut = np.transpose(lut, (3,2,1,0))
+    lut = model.lut3d.LUT.data
     print(lut.shape)
-    lutForsave = colour.LUT3D(lut)
-    colour.write_LUT(lutForsave, "testlut.cube")
\ No newline at end of file
+    save_cube(lut, "testlut.cube")
\ No newline at end of file
@@ -1,27 +1,52 @@
 #include "tetrahedral.h"
+#include "tetrahedral_simd.h"
 #define CLIP(x, low, high) (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
 #define INDEX(a, b, c, d, d1, d2, d3) ((a) * (d1) * (d2) * (d3) + (b) * (d2) * (d3) + (c) * (d3) + (d))
 
+template <typename scalar_t, typename pixel_t>
+void TetrahedralForwardCpu(const scalar_t *lut, const pixel_t *image, pixel_t *output, const LutImageLayout &image_layout, const LutImageLayout &output_layout, const int dim, const int shift, const float binsize, const int width, const int height, const int batch);
+
+template <typename scalar_t>
+void TetrahedralBackwardCpu(const scalar_t *image, const scalar_t *image_grad, const scalar_t *lut, scalar_t *lut_grad, LutSparseGrad<scalar_t> *sparse_grad, scalar_t *input_grad, const LutImageLayout &image_layout, const LutImageLayout &grad_layout, const LutImageLayout &input_grad_layout, const int dim, const int shift, const float binsize, const int width, const int height, const int batch);
+
+template <typename scalar_t>
+double TetrahedralLossBackwardCpu(const scalar_t *lut, const scalar_t *image, const scalar_t *target, scalar_t *lut_grad, LutSparseGrad<scalar_t> *sparse_grad, const LutImageLayout &image_layout, const LutImageLayout &target_layout, const int norm, const int dim, const int shift, const int width, const int height, const int batch);
+
+template <typename scalar_t, typename pixel_t>
+void TetrahedralForwardPackedCpu(const scalar_t *packed, const pixel_t *image, pixel_t *output, const LutImageLayout &image_layout, const LutImageLayout &output_layout, const int dim, const int width, const int height, const int batch);
+
+template <typename scalar_t>
+void TetrahedralShaperForwardCpu(const scalar_t *shaper, const int shaper_dim, const int shaper_stride, const scalar_t *lut, const scalar_t *image, scalar_t *output, const LutImageLayout &image_layout, const LutImageLayout &output_layout, const int dim, const int shift, const int width, const int height, const int batch);
+
 template <typename scalar_t>
-void TetrahedralForwardCpu(const scalar_t *lut, const scalar_t *image, scalar_t *output, const int dim, const int shift, const float binsize, const int width, const int height, const int channels, const int batch);
+void TetrahedralShaperBackwardCpu(const scalar_t *shaper, const int shaper_dim, const int shaper_stride, const scalar_t *lut, const scalar_t *image, const scalar_t *image_grad, scalar_t *grad, const LutImageLayout &image_layout, const LutImageLayout &grad_layout, const int dim, const int shift, const int width, const int height, const int batch);
 
 template <typename scalar_t>
-void TetrahedralBackwardCpu(const scalar_t *image, const scalar_t *image_grad, scalar_t *lut_grad, const int dim, const int shift, const float binsize, const int width, const int height, const int channels, const int batch);
+void TetrahedralBakeTableCpu(const scalar_t *lut, uint32_t *table, const int dim, const int shift);
+
+template <typename scalar_t, typename pixel_t>
+void TetrahedralBankForwardCpu(const scalar_t *arena, const LutBankLut *luts, const pixel_t *image, pixel_t *output, const LutImageLayout &image_layout, const LutImageLayout &output_layout, const int width, const int height, const int batch);
+
+template <typename scalar_t, typename pixel_t>
+void TetrahedralFanoutForwardCpu(const scalar_t *luts, const int count, const pixel_t *image, pixel_t *output, const LutImageLayout &image_layout, const LutImageLayout &output_layout, const int64_t output_stride, const int dim, const int width, const int height, const int batch);
+
+template <typename scalar_t, typename pixel_t>
+void TetrahedralMaskForwardCpu(const scalar_t *luts, const int count, const scalar_t *mask, const int mask_channels, const pixel_t *image, pixel_t *output, const LutImageLayout &mask_layout, const LutImageLayout &image_layout, const LutImageLayout &output_layout, const int dim, const int width, const int height, const int batch);
+
+template <typename scalar_t>
+void TetrahedralMaskBackwardCpu(const scalar_t *luts, const int count, const scalar_t *mask, const int mask_channels, const scalar_t *image, const scalar_t *image_grad, scalar_t *luts_grad, scalar_t *mask_grad, scalar_t *input_grad, const LutImageLayout &mask_layout, const LutImageLayout &image_layout, const LutImageLayout &grad_layout, const LutImageLayout &mask_grad_layout, const LutImageLayout &input_grad_layout, const int dim, const int width, const int height, const int batch);
 
 int tetrahedral_forward(torch::Tensor lut, torch::Tensor image, torch::Tensor output,
                         int lut_dim, int shift, float binsize, int width, int height, int batch)
 {
-    auto image_size = image.sizes();
-    int channels = image_size[1];
-
     AT_DISPATCH_FLOATING_TYPES(lut.scalar_type(), "tetrahedral_forward_cpp",
                                ([&]
-                                { TetrahedralForwardCpu<scalar_t>(
-                                      lut.data_ptr<scalar_t>(),
-                                      image.data_ptr<scalar_t>(),
-                                      output.data_ptr<scalar_t>(),
-                                      lut_dim, shift, binsize, width,
-                                      height, channels, batch); }));
+                                { lut_dispatch_pixels<scalar_t>(image, output, [&](const auto *in, auto *out)
+                                                                { TetrahedralForwardCpu<scalar_t>(
+                                                                      lut.data_ptr<scalar_t>(), in, out,
+                                                                      lut_image_layout(image), lut_image_layout(output),
+                                                                      lut_dim, shift, binsize, width,
+                                                                      height, batch); }); }));
 
     return 1;
 }
@@ -29,326 +54,826 @@ int tetrahedral_forward(torch::Tensor lut, torch::Tensor image, torch::Tensor ou
 int tetrahedral_backward(torch::Tensor image, torch::Tensor image_grad, torch::Tensor lut_grad,
                          int lut_dim, int shift, float binsize, int width, int height, int batch)
 {
-    auto image_size = image.sizes();
-    int channels = image_size[1];
-
     AT_DISPATCH_FLOATING_TYPES(image.scalar_type(), "tetrahedral_backward_cpp",
                                ([&]
                                 { TetrahedralBackwardCpu<scalar_t>(
                                       image.data_ptr<scalar_t>(),
                                       image_grad.data_ptr<scalar_t>(),
+                                      nullptr,
                                       lut_grad.data_ptr<scalar_t>(),
+                                      nullptr,
+                                      nullptr,
+                                      lut_image_layout(image), lut_image_layout(image_grad), lut_image_layout(image_grad),
                                       lut_dim, shift, binsize, width,
-                                      height, channels, batch); }));
+                                      height, batch); }));
+
+    return 1;
+}
+
+// LUT gradient and gradient of the input image, computed in one traversal:
+// the cell found for a pixel serves both the scatter into the LUT and the
+// slopes of the interpolation.
+int tetrahedral_backward_input(torch::Tensor lut, torch::Tensor image, torch::Tensor image_grad, torch::Tensor lut_grad, torch::Tensor input_grad,
+                               int lut_dim, int shift, float binsize, int width, int height, int batch)
+{
+    AT_DISPATCH_FLOATING_TYPES(image.scalar_type(), "tetrahedral_backward_input_cpp",
+                               ([&]
+                                { TetrahedralBackwardCpu<scalar_t>(
+                                      image.data_ptr<scalar_t>(),
+                                      image_grad.data_ptr<scalar_t>(),
+                                      lut.data_ptr<scalar_t>(),
+                                      lut_grad.data_ptr<scalar_t>(),
+                                      nullptr,
+                                      input_grad.data_ptr<scalar_t>(),
+                                      lut_image_layout(image), lut_image_layout(image_grad), lut_image_layout(input_grad),
+                                      lut_dim, shift, binsize, width,
+                                      height, batch); }));
+
+    return 1;
+}
+
+int tetrahedral_pack_lut(torch::Tensor lut, torch::Tensor packed, int lut_dim)
+{
+    TORCH_CHECK(packed.numel() == lut_packed_size(lut_dim), "packed LUT must have dim^3 * ", LUT_NODE_STRIDE, " elements");
+
+    AT_DISPATCH_FLOATING_TYPES(lut.scalar_type(), "tetrahedral_pack_lut_cpp",
+                               ([&]
+                                { lut_pack_nodes<scalar_t>(
+                                      lut.data_ptr<scalar_t>(),
+                                      packed.data_ptr<scalar_t>(),
+                                      lut_dim); }));
+
+    return 1;
+}
+
+int tetrahedral_forward_packed(torch::Tensor packed, torch::Tensor image, torch::Tensor output,
+                               int lut_dim, int width, int height, int batch)
+{
+    AT_DISPATCH_FLOATING_TYPES(packed.scalar_type(), "tetrahedral_forward_packed_cpp",
+                               ([&]
+                                { lut_dispatch_pixels<scalar_t>(image, output, [&](const auto *in, auto *out)
+                                                                { TetrahedralForwardPackedCpu<scalar_t>(
+                                                                      packed.data_ptr<scalar_t>(), in, out,
+                                                                      lut_image_layout(image), lut_image_layout(output),
+                                                                      lut_dim, width, height, batch); }); }));
+
+    return 1;
+}
+
+// 1D shaper curve per channel ([dim1], shared, or [3, dim1]) followed by the
+// 3D LUT in one pass, as Lut1D -> clamp -> Lut3D.
+int tetrahedral_shaper_forward(torch::Tensor shaper, torch::Tensor lut, torch::Tensor image, torch::Tensor output,
+                               int shaper_dim, int lut_dim, int shift, float binsize, int width, int height, int batch)
+{
+    const int shaper_stride = shaper.dim() == 2 ? shaper_dim : 0;
+
+    AT_DISPATCH_FLOATING_TYPES(lut.scalar_type(), "tetrahedral_shaper_forward_cpp",
+                               ([&]
+                                { TetrahedralShaperForwardCpu<scalar_t>(
+                                      shaper.data_ptr<scalar_t>(), shaper_dim, shaper_stride,
+                                      lut.data_ptr<scalar_t>(),
+                                      image.data_ptr<scalar_t>(),
+                                      output.data_ptr<scalar_t>(),
+                                      lut_image_layout(image), lut_image_layout(output),
+                                      lut_dim, shift, width, height, batch); }));
+
+    return 1;
+}
+
+int tetrahedral_shaper_backward(torch::Tensor shaper, torch::Tensor lut, torch::Tensor image, torch::Tensor image_grad,
+                                torch::Tensor shaper_grad, torch::Tensor lut_grad,
+                                int shaper_dim, int lut_dim, int shift, float binsize, int width, int height, int batch)
+{
+    const int shaper_stride = shaper.dim() == 2 ? shaper_dim : 0;
+    const int64_t lut_size = (int64_t)shift * 3;
+
+    // Both gradients live in one buffer, so they share the per-thread scratch
+    // and the ordered reduction of lut_parallel_accumulate.
+    torch::Tensor grad = torch::zeros({lut_size + shaper.numel()}, lut.options());
+
+    AT_DISPATCH_FLOATING_TYPES(lut.scalar_type(), "tetrahedral_shaper_backward_cpp",
+                               ([&]
+                                { TetrahedralShaperBackwardCpu<scalar_t>(
+                                      shaper.data_ptr<scalar_t>(), shaper_dim, shaper_stride,
+                                      lut.data_ptr<scalar_t>(),
+                                      image.data_ptr<scalar_t>(),
+                                      image_grad.data_ptr<scalar_t>(),
+                                      grad.data_ptr<scalar_t>(),
+                                      lut_image_layout(image), lut_image_layout(image_grad),
+                                      lut_dim, shift, width, height, batch); }));
+
+    lut_grad.add_(grad.narrow(0, 0, lut_size).view_as(lut_grad));
+    shaper_grad.add_(grad.narrow(0, lut_size, shaper.numel()).view_as(shaper_grad));
+    return 1;
+}
+
+// Chains of 3D LUTs and 1D curves (see lut_chain.h), evaluated with tetrahedral
+// interpolation: applied to an image as is, or baked into one LUT.
+int tetrahedral_chain_forward(std::vector<torch::Tensor> stages, torch::Tensor image, torch::Tensor output,
+                              int width, int height, int batch)
+{
+    AT_DISPATCH_FLOATING_TYPES(image.scalar_type(), "tetrahedral_chain_forward_cpp",
+                               ([&]
+                                { lut_chain_image<scalar_t>(
+                                      lut_chain_stages<scalar_t>(stages),
+                                      image.data_ptr<scalar_t>(),
+                                      output.data_ptr<scalar_t>(),
+                                      lut_image_layout(image), lut_image_layout(output),
+                                      width, height, batch, tetrahedral_sample<scalar_t>); }));
+
+    return 1;
+}
+
+int tetrahedral_bake(std::vector<torch::Tensor> stages, torch::Tensor baked, int baked_dim)
+{
+    TORCH_CHECK(baked.numel() == (int64_t)baked_dim * baked_dim * baked_dim * 3, "baked LUT must be [3, dim, dim, dim]");
+
+    AT_DISPATCH_FLOATING_TYPES(baked.scalar_type(), "tetrahedral_bake_cpp",
+                               ([&]
+                                { lut_chain_bake<scalar_t>(
+                                      lut_chain_stages<scalar_t>(stages),
+                                      baked.data_ptr<scalar_t>(),
+                                      baked_dim, tetrahedral_sample<scalar_t>); }));
+
+    return 1;
+}
+
+// Dense 256^3 table of a LUT for 8-bit images (see lut_table.h), baked once
+// and then applied by a gather per pixel.
+int tetrahedral_bake_table(torch::Tensor lut, torch::Tensor table, int lut_dim, int shift)
+{
+    uint32_t *entries = lut_table_data(table);
+
+    AT_DISPATCH_FLOATING_TYPES(lut.scalar_type(), "tetrahedral_bake_table_cpp",
+                               ([&]
+                                { TetrahedralBakeTableCpu<scalar_t>(
+                                      lut.data_ptr<scalar_t>(), entries,
+                                      lut_dim, shift); }));
+
+    return 1;
+}
+
+int tetrahedral_forward_table(torch::Tensor table, torch::Tensor image, torch::Tensor output,
+                              int width, int height, int batch)
+{
+    return lut_table_forward_image(table, image, output, width, height, batch);
+}
+
+// Per-sample blends of basis LUTs ([n, 3, dim, dim, dim] and [batch, n]
+// weights, see lut_blend.h). Each sample is interpolated against its blend,
+// and the backward returns the gradients of the basis and of the weights.
+int tetrahedral_blend_forward(torch::Tensor basis, torch::Tensor weights, torch::Tensor image, torch::Tensor output,
+                              int lut_dim, int shift, float binsize, int width, int height, int batch)
+{
+    const int n = basis.size(0);
+    TORCH_CHECK(weights.numel() == (int64_t)batch * n, "weights must be [batch, ", n, "]");
+    const LutImageLayout image_layout = lut_image_layout(image);
+    const LutImageLayout output_layout = lut_image_layout(output);
+
+    AT_DISPATCH_FLOATING_TYPES(basis.scalar_type(), "tetrahedral_blend_forward_cpp",
+                               ([&]
+                                { lut_dispatch_pixels<scalar_t>(image, output, [&](const auto *in, auto *out)
+                                                                { lut_blend_samples<scalar_t>(
+                                                                      basis.data_ptr<scalar_t>(), weights.data_ptr<scalar_t>(),
+                                                                      n, (int64_t)shift * 3, batch, [&](const int b, const scalar_t *lut)
+                                                                      { TetrahedralForwardCpu<scalar_t>(
+                                                                            lut, in + image_layout.offset(b, 0, 0, 0), out + output_layout.offset(b, 0, 0, 0),
+                                                                            image_layout, output_layout,
+                                                                            lut_dim, shift, binsize, width,
+                                                                            height, 1); }); }); }));
+
+    return 1;
+}
+
+int tetrahedral_blend_backward(torch::Tensor basis, torch::Tensor weights, torch::Tensor image, torch::Tensor image_grad,
+                               torch::Tensor basis_grad, torch::Tensor weights_grad, c10::optional<torch::Tensor> input_grad,
+                               int lut_dim, int shift, float binsize, int width, int height, int batch)
+{
+    const int n = basis.size(0);
+    TORCH_CHECK(weights.numel() == (int64_t)batch * n, "weights must be [batch, ", n, "]");
+    const LutImageLayout image_layout = lut_image_layout(image);
+    const LutImageLayout grad_layout = lut_image_layout(image_grad);
+    const LutImageLayout input_grad_layout = input_grad ? lut_image_layout(*input_grad) : grad_layout;
+
+    AT_DISPATCH_FLOATING_TYPES(image.scalar_type(), "tetrahedral_blend_backward_cpp",
+                               ([&]
+                                { scalar_t *d_image = input_grad ? input_grad->data_ptr<scalar_t>() : nullptr;
+                                  lut_blend_backward_samples<scalar_t>(
+                                      basis.data_ptr<scalar_t>(), weights.data_ptr<scalar_t>(),
+                                      n, (int64_t)shift * 3, batch,
+                                      basis_grad.data_ptr<scalar_t>(), weights_grad.data_ptr<scalar_t>(),
+                                      [&](const int b, const scalar_t *lut, scalar_t *grad)
+                                      { TetrahedralBackwardCpu<scalar_t>(
+                                            image.data_ptr<scalar_t>() + image_layout.offset(b, 0, 0, 0),
+                                            image_grad.data_ptr<scalar_t>() + grad_layout.offset(b, 0, 0, 0),
+                                            d_image ? lut : nullptr,
+                                            grad,
+                                            nullptr,
+                                            d_image ? d_image + input_grad_layout.offset(b, 0, 0, 0) : nullptr,
+                                            image_layout, grad_layout, input_grad_layout,
+                                            lut_dim, shift, binsize, width,
+                                            height, 1); }); }));
+
+    return 1;
+}
+
+// Batches whose samples use different LUTs of a bank (see lut_bank.h): ids[b]
+// selects the LUT of sample b, and all rows are interpolated in one pass.
+int tetrahedral_bank_forward(torch::Tensor arena, torch::Tensor index, torch::Tensor ids, torch::Tensor image, torch::Tensor output,
+                             int width, int height, int batch)
+{
+    const std::vector<LutBankLut> luts = lut_bank_select(arena, index, ids, batch);
+
+    AT_DISPATCH_FLOATING_TYPES(arena.scalar_type(), "tetrahedral_bank_forward_cpp",
+                               ([&]
+                                { lut_dispatch_pixels<scalar_t>(image, output, [&](const auto *in, auto *out)
+                                                                { TetrahedralBankForwardCpu<scalar_t>(
+                                                                      arena.data_ptr<scalar_t>(), luts.data(), in, out,
+                                                                      lut_image_layout(image), lut_image_layout(output),
+                                                                      width, height, batch); }); }));
+
+    return 1;
+}
+
+// One image through count LUTs of the same dim ([count, 3, dim, dim, dim]) in
+// one pass, into a [count, batch, 3, height, width] output (see lut_fanout.h).
+int tetrahedral_fanout_forward(torch::Tensor luts, torch::Tensor image, torch::Tensor output,
+                               int lut_dim, int width, int height, int batch)
+{
+    const int count = luts.size(0);
+    TORCH_CHECK(output.dim() == 5 && output.size(0) == count, "output must be [", count, ", batch, 3, height, width]");
+    const LutImageLayout output_layout = {output.stride(1), output.stride(2), output.stride(3), output.stride(4)};
+
+    AT_DISPATCH_FLOATING_TYPES(luts.scalar_type(), "tetrahedral_fanout_forward_cpp",
+                               ([&]
+                                { lut_dispatch_pixels<scalar_t>(image, output, [&](const auto *in, auto *out)
+                                                                { TetrahedralFanoutForwardCpu<scalar_t>(
+                                                                      luts.data_ptr<scalar_t>(), count, in, out,
+                                                                      lut_image_layout(image), output_layout, output.stride(0),
+                                                                      lut_dim, width, height, batch); }); }));
+
+    return 1;
+}
+
+// Per-pixel blends of count LUTs of the same dim ([count, 3, dim, dim, dim])
+// weighted by a [batch, count (or count - 1), height, width] mask, in one pass
+// (see lut_mask.h).
+int tetrahedral_mask_forward(torch::Tensor luts, torch::Tensor mask, torch::Tensor image, torch::Tensor output,
+                             int lut_dim, int width, int height, int batch)
+{
+    const int count = luts.size(0);
+    const int mask_channels = mask.size(1);
+    TORCH_CHECK(mask_channels == count || mask_channels == count - 1, "mask must have ", count, " or ", count - 1, " channels");
+
+    AT_DISPATCH_FLOATING_TYPES(luts.scalar_type(), "tetrahedral_mask_forward_cpp",
+                               ([&]
+                                { lut_dispatch_pixels<scalar_t>(image, output, [&](const auto *in, auto *out)
+                                                                { TetrahedralMaskForwardCpu<scalar_t>(
+                                                                      luts.data_ptr<scalar_t>(), count,
+                                                                      mask.data_ptr<scalar_t>(), mask_channels, in, out,
+                                                                      lut_image_layout(mask), lut_image_layout(image), lut_image_layout(output),
+                                                                      lut_dim, width, height, batch); }); }));
+
+    return 1;
+}
+
+int tetrahedral_mask_backward(torch::Tensor luts, torch::Tensor mask, torch::Tensor image, torch::Tensor image_grad,
+                              torch::Tensor luts_grad, c10::optional<torch::Tensor> mask_grad, c10::optional<torch::Tensor> input_grad,
+                              int lut_dim, int width, int height, int batch)
+{
+    const int count = luts.size(0);
+    const int mask_channels = mask.size(1);
+    TORCH_CHECK(mask_channels == count || mask_channels == count - 1, "mask must have ", count, " or ", count - 1, " channels");
+    const LutImageLayout grad_layout = lut_image_layout(image_grad);
+    const LutImageLayout mask_grad_layout = mask_grad ? lut_image_layout(*mask_grad) : grad_layout;
+    const LutImageLayout input_grad_layout = input_grad ? lut_image_layout(*input_grad) : grad_layout;
+
+    AT_DISPATCH_FLOATING_TYPES(image.scalar_type(), "tetrahedral_mask_backward_cpp",
+                               ([&]
+                                { TetrahedralMaskBackwardCpu<scalar_t>(
+                                      luts.data_ptr<scalar_t>(), count,
+                                      mask.data_ptr<scalar_t>(), mask_channels,
+                                      image.data_ptr<scalar_t>(),
+                                      image_grad.data_ptr<scalar_t>(),
+                                      luts_grad.data_ptr<scalar_t>(),
+                                      mask_grad ? mask_grad->data_ptr<scalar_t>() : nullptr,
+                                      input_grad ? input_grad->data_ptr<scalar_t>() : nullptr,
+                                      lut_image_layout(mask), lut_image_layout(image), grad_layout,
+                                      mask_grad_layout, input_grad_layout,
+                                      lut_dim, width, height, batch); }));
+
+    return 1;
+}
+
+int tetrahedral_stream_forward(torch::Tensor lut, const std::string &input_path, const std::string &output_path,
+                               int lut_dim, int shift, float binsize, int raw_width, int raw_height,
+                               const std::string &raw_type, int64_t budget)
+{
+    const torch::Tensor table = lut.to(torch::kFloat).contiguous();
+    return lut_stream_apply(input_path, output_path, raw_width, raw_height, raw_type, budget,
+                            [&](const auto *image, auto *output, const LutImageLayout &layout, const int width, const int rows)
+                            { TetrahedralForwardCpu<float>(
+                                  table.data_ptr<float>(), image, output, layout, layout,
+                                  lut_dim, shift, binsize, width, rows, 1); });
+}
+
+std::map<std::string, std::map<std::string, double>> tetrahedral_batch_forward(torch::Tensor lut, const std::vector<std::string> &inputs, const std::string &output_dir,
+                                                                               int lut_dim, int shift, float binsize, int workers, int depth)
+{
+    const torch::Tensor table = lut.to(torch::kFloat).contiguous();
+    return lut_batch_apply(inputs, output_dir, workers, depth,
+                           [&](const auto *image, auto *output, const LutImageLayout &layout, const int width, const int rows)
+                           { TetrahedralForwardCpu<float>(
+                                 table.data_ptr<float>(), image, output, layout, layout,
+                                 lut_dim, shift, binsize, width, rows, 1); });
+}
+
+double tetrahedral_loss_backward(torch::Tensor lut, torch::Tensor image, torch::Tensor target, torch::Tensor lut_grad,
+                                 int norm, int lut_dim, int shift, float binsize, int width, int height, int batch)
+{
+    TORCH_CHECK(norm == LUT_LOSS_L1 || norm == LUT_LOSS_L2, "norm must be 1 (L1) or 2 (L2)");
+    TORCH_CHECK(image.sizes() == target.sizes(), "image and target must have the same shape");
+
+    double loss = 0;
+    AT_DISPATCH_FLOATING_TYPES(image.scalar_type(), "tetrahedral_loss_backward_cpp",
+                               ([&]
+                                { loss = TetrahedralLossBackwardCpu<scalar_t>(
+                                      lut.data_ptr<scalar_t>(),
+                                      image.data_ptr<scalar_t>(),
+                                      target.data_ptr<scalar_t>(),
+                                      lut_grad.data_ptr<scalar_t>(),
+                                      nullptr,
+                                      lut_image_layout(image), lut_image_layout(target), norm,
+                                      lut_dim, shift, width, height, batch); }));
+
+    return loss;
+}
+
+// COO indices and values of a sparse gradient, as returned by sparse_grad.
+template <typename scalar_t>
+static std::tuple<torch::Tensor, torch::Tensor> tetrahedral_sparse_tensors(const LutSparseGrad<scalar_t> &grad, const int lut_dim, const torch::TensorOptions &options)
+{
+    torch::Tensor indices = torch::empty({4, (int64_t)grad.values.size()}, torch::kLong);
+    torch::Tensor values = torch::empty({(int64_t)grad.values.size()}, options);
+    lut_sparse_indices(grad.nodes, lut_dim, indices.data_ptr<int64_t>());
+    std::copy(grad.values.begin(), grad.values.end(), values.data_ptr<scalar_t>());
+    return std::make_tuple(indices, values);
+}
+
+// backward / backward_input with the LUT gradient returned as the COO indices
+// and values of the nodes it reaches (lut_parallel_accumulate_sparse), without
+// a dense gradient. input_grad receives the image gradient when given.
+std::tuple<torch::Tensor, torch::Tensor> tetrahedral_backward_sparse(torch::Tensor lut, torch::Tensor image, torch::Tensor image_grad, c10::optional<torch::Tensor> input_grad,
+                                                                     int lut_dim, int shift, float binsize, int width, int height, int batch)
+{
+    std::tuple<torch::Tensor, torch::Tensor> coo;
+    AT_DISPATCH_FLOATING_TYPES(image.scalar_type(), "tetrahedral_backward_sparse_cpp",
+                               ([&]
+                                {
+                                    LutSparseGrad<scalar_t> grad;
+                                    TetrahedralBackwardCpu<scalar_t>(
+                                        image.data_ptr<scalar_t>(),
+                                        image_grad.data_ptr<scalar_t>(),
+                                        input_grad ? lut.data_ptr<scalar_t>() : nullptr,
+                                        nullptr,
+                                        &grad,
+                                        input_grad ? input_grad->data_ptr<scalar_t>() : nullptr,
+                                        lut_image_layout(image), lut_image_layout(image_grad), lut_image_layout(input_grad ? *input_grad : image_grad),
+                                        lut_dim, shift, binsize, width,
+                                        height, batch);
+                                    coo = tetrahedral_sparse_tensors(grad, lut_dim, image.options());
+                                }));
+
+    return coo;
+}
+
+// loss_backward with a sparse LUT gradient: the loss and the COO indices and
+// values of the gradient.
+std::tuple<double, torch::Tensor, torch::Tensor> tetrahedral_loss_backward_sparse(torch::Tensor lut, torch::Tensor image, torch::Tensor target,
+                                                                                  int norm, int lut_dim, int shift, float binsize, int width, int height, int batch)
+{
+    TORCH_CHECK(norm == LUT_LOSS_L1 || norm == LUT_LOSS_L2, "norm must be 1 (L1) or 2 (L2)");
+    TORCH_CHECK(image.sizes() == target.sizes(), "image and target must have the same shape");
+
+    double loss = 0;
+    std::tuple<torch::Tensor, torch::Tensor> coo;
+    AT_DISPATCH_FLOATING_TYPES(image.scalar_type(), "tetrahedral_loss_backward_sparse_cpp",
+                               ([&]
+                                {
+                                    LutSparseGrad<scalar_t> grad;
+                                    loss = TetrahedralLossBackwardCpu<scalar_t>(
+                                        lut.data_ptr<scalar_t>(),
+                                        image.data_ptr<scalar_t>(),
+                                        target.data_ptr<scalar_t>(),
+                                        nullptr,
+                                        &grad,
+                                        lut_image_layout(image), lut_image_layout(target), norm,
+                                        lut_dim, shift, width, height, batch);
+                                    coo = tetrahedral_sparse_tensors(grad, lut_dim, image.options());
+                                }));
+
+    return std::make_tuple(loss, std::get<0>(coo), std::get<1>(coo));
+}
+
+std::tuple<torch::Tensor, torch::Tensor> tetrahedral_sparse_grad(torch::Tensor lut_grad, int lut_dim)
+{
+    TORCH_CHECK(lut_grad.is_contiguous(), "lut_grad must be contiguous");
+
+    torch::Tensor indices, values;
+    AT_DISPATCH_FLOATING_TYPES(lut_grad.scalar_type(), "tetrahedral_sparse_grad_cpp",
+                               ([&]
+                                {
+                                    const std::vector<int64_t> nodes = lut_sparse_nodes<scalar_t>(
+                                        lut_grad.data_ptr<scalar_t>(), (int64_t)lut_dim * lut_dim * lut_dim);
+                                    indices = torch::empty({4, (int64_t)nodes.size() * 3}, torch::kLong);
+                                    values = torch::empty({(int64_t)nodes.size() * 3}, lut_grad.options());
+                                    lut_sparse_coo<scalar_t>(lut_grad.data_ptr<scalar_t>(), nodes, lut_dim,
+                                                             indices.data_ptr<int64_t>(), values.data_ptr<scalar_t>());
+                                }));
+
+    return std::make_tuple(indices, values);
+}
+
+int tetrahedral_sparse_adam(torch::Tensor param, torch::Tensor exp_avg, torch::Tensor exp_avg_sq, c10::optional<torch::Tensor> indices, torch::Tensor values,
+                            int64_t step, double lr, double beta1, double beta2, double eps)
+{
+    TORCH_CHECK(param.is_contiguous() && exp_avg.is_contiguous() && exp_avg_sq.is_contiguous(), "param and moments must be contiguous");
+    TORCH_CHECK(indices.has_value() || values.sizes() == param.sizes(), "a dense gradient must have the shape of param");
+    TORCH_CHECK(!indices.has_value() || indices->size(0) == param.dim(), "indices must be [param.dim(), nnz]");
+
+    const torch::Tensor index = indices.has_value() ? indices->contiguous() : torch::Tensor();
+    const torch::Tensor value = values.contiguous();
+    AT_DISPATCH_FLOATING_TYPES(param.scalar_type(), "tetrahedral_sparse_adam_cpp",
+                               ([&]
+                                { lut_sparse_adam<scalar_t>(
+                                      param.data_ptr<scalar_t>(),
+                                      exp_avg.data_ptr<scalar_t>(),
+                                      exp_avg_sq.data_ptr<scalar_t>(),
+                                      index.defined() ? index.data_ptr<int64_t>() : nullptr,
+                                      param.strides().data(), param.dim(),
+                                      value.data_ptr<scalar_t>(), value.numel(),
+                                      step, lr, beta1, beta2, eps); }));
+
+    return 1;
+}
+
+int tetrahedral_sparse_sgd(torch::Tensor param, c10::optional<torch::Tensor> indices, torch::Tensor values, double lr)
+{
+    TORCH_CHECK(param.is_contiguous(), "param must be contiguous");
+    TORCH_CHECK(indices.has_value() || values.sizes() == param.sizes(), "a dense gradient must have the shape of param");
+    TORCH_CHECK(!indices.has_value() || indices->size(0) == param.dim(), "indices must be [param.dim(), nnz]");
+
+    const torch::Tensor index = indices.has_value() ? indices->contiguous() : torch::Tensor();
+    const torch::Tensor value = values.contiguous();
+    AT_DISPATCH_FLOATING_TYPES(param.scalar_type(), "tetrahedral_sparse_sgd_cpp",
+                               ([&]
+                                { lut_sparse_sgd<scalar_t>(
+                                      param.data_ptr<scalar_t>(),
+                                      index.defined() ? index.data_ptr<int64_t>() : nullptr,
+                                      param.strides().data(), param.dim(),
+                                      value.data_ptr<scalar_t>(), value.numel(), lr); }));
+
+    return 1;
+}
+
+// Fills the [3, dim] curves of lut and returns LUT_SEPARABLE_IDENTITY, _CURVES
+// or _FULL. The same for both interpolation modes.
+int tetrahedral_classify(torch::Tensor lut, torch::Tensor curves, int lut_dim, double tol)
+{
+    TORCH_CHECK(lut.is_contiguous() && curves.is_contiguous(), "lut and curves must be contiguous");
+    TORCH_CHECK(curves.numel() == 3 * lut_dim, "curves must be [3, ", lut_dim, "]");
+    TORCH_CHECK(lut_dim >= 2, "lut_dim must be at least 2");
+
+    int kind = LUT_SEPARABLE_FULL;
+    AT_DISPATCH_FLOATING_TYPES(lut.scalar_type(), "tetrahedral_classify_cpp",
+                               ([&]
+                                { kind = lut_separable_classify<scalar_t>(
+                                      lut.data_ptr<scalar_t>(), lut_dim, tol,
+                                      curves.data_ptr<scalar_t>()); }));
+
+    return kind;
+}
+
+// Forward of a LUT classified as separable, from its curves alone.
+int tetrahedral_forward_separable(torch::Tensor curves, torch::Tensor image, torch::Tensor output,
+                                  int lut_dim, int width, int height, int batch)
+{
+    AT_DISPATCH_FLOATING_TYPES(curves.scalar_type(), "tetrahedral_forward_separable_cpp",
+                               ([&]
+                                { lut_dispatch_pixels<scalar_t>(image, output, [&](const auto *in, auto *out)
+                                                                { lut_forward_rows<scalar_t>(
+                                                                      in, out, lut_image_layout(image), lut_image_layout(output),
+                                                                      batch, height, width, [&](const scalar_t *image, scalar_t *output, const int64_t plane)
+                                                                      { lut_separable_row(curves.data_ptr<scalar_t>(), lut_dim, image, output, plane, width); }); }); }));
 
     return 1;
 }
 
+// Vector row kernels for float images, chosen from CPUID when the module loads.
+static const TetrahedralRowKernel tetrahedral_row_kernel = TetrahedralSelectRowKernel(false);
+static const TetrahedralRowKernel tetrahedral_packed_row_kernel = TetrahedralSelectRowKernel(true);
+static const TetrahedralCellKernel tetrahedral_cell_kernel = TetrahedralSelectCellKernel();
+
+// Number of leading pixels of a row interpolated by a vector kernel.
+template <typename scalar_t>
+static int TetrahedralForwardRowSimd(const TetrahedralRowKernel kernel, const scalar_t *lut, const scalar_t *image, scalar_t *output, const int64_t plane, const int width, const int dim, const int shift)
+{
+    return 0;
+}
+
+template <>
+int TetrahedralForwardRowSimd<float>(const TetrahedralRowKernel kernel, const float *lut, const float *image, float *output, const int64_t plane, const int width, const int dim, const int shift)
+{
+    return kernel ? kernel(lut, image, output, plane, width, dim, shift) : 0;
+}
+
+// Cells of a planar [3][n] chunk for the fan-out forward (lut_fanout.h).
+template <typename scalar_t>
+static void TetrahedralFanoutCells(const scalar_t *row, const int n, const int dim, LutFanoutCells<scalar_t, 4> &cells)
+{
+    for (int w = 0; w < n; ++w)
+        lut_fanout_store_cell(cells, w, tetrahedral_cell(row[w], row[w + n], row[w + n * 2], dim));
+}
+
+template <>
+void TetrahedralFanoutCells<float>(const float *row, const int n, const int dim, LutFanoutCells<float, 4> &cells)
+{
+    int w = tetrahedral_cell_kernel ? tetrahedral_cell_kernel(row, n, n, dim, cells.id[0], cells.w[0], LUT_FANOUT_CHUNK) : 0;
+    for (; w < n; ++w)
+        lut_fanout_store_cell(cells, w, tetrahedral_cell(row[w], row[w + n], row[w + n * 2], dim));
+}
+
+// Interpolates one planar row: image and output point at the R values of the
+// row, the G and B values follow at plane and 2 * plane.
+template <typename scalar_t>
+static void TetrahedralForwardRow(const scalar_t *lut, const scalar_t *image, scalar_t *output, const int64_t plane, const int width, const int dim, const int shift)
+{
+    int w = TetrahedralForwardRowSimd(tetrahedral_row_kernel, lut, image, output, plane, width, dim, shift);
+
+    for (; w < width; ++w)
+    {
+        int64_t r_index = w;
+        int64_t g_index = w + plane;
+        int64_t b_index = w + plane * 2;
+
+        const TetrahedralCell<scalar_t> cell = tetrahedral_cell(image[r_index], image[g_index], image[b_index], dim);
+
+        output[r_index] = cell.w[0] * lut[cell.id[0]] + cell.w[1] * lut[cell.id[1]] +
+                          cell.w[2] * lut[cell.id[2]] + cell.w[3] * lut[cell.id[3]];
+
+        output[g_index] = cell.w[0] * lut[cell.id[0] + shift] + cell.w[1] * lut[cell.id[1] + shift] +
+                          cell.w[2] * lut[cell.id[2] + shift] + cell.w[3] * lut[cell.id[3] + shift];
+
+        output[b_index] = cell.w[0] * lut[cell.id[0] + shift * 2] + cell.w[1] * lut[cell.id[1] + shift * 2] +
+                          cell.w[2] * lut[cell.id[2] + shift * 2] + cell.w[3] * lut[cell.id[3] + shift * 2];
+    }
+}
+
+template <typename scalar_t, typename pixel_t>
+void TetrahedralForwardCpu(const scalar_t *lut, const pixel_t *image, pixel_t *output, const LutImageLayout &image_layout, const LutImageLayout &output_layout, const int dim, const int shift, const float binsize, const int width, const int height, const int batch)
+{
+    lut_forward_rows<scalar_t>(image, output, image_layout, output_layout, batch, height, width, [&](const scalar_t *image, scalar_t *output, const int64_t plane)
+    {
+        TetrahedralForwardRow(lut, image, output, plane, width, dim, shift);
+    });
+}
+
 template <typename scalar_t>
-void TetrahedralForwardCpu(const scalar_t *lut, const scalar_t *image, scalar_t *output, const int dim, const int shift, const float binsize, const int width, const int height, const int channels, const int batch)
+void TetrahedralBakeTableCpu(const scalar_t *lut, uint32_t *table, const int dim, const int shift)
+{
+    lut_table_bake<scalar_t>(table, [&](const scalar_t *image, scalar_t *output, const int64_t plane, const int width)
+    {
+        TetrahedralForwardRow(lut, image, output, plane, width, dim, shift);
+    });
+}
+
+template <typename scalar_t, typename pixel_t>
+void TetrahedralBankForwardCpu(const scalar_t *arena, const LutBankLut *luts, const pixel_t *image, pixel_t *output, const LutImageLayout &image_layout, const LutImageLayout &output_layout, const int width, const int height, const int batch)
 {
-    for (int batch_index = 0; batch_index < batch; ++batch_index)
+    lut_forward_rows_indexed<scalar_t>(image, output, image_layout, output_layout, batch, height, width, [&](const int batch_index, const scalar_t *image, scalar_t *output, const int64_t plane)
     {
-        for (int h = 0; h < height; ++h)
+        const LutBankLut &lut = luts[batch_index];
+        TetrahedralForwardRow(arena + lut.offset, image, output, plane, width, lut.dim, lut.dim * lut.dim * lut.dim);
+    });
+}
+
+template <typename scalar_t, typename pixel_t>
+void TetrahedralFanoutForwardCpu(const scalar_t *luts, const int count, const pixel_t *image, pixel_t *output, const LutImageLayout &image_layout, const LutImageLayout &output_layout, const int64_t output_stride, const int dim, const int width, const int height, const int batch)
+{
+    lut_fanout_forward<scalar_t, 4>(luts, count, dim, image, output, image_layout, output_layout, output_stride, width, height, batch, [&](const scalar_t *row, const int n, LutFanoutCells<scalar_t, 4> &cells)
+    {
+        TetrahedralFanoutCells(row, n, dim, cells);
+    });
+}
+
+template <typename scalar_t, typename pixel_t>
+void TetrahedralMaskForwardCpu(const scalar_t *luts, const int count, const scalar_t *mask, const int mask_channels, const pixel_t *image, pixel_t *output, const LutImageLayout &mask_layout, const LutImageLayout &image_layout, const LutImageLayout &output_layout, const int dim, const int width, const int height, const int batch)
+{
+    lut_mask_forward<scalar_t, 4>(luts, count, mask, mask_channels, image, output, mask_layout, image_layout, output_layout, dim, width, height, batch, [&](const scalar_t *row, const int n, LutFanoutCells<scalar_t, 4> &cells)
+    {
+        TetrahedralFanoutCells(row, n, dim, cells);
+    });
+}
+
+template <typename scalar_t>
+void TetrahedralMaskBackwardCpu(const scalar_t *luts, const int count, const scalar_t *mask, const int mask_channels, const scalar_t *image, const scalar_t *image_grad, scalar_t *luts_grad, scalar_t *mask_grad, scalar_t *input_grad, const LutImageLayout &mask_layout, const LutImageLayout &image_layout, const LutImageLayout &grad_layout, const LutImageLayout &mask_grad_layout, const LutImageLayout &input_grad_layout, const int dim, const int width, const int height, const int batch)
+{
+    lut_mask_backward<scalar_t, 4>(luts, count, mask, mask_channels, image, image_grad, luts_grad, mask_grad, input_grad, mask_layout, image_layout, grad_layout, mask_grad_layout, input_grad_layout, dim, dim * dim * dim, width, height, batch, [&](const scalar_t r, const scalar_t g, const scalar_t b)
+    {
+        return tetrahedral_cell(r, g, b, dim);
+    });
+}
+
+template <typename scalar_t>
+void TetrahedralBackwardCpu(const scalar_t *image, const scalar_t *image_grad, const scalar_t *lut, scalar_t *lut_grad, LutSparseGrad<scalar_t> *sparse_grad, scalar_t *input_grad, const LutImageLayout &image_layout, const LutImageLayout &grad_layout, const LutImageLayout &input_grad_layout, const int dim, const int shift, const float binsize, const int width, const int height, const int batch)
+{
+    lut_parallel_accumulate_grad(lut_grad, sparse_grad, dim, batch, height, width, [&](const int batch_index, const int h, LutNodeGrad<scalar_t> &grad)
+    {
+        for (int w = 0; w < width; ++w)
         {
-            for (int w = 0; w < width; ++w)
+            int64_t r_index = image_layout.offset(batch_index, 0, h, w);
+            int64_t g_index = r_index + image_layout.channel;
+            int64_t b_index = r_index + image_layout.channel * 2;
+            int64_t r_grad = grad_layout.offset(batch_index, 0, h, w);
+            int64_t g_grad = r_grad + grad_layout.channel;
+            int64_t b_grad = r_grad + grad_layout.channel * 2;
+
+            const TetrahedralCell<scalar_t> cell = tetrahedral_cell(image[r_index], image[g_index], image[b_index], dim);
+            const scalar_t g[3] = {image_grad[r_grad], image_grad[g_grad], image_grad[b_grad]};
+
+            lut_node_grad_scatter<scalar_t, 4>(grad, cell.id, cell.w, g);
+
+            if (input_grad == nullptr)
+                continue;
+
+            scalar_t coord[3] = {0, 0, 0};
+            for (int c = 0; c < 3; ++c)
             {
-                int r_index = INDEX(batch_index, 0, h, w, 3, height, width);
-                int g_index = INDEX(batch_index, 1, h, w, 3, height, width);
-                int b_index = INDEX(batch_index, 2, h, w, 3, height, width);
-
-                scalar_t r = image[r_index];
-                scalar_t g = image[g_index];
-                scalar_t b = image[b_index];
-
-                scalar_t r_loc = r * (dim - 1);
-                scalar_t g_loc = g * (dim - 1);
-                scalar_t b_loc = b * (dim - 1);
-
-                int r_0 = floor(r_loc);
-                int g_0 = floor(g_loc);
-                int b_0 = floor(b_loc);
-                int r_1 = r_0 + 1;
-                int g_1 = g_0 + 1;
-                int b_1 = b_0 + 1;
-
-                r_0 = CLIP(r_0, 0, dim - 1);
-                g_0 = CLIP(g_0, 0, dim - 1);
-                b_0 = CLIP(b_0, 0, dim - 1);
-                r_1 = CLIP(r_1, 0, dim - 1);
-                g_1 = CLIP(g_1, 0, dim - 1);
-                b_1 = CLIP(b_1, 0, dim - 1);
-
-                scalar_t r_d = r_loc - r_0;
-                scalar_t g_d = g_loc - g_0;
-                scalar_t b_d = b_loc - b_0;
-
-                // compute value based on 6 cases
-                if (r_d > g_d && g_d > b_d)
-                {
-                    output[r_index] = (1 - r_d) * lut[INDEX(0, r_0, g_0, b_0, dim, dim, dim)] +
-                                      (r_d - g_d) * lut[INDEX(0, r_1, g_0, b_0, dim, dim, dim)] +
-                                      (g_d - b_d) * lut[INDEX(0, r_1, g_1, b_0, dim, dim, dim)] +
-                                      b_d * lut[INDEX(0, r_1, g_1, b_1, dim, dim, dim)];
-
-                    output[g_index] = (1 - r_d) * lut[INDEX(1, r_0, g_0, b_0, dim, dim, dim)] +
-                                      (r_d - g_d) * lut[INDEX(1, r_1, g_0, b_0, dim, dim, dim)] +
-                                      (g_d - b_d) * lut[INDEX(1, r_1, g_1, b_0, dim, dim, dim)] +
-                                      b_d * lut[INDEX(1, r_1, g_1, b_1, dim, dim, dim)];
-
-                    output[b_index] = (1 - r_d) * lut[INDEX(2, r_0, g_0, b_0, dim, dim, dim)] +
-                                      (r_d - g_d) * lut[INDEX(2, r_1, g_0, b_0, dim, dim, dim)] +
-                                      (g_d - b_d) * lut[INDEX(2, r_1, g_1, b_0, dim, dim, dim)] +
-                                      b_d * lut[INDEX(2, r_1, g_1, b_1, dim, dim, dim)];
-                }
-                else if (r_d > g_d && r_d > b_d)
-                {
-                    output[r_index] = (1 - r_d) * lut[INDEX(0, r_0, g_0, b_0, dim, dim, dim)] +
-                                      (r_d - b_d) * lut[INDEX(0, r_1, g_0, b_0, dim, dim, dim)] +
-                                      (b_d - g_d) * lut[INDEX(0, r_1, g_0, b_1, dim, dim, dim)] +
-                                      g_d * lut[INDEX(0, r_1, g_1, b_1, dim, dim, dim)];
-
-                    output[g_index] = (1 - r_d) * lut[INDEX(1, r_0, g_0, b_0, dim, dim, dim)] +
-                                      (r_d - b_d) * lut[INDEX(1, r_1, g_0, b_0, dim, dim, dim)] +
-                                      (b_d - g_d) * lut[INDEX(1, r_1, g_0, b_1, dim, dim, dim)] +
-                                      g_d * lut[INDEX(1, r_1, g_1, b_1, dim, dim, dim)];
-
-                    output[b_index] = (1 - r_d) * lut[INDEX(2, r_0, g_0, b_0, dim, dim, dim)] +
-                                      (r_d - b_d) * lut[INDEX(2, r_1, g_0, b_0, dim, dim, dim)] +
-                                      (b_d - g_d) * lut[INDEX(2, r_1, g_0, b_1, dim, dim, dim)] +
-                                      g_d * lut[INDEX(2, r_1, g_1, b_1, dim, dim, dim)];
-                }
-                else if (r_d > g_d && g_d <= b_d && r_d <= b_d)
-                {
-                    output[r_index] = (1 - b_d) * lut[INDEX(0, r_0, g_0, b_0, dim, dim, dim)] +
-                                      (b_d - r_d) * lut[INDEX(0, r_0, g_0, b_1, dim, dim, dim)] +
-                                      (r_d - g_d) * lut[INDEX(0, r_1, g_0, b_1, dim, dim, dim)] +
-                                      g_d * lut[INDEX(0, r_1, g_1, b_1, dim, dim, dim)];
-
-                    output[g_index] = (1 - b_d) * lut[INDEX(1, r_0, g_0, b_0, dim, dim, dim)] +
-                                      (b_d - r_d) * lut[INDEX(1, r_0, g_0, b_1, dim, dim, dim)] +
-                                      (r_d - g_d) * lut[INDEX(1, r_1, g_0, b_1, dim, dim, dim)] +
-                                      g_d * lut[INDEX(1, r_1, g_1, b_1, dim, dim, dim)];
-
-                    output[b_index] = (1 - b_d) * lut[INDEX(2, r_0, g_0, b_0, dim, dim, dim)] +
-                                      (b_d - r_d) * lut[INDEX(2, r_0, g_0, b_1, dim, dim, dim)] +
-                                      (r_d - g_d) * lut[INDEX(2, r_1, g_0, b_1, dim, dim, dim)] +
-                                      g_d * lut[INDEX(2, r_1, g_1, b_1, dim, dim, dim)];
-                }
-                else if (r_d <= g_d && b_d > g_d)
-                {
-                    output[r_index] = (1 - b_d) * lut[INDEX(0, r_0, g_0, b_0, dim, dim, dim)] +
-                                      (b_d - g_d) * lut[INDEX(0, r_0, g_0, b_1, dim, dim, dim)] +
-                                      (g_d - r_d) * lut[INDEX(0, r_0, g_1, b_1, dim, dim, dim)] +
-                                      r_d * lut[INDEX(0, r_1, g_1, b_1, dim, dim, dim)];
-
-                    output[g_index] = (1 - b_d) * lut[INDEX(1, r_0, g_0, b_0, dim, dim, dim)] +
-                                      (b_d - g_d) * lut[INDEX(1, r_0, g_0, b_1, dim, dim, dim)] +
-                                      (g_d - r_d) * lut[INDEX(1, r_0, g_1, b_1, dim, dim, dim)] +
-                                      r_d * lut[INDEX(1, r_1, g_1, b_1, dim, dim, dim)];
-
-                    output[b_index] = (1 - b_d) * lut[INDEX(2, r_0, g_0, b_0, dim, dim, dim)] +
-                                      (b_d - g_d) * lut[INDEX(2, r_0, g_0, b_1, dim, dim, dim)] +
-                                      (g_d - r_d) * lut[INDEX(2, r_0, g_1, b_1, dim, dim, dim)] +
-                                      r_d * lut[INDEX(2, r_1, g_1, b_1, dim, dim, dim)];
-                }
-                else if (r_d <= g_d && b_d > r_d)
-                {
-                    output[r_index] = (1 - g_d) * lut[INDEX(0, r_0, g_0, b_0, dim, dim, dim)] +
-                                      (g_d - b_d) * lut[INDEX(0, r_0, g_1, b_0, dim, dim, dim)] +
-                                      (b_d - r_d) * lut[INDEX(0, r_0, g_1, b_1, dim, dim, dim)] +
-                                      r_d * lut[INDEX(0, r_1, g_1, b_1, dim, dim, dim)];
-
-                    output[g_index] = (1 - g_d) * lut[INDEX(1, r_0, g_0, b_0, dim, dim, dim)] +
-                                      (g_d - b_d) * lut[INDEX(1, r_0, g_1, b_0, dim, dim, dim)] +
-                                      (b_d - r_d) * lut[INDEX(1, r_0, g_1, b_1, dim, dim, dim)] +
-                                      r_d * lut[INDEX(1, r_1, g_1, b_1, dim, dim, dim)];
-
-                    output[b_index] = (1 - g_d) * lut[INDEX(2, r_0, g_0, b_0, dim, dim, dim)] +
-                                      (g_d - b_d) * lut[INDEX(2, r_0, g_1, b_0, dim, dim, dim)] +
-                                      (b_d - r_d) * lut[INDEX(2, r_0, g_1, b_1, dim, dim, dim)] +
-                                      r_d * lut[INDEX(2, r_1, g_1, b_1, dim, dim, dim)];
-                }
-                else
-                {
-                    output[r_index] = (1 - g_d) * lut[INDEX(0, r_0, g_0, b_0, dim, dim, dim)] +
-                                      (g_d - r_d) * lut[INDEX(0, r_0, g_1, b_0, dim, dim, dim)] +
-                                      (r_d - b_d) * lut[INDEX(0, r_1, g_1, b_0, dim, dim, dim)] +
-                                      b_d * lut[INDEX(0, r_1, g_1, b_1, dim, dim, dim)];
-
-                    output[g_index] = (1 - g_d) * lut[INDEX(1, r_0, g_0, b_0, dim, dim, dim)] +
-                                      (g_d - r_d) * lut[INDEX(1, r_0, g_1, b_0, dim, dim, dim)] +
-                                      (r_d - b_d) * lut[INDEX(1, r_1, g_1, b_0, dim, dim, dim)] +
-                                      b_d * lut[INDEX(1, r_1, g_1, b_1, dim, dim, dim)];
-
-                    output[b_index] = (1 - g_d) * lut[INDEX(2, r_0, g_0, b_0, dim, dim, dim)] +
-                                      (g_d - r_d) * lut[INDEX(2, r_0, g_1, b_0, dim, dim, dim)] +
-                                      (r_d - b_d) * lut[INDEX(2, r_1, g_1, b_0, dim, dim, dim)] +
-                                      b_d * lut[INDEX(2, r_1, g_1, b_1, dim, dim, dim)];
-                }
+                scalar_t slope[3];
+                tetrahedral_slope(cell, lut + shift * c, dim, slope);
+                for (int a = 0; a < 3; ++a)
+                    coord[a] += slope[a] * g[c];
             }
+
+            const int64_t input_index = input_grad_layout.offset(batch_index, 0, h, w);
+            for (int a = 0; a < 3; ++a)
+                input_grad[input_index + a * input_grad_layout.channel] = coord[a];
         }
-    }
+    });
+}
+
+template <typename scalar_t>
+double TetrahedralLossBackwardCpu(const scalar_t *lut, const scalar_t *image, const scalar_t *target, scalar_t *lut_grad, LutSparseGrad<scalar_t> *sparse_grad, const LutImageLayout &image_layout, const LutImageLayout &target_layout, const int norm, const int dim, const int shift, const int width, const int height, const int batch)
+{
+    return lut_loss_backward<scalar_t, 4>(lut, image, target, lut_grad, sparse_grad, image_layout, target_layout, norm, dim, shift, width, height, batch, [&](const scalar_t r, const scalar_t g, const scalar_t b)
+    {
+        return tetrahedral_cell(r, g, b, dim);
+    });
+}
+
+template <typename scalar_t, typename pixel_t>
+void TetrahedralForwardPackedCpu(const scalar_t *packed, const pixel_t *image, pixel_t *output, const LutImageLayout &image_layout, const LutImageLayout &output_layout, const int dim, const int width, const int height, const int batch)
+{
+    lut_forward_rows<scalar_t>(image, output, image_layout, output_layout, batch, height, width, [&](const scalar_t *image, scalar_t *output, const int64_t plane)
+    {
+        int w = TetrahedralForwardRowSimd(tetrahedral_packed_row_kernel, packed, image, output, plane, width, dim, 0);
+
+        for (; w < width; ++w)
+        {
+            int64_t r_index = w;
+            int64_t g_index = w + plane;
+            int64_t b_index = w + plane * 2;
+
+            const TetrahedralCell<scalar_t> cell = tetrahedral_cell(image[r_index], image[g_index], image[b_index], dim);
+
+            scalar_t rgb[3];
+            lut_node_blend<scalar_t, 4>(packed, cell.id, cell.w, rgb);
+            output[r_index] = rgb[0];
+            output[g_index] = rgb[1];
+            output[b_index] = rgb[2];
+        }
+    });
 }
 
 template <typename scalar_t>
-void TetrahedralBackwardCpu(const scalar_t *image, const scalar_t *image_grad, scalar_t *lut_grad, const int dim, const int shift, const float binsize, const int width, const int height, const int channels, const int batch)
+void TetrahedralShaperForwardCpu(const scalar_t *shaper, const int shaper_dim, const int shaper_stride, const scalar_t *lut, const scalar_t *image, scalar_t *output, const LutImageLayout &image_layout, const LutImageLayout &output_layout, const int dim, const int shift, const int width, const int height, const int batch)
 {
-    for (int batch_index = 0; batch_index < batch; ++batch_index)
+    lut_parallel_rows(batch, height, width, [&](const int batch_index, const int h)
     {
-        for (int h = 0; h < height; ++h)
+        scalar_t *row = lut_row_buffer<scalar_t>(width);
+
+        lut_shaper_row(shaper, shaper_dim, shaper_stride, image + image_layout.offset(batch_index, 0, h, 0), image_layout.channel, image_layout.col, row, width);
+        TetrahedralForwardRow(lut, row, row + width * 3, width, width, dim, shift);
+        lut_store_row(row + width * 3, output + output_layout.offset(batch_index, 0, h, 0), output_layout, width);
+    });
+}
+
+// grad holds the 3D LUT gradient followed by the shaper gradient. The shaper
+// receives the image gradient pulled back through the 3D interpolation (its
+// slope along each input axis) and through the clamp.
+template <typename scalar_t>
+void TetrahedralShaperBackwardCpu(const scalar_t *shaper, const int shaper_dim, const int shaper_stride, const scalar_t *lut, const scalar_t *image, const scalar_t *image_grad, scalar_t *grad, const LutImageLayout &image_layout, const LutImageLayout &grad_layout, const int dim, const int shift, const int width, const int height, const int batch)
+{
+    const int64_t grad_size = (int64_t)shift * 3 + (shaper_stride ? shaper_dim * 3 : shaper_dim);
+
+    lut_parallel_accumulate(grad, grad_size, batch, height, width, [&](const int batch_index, const int h, scalar_t *lut_grad)
+    {
+        scalar_t *shaper_grad = lut_grad + shift * 3;
+
+        for (int w = 0; w < width; ++w)
         {
-            for (int w = 0; w < width; ++w)
+            const int64_t index = image_layout.offset(batch_index, 0, h, w);
+            const int64_t grad_index = grad_layout.offset(batch_index, 0, h, w);
+
+            ShaperSample<scalar_t> s[3];
+            scalar_t g[3];
+            for (int c = 0; c < 3; ++c)
             {
-                int r_index = INDEX(batch_index, 0, h, w, 3, height, width);
-                int g_index = INDEX(batch_index, 1, h, w, 3, height, width);
-                int b_index = INDEX(batch_index, 2, h, w, 3, height, width);
-
-                scalar_t r = image[r_index];
-                scalar_t g = image[g_index];
-                scalar_t b = image[b_index];
-
-                scalar_t r_loc = r * (dim - 1);
-                scalar_t g_loc = g * (dim - 1);
-                scalar_t b_loc = b * (dim - 1);
-
-                int r_0 = floor(r_loc);
-                int g_0 = floor(g_loc);
-                int b_0 = floor(b_loc);
-                int r_1 = r_0 + 1;
-                int g_1 = g_0 + 1;
-                int b_1 = b_0 + 1;
-
-                r_0 = CLIP(r_0, 0, dim - 1);
-                g_0 = CLIP(g_0, 0, dim - 1);
-                b_0 = CLIP(b_0, 0, dim - 1);
-                r_1 = CLIP(r_1, 0, dim - 1);
-                g_1 = CLIP(g_1, 0, dim - 1);
-                b_1 = CLIP(b_1, 0, dim - 1);
-
-                scalar_t r_d = r_loc - r_0;
-                scalar_t g_d = g_loc - g_0;
-                scalar_t b_d = b_loc - b_0;
-
-                int id000 = INDEX(0, r_0, g_0, b_0, dim, dim, dim);
-                int id100 = INDEX(0, r_1, g_0, b_0, dim, dim, dim);
-                int id010 = INDEX(0, r_0, g_1, b_0, dim, dim, dim);
-                int id110 = INDEX(0, r_1, g_1, b_0, dim, dim, dim);
-                int id001 = INDEX(0, r_0, g_0, b_1, dim, dim, dim);
-                int id101 = INDEX(0, r_1, g_0, b_1, dim, dim, dim);
-                int id011 = INDEX(0, r_0, g_1, b_1, dim, dim, dim);
-                int id111 = INDEX(0, r_1, g_1, b_1, dim, dim, dim);
-
-                // compute gradient based on 6 cases
-                if (r_d > g_d && g_d > b_d)
-                {
-                    lut_grad[id000] += (1 - r_d) * image_grad[r_index];
-                    lut_grad[id100] += (r_d - g_d) * image_grad[r_index];
-                    lut_grad[id110] += (g_d - b_d) * image_grad[r_index];
-                    lut_grad[id111] += b_d * image_grad[r_index];
-
-                    lut_grad[id000 + shift] += (1 - r_d) * image_grad[g_index];
-                    lut_grad[id100 + shift] += (r_d - g_d) * image_grad[g_index];
-                    lut_grad[id110 + shift] += (g_d - b_d) * image_grad[g_index];
-                    lut_grad[id111 + shift] += b_d * image_grad[g_index];
-
-                    lut_grad[id000 + shift * 2] += (1 - r_d) * image_grad[b_index];
-                    lut_grad[id100 + shift * 2] += (r_d - g_d) * image_grad[b_index];
-                    lut_grad[id110 + shift * 2] += (g_d - b_d) * image_grad[b_index];
-                    lut_grad[id111 + shift * 2] += b_d * image_grad[b_index];
-                }
-                else if (r_d > g_d && r_d > b_d)
-                {
-                    lut_grad[id000] += (1 - r_d) * image_grad[r_index];
-                    lut_grad[id100] += (r_d - b_d) * image_grad[r_index];
-                    lut_grad[id101] += (b_d - g_d) * image_grad[r_index];
-                    lut_grad[id111] += g_d * image_grad[r_index];
-
-                    lut_grad[id000 + shift] += (1 - r_d) * image_grad[g_index];
-                    lut_grad[id100 + shift] += (r_d - b_d) * image_grad[g_index];
-                    lut_grad[id101 + shift] += (b_d - g_d) * image_grad[g_index];
-                    lut_grad[id111 + shift] += g_d * image_grad[g_index];
-
-                    lut_grad[id000 + shift * 2] += (1 - r_d) * image_grad[b_index];
-                    lut_grad[id100 + shift * 2] += (r_d - b_d) * image_grad[b_index];
-                    lut_grad[id101 + shift * 2] += (b_d - g_d) * image_grad[b_index];
-                    lut_grad[id111 + shift * 2] += g_d * image_grad[b_index];
-                }
-                else if (r_d > g_d && g_d <= b_d && r_d <= b_d)
-                {
-                    lut_grad[id000] += (1 - b_d) * image_grad[r_index];
-                    lut_grad[id001] += (b_d - r_d) * image_grad[r_index];
-                    lut_grad[id101] += (r_d - g_d) * image_grad[r_index];
-                    lut_grad[id111] += g_d * image_grad[r_index];
-
-                    lut_grad[id000 + shift] += (1 - b_d) * image_grad[g_index];
-                    lut_grad[id001 + shift] += (b_d - r_d) * image_grad[g_index];
-                    lut_grad[id101 + shift] += (r_d - g_d) * image_grad[g_index];
-                    lut_grad[id111 + shift] += g_d * image_grad[g_index];
-
-                    lut_grad[id000 + shift * 2] += (1 - b_d) * image_grad[b_index];
-                    lut_grad[id001 + shift * 2] += (b_d - r_d) * image_grad[b_index];
-                    lut_grad[id101 + shift * 2] += (r_d - g_d) * image_grad[b_index];
-                    lut_grad[id111 + shift * 2] += g_d * image_grad[b_index];
-                }
-                else if (r_d <= g_d && b_d > g_d)
-                {
-                    lut_grad[id000] += (1 - b_d) * image_grad[r_index];
-                    lut_grad[id001] += (b_d - g_d) * image_grad[r_index];
-                    lut_grad[id011] += (g_d - r_d) * image_grad[r_index];
-                    lut_grad[id111] += r_d * image_grad[r_index];
-
-                    lut_grad[id000 + shift] += (1 - b_d) * image_grad[g_index];
-                    lut_grad[id001 + shift] += (b_d - g_d) * image_grad[g_index];
-                    lut_grad[id011 + shift] += (g_d - r_d) * image_grad[g_index];
-                    lut_grad[id111 + shift] += r_d * image_grad[g_index];
-
-                    lut_grad[id000 + shift * 2] += (1 - b_d) * image_grad[b_index];
-                    lut_grad[id001 + shift * 2] += (b_d - g_d) * image_grad[b_index];
-                    lut_grad[id011 + shift * 2] += (g_d - r_d) * image_grad[b_index];
-                    lut_grad[id111 + shift * 2] += r_d * image_grad[b_index];
-                }
-                else if (r_d <= g_d && b_d > r_d)
-                {
-                    lut_grad[id000] += (1 - g_d) * image_grad[r_index];
-                    lut_grad[id010] += (g_d - b_d) * image_grad[r_index];
-                    lut_grad[id011] += (b_d - r_d) * image_grad[r_index];
-                    lut_grad[id111] += r_d * image_grad[r_index];
-
-                    lut_grad[id000 + shift] += (1 - g_d) * image_grad[g_index];
-                    lut_grad[id010 + shift] += (g_d - b_d) * image_grad[g_index];
-                    lut_grad[id011 + shift] += (b_d - r_d) * image_grad[g_index];
-                    lut_grad[id111 + shift] += r_d * image_grad[g_index];
-
-                    lut_grad[id000 + shift * 2] += (1 - g_d) * image_grad[b_index];
-                    lut_grad[id010 + shift * 2] += (g_d - b_d) * image_grad[b_index];
-                    lut_grad[id011 + shift * 2] += (b_d - r_d) * image_grad[b_index];
-                    lut_grad[id111 + shift * 2] += r_d * image_grad[b_index];
-                }
-                else
-                {
-                    lut_grad[id000] += (1 - g_d) * image_grad[r_index];
-                    lut_grad[id010] += (g_d - r_d) * image_grad[r_index];
-                    lut_grad[id110] += (r_d - b_d) * image_grad[r_index];
-                    lut_grad[id111] += b_d * image_grad[r_index];
-
-                    lut_grad[id000 + shift] += (1 - g_d) * image_grad[g_index];
-                    lut_grad[id010 + shift] += (g_d - r_d) * image_grad[g_index];
-                    lut_grad[id110 + shift] += (r_d - b_d) * image_grad[g_index];
-                    lut_grad[id111 + shift] += b_d * image_grad[g_index];
-
-                    lut_grad[id000 + shift * 2] += (1 - g_d) * image_grad[b_index];
-                    lut_grad[id010 + shift * 2] += (g_d - r_d) * image_grad[b_index];
-                    lut_grad[id110 + shift * 2] += (r_d - b_d) * image_grad[b_index];
-                    lut_grad[id111 + shift * 2] += b_d * image_grad[b_index];
-                }
+                s[c] = lut_shaper_sample(shaper + c * shaper_stride, shaper_dim, image[index + c * image_layout.channel]);
+                g[c] = image_grad[grad_index + c * grad_layout.channel];
+            }
+
+            const TetrahedralCell<scalar_t> cell = tetrahedral_cell(s[0].value, s[1].value, s[2].value, dim);
+
+            scalar_t coord[3] = {0, 0, 0};
+            for (int c = 0; c < 3; ++c)
+            {
+                for (int k = 0; k < 4; ++k)
+                    lut_grad[cell.id[k] + shift * c] += cell.w[k] * g[c];
+
+                scalar_t slope[3];
+                tetrahedral_slope(cell, lut + shift * c, dim, slope);
+                for (int a = 0; a < 3; ++a)
+                    coord[a] += slope[a] * g[c];
+            }
+
+            for (int c = 0; c < 3; ++c)
+            {
+                if (!s[c].inside)
+                    continue;
+                shaper_grad[c * shaper_stride + s[c].lo] += (1 - s[c].d) * coord[c];
+                shaper_grad[c * shaper_stride + s[c].hi] += s[c].d * coord[c];
             }
         }
-    }
+    });
 }
 
 PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
 {
     m.def("forward", &tetrahedral_forward, "Tetrahedral forward");
     m.def("backward", &tetrahedral_backward, "Tetrahedral backward");
+    m.def("backward_input", &tetrahedral_backward_input, "Tetrahedral backward for the LUT and the input image");
+    m.def("pack_lut", &tetrahedral_pack_lut, "Pack a LUT into the node-interleaved layout");
+    m.def("forward_packed", &tetrahedral_forward_packed, "Tetrahedral forward on a packed LUT");
+    m.def("shaper_forward", &tetrahedral_shaper_forward, "Tetrahedral forward with a 1D shaper");
+    m.def("shaper_backward", &tetrahedral_shaper_backward, "Tetrahedral backward with a 1D shaper");
+    m.def("chain_forward", &tetrahedral_chain_forward, "Apply a chain of LUTs stage by stage");
+    m.def("bake", &tetrahedral_bake, "Bake a chain of LUTs into one LUT");
+    m.def("bake_table", &tetrahedral_bake_table, "Bake a LUT into a 256^3 table for uint8 images");
+    m.def("forward_table", &tetrahedral_forward_table, "Apply a baked 256^3 table to a uint8 image");
+    m.def("blend_forward", &tetrahedral_blend_forward, "Tetrahedral forward of per-sample blends of basis LUTs");
+    m.def("blend_backward", &tetrahedral_blend_backward, "Tetrahedral backward of per-sample blends of basis LUTs");
+    m.def("bank_forward", &tetrahedral_bank_forward, "Interpolate every sample with its own LUT of a bank");
+    m.def("fanout_forward", &tetrahedral_fanout_forward, "Interpolate one image with each of a stack of LUTs");
+    m.def("mask_forward", &tetrahedral_mask_forward, "Interpolate each pixel against a mask-weighted blend of a stack of LUTs");
+    m.def("mask_backward", &tetrahedral_mask_backward, "Gradients of the LUTs, the mask and the image for mask_forward");
+    m.def("stream_forward", &tetrahedral_stream_forward, "Apply a LUT to an image file strip by strip with bounded memory");
+    m.def("batch_forward", &tetrahedral_batch_forward, "Apply a LUT to a list of image files with pipelined decode, apply and encode");
+    m.def("batch_png", &lut_batch_png, "Whether batch_forward reads and writes PNG files (libpng was found at build time)");
+    m.def("loss_backward", &tetrahedral_loss_backward, "L1 / L2 loss of the interpolated image and its LUT gradient in one pass");
+    m.def("backward_sparse", &tetrahedral_backward_sparse, "Backward with the LUT gradient as COO indices and values of the nodes it reaches");
+    m.def("loss_backward_sparse", &tetrahedral_loss_backward_sparse, "loss_backward with the LUT gradient as COO indices and values of the nodes it reaches");
+    m.def("sparse_grad", &tetrahedral_sparse_grad, "Coalesced COO indices and values of the touched nodes of a LUT gradient");
+    m.def("sparse_adam", &tetrahedral_sparse_adam, "Adam step on the entries of a sparse (or dense) gradient");
+    m.def("sparse_sgd", &tetrahedral_sparse_sgd, "SGD step on the entries of a sparse (or dense) gradient");
+    m.def("classify", &tetrahedral_classify, "Classify a LUT as identity, per-channel curves or full 3D within a tolerance");
+    m.def("forward_separable", &tetrahedral_forward_separable, "Forward of a separable LUT as three 1D curve lookups");
+    lut_def_host_ops(m);
+}
+
+// The same operators through the dispatcher, with C++ autograd (lut_op.h):
+// torch.ops.tetrahedral.interpolate(lut, image) and its out= variant, with CPU,
+// Autograd and Meta kernels.
+static constexpr char tetrahedral_interpolate_op[] = "tetrahedral::interpolate";
+
+TORCH_LIBRARY(tetrahedral, m)
+{
+    m.def("interpolate(Tensor lut, Tensor image) -> Tensor");
+    m.def("interpolate.out(Tensor lut, Tensor image, *, Tensor(a!) out) -> Tensor(a!)");
+}
+
+TORCH_LIBRARY_IMPL(tetrahedral, CPU, m)
+{
+    m.impl("interpolate", &lut_interpolate_cpu<tetrahedral_forward>);
+    m.impl("interpolate.out", &lut_interpolate_out<tetrahedral_forward>);
+}
+
+TORCH_LIBRARY_IMPL(tetrahedral, Autograd, m)
+{
+    m.impl("interpolate", &lut_interpolate<tetrahedral_interpolate_op, tetrahedral_backward, tetrahedral_backward_input>);
+}
+
+TORCH_LIBRARY_IMPL(tetrahedral, Meta, m)
+{
+    m.impl("interpolate", &lut_interpolate_meta);
 }
@@ -2,6 +2,26 @@
 #define TETRAHEDRAL_H
 
 #include <torch/extension.h>
+#include "lut_bank.h"
+#include "lut_batch.h"
+#include "lut_blend.h"
+#include "lut_chain.h"
+#include "lut_cube.h"
+#include "lut_fanout.h"
+#include "lut_host.h"
+#include "lut_image.h"
+#include "lut_interp.h"
+#include "lut_layout.h"
+#include "lut_loss.h"
+#include "lut_mask.h"
+#include "lut_op.h"
+#include "lut_parallel.h"
+#include "lut_separable.h"
+#include "lut_shaper.h"
+#include "lut_shard.h"
+#include "lut_sparse.h"
+#include "lut_stream.h"
+#include "lut_table.h"
 
 int tetrahedral_forward(torch::Tensor lut, torch::Tensor image, torch::Tensor output,
                         int lut_dim, int shift, float binsize, int width, int height, int batch);
@@ -9,4 +29,77 @@ int tetrahedral_forward(torch::Tensor lut, torch::Tensor image, torch::Tensor ou
 int tetrahedral_backward(torch::Tensor image, torch::Tensor image_grad, torch::Tensor lut_grad,
                          int lut_dim, int shift, float binsize, int width, int height, int batch);
 
+int tetrahedral_backward_input(torch::Tensor lut, torch::Tensor image, torch::Tensor image_grad, torch::Tensor lut_grad, torch::Tensor input_grad,
+                               int lut_dim, int shift, float binsize, int width, int height, int batch);
+
+int tetrahedral_pack_lut(torch::Tensor lut, torch::Tensor packed, int lut_dim);
+
+int tetrahedral_forward_packed(torch::Tensor packed, torch::Tensor image, torch::Tensor output,
+                               int lut_dim, int width, int height, int batch);
+
+int tetrahedral_shaper_forward(torch::Tensor shaper, torch::Tensor lut, torch::Tensor image, torch::Tensor output,
+                               int shaper_dim, int lut_dim, int shift, float binsize, int width, int height, int batch);
+
+int tetrahedral_shaper_backward(torch::Tensor shaper, torch::Tensor lut, torch::Tensor image, torch::Tensor image_grad,
+                                torch::Tensor shaper_grad, torch::Tensor lut_grad,
+                                int shaper_dim, int lut_dim, int shift, float binsize, int width, int height, int batch);
+
+int tetrahedral_chain_forward(std::vector<torch::Tensor> stages, torch::Tensor image, torch::Tensor output,
+                              int width, int height, int batch);
+
+int tetrahedral_bake(std::vector<torch::Tensor> stages, torch::Tensor baked, int baked_dim);
+
+int tetrahedral_bake_table(torch::Tensor lut, torch::Tensor table, int lut_dim, int shift);
+
+int tetrahedral_forward_table(torch::Tensor table, torch::Tensor image, torch::Tensor output,
+                              int width, int height, int batch);
+
+int tetrahedral_blend_forward(torch::Tensor basis, torch::Tensor weights, torch::Tensor image, torch::Tensor output,
+                              int lut_dim, int shift, float binsize, int width, int height, int batch);
+
+int tetrahedral_blend_backward(torch::Tensor basis, torch::Tensor weights, torch::Tensor image, torch::Tensor image_grad,
+                               torch::Tensor basis_grad, torch::Tensor weights_grad, c10::optional<torch::Tensor> input_grad,
+                               int lut_dim, int shift, float binsize, int width, int height, int batch);
+
+int tetrahedral_bank_forward(torch::Tensor arena, torch::Tensor index, torch::Tensor ids, torch::Tensor image, torch::Tensor output,
+                             int width, int height, int batch);
+
+int tetrahedral_fanout_forward(torch::Tensor luts, torch::Tensor image, torch::Tensor output,
+                               int lut_dim, int width, int height, int batch);
+
+int tetrahedral_mask_forward(torch::Tensor luts, torch::Tensor mask, torch::Tensor image, torch::Tensor output,
+                             int lut_dim, int width, int height, int batch);
+
+int tetrahedral_mask_backward(torch::Tensor luts, torch::Tensor mask, torch::Tensor image, torch::Tensor image_grad,
+                              torch::Tensor luts_grad, c10::optional<torch::Tensor> mask_grad, c10::optional<torch::Tensor> input_grad,
+                              int lut_dim, int width, int height, int batch);
+
+int tetrahedral_stream_forward(torch::Tensor lut, const std::string &input_path, const std::string &output_path,
+                               int lut_dim, int shift, float binsize, int raw_width, int raw_height,
+                               const std::string &raw_type, int64_t budget);
+
+std::map<std::string, std::map<std::string, double>> tetrahedral_batch_forward(torch::Tensor lut, const std::vector<std::string> &inputs, const std::string &output_dir,
+                                                                               int lut_dim, int shift, float binsize, int workers, int depth);
+
+double tetrahedral_loss_backward(torch::Tensor lut, torch::Tensor image, torch::Tensor target, torch::Tensor lut_grad,
+                                 int norm, int lut_dim, int shift, float binsize, int width, int height, int batch);
+
+std::tuple<torch::Tensor, torch::Tensor> tetrahedral_backward_sparse(torch::Tensor lut, torch::Tensor image, torch::Tensor image_grad, c10::optional<torch::Tensor> input_grad,
+                                                                     int lut_dim, int shift, float binsize, int width, int height, int batch);
+
+std::tuple<double, torch::Tensor, torch::Tensor> tetrahedral_loss_backward_sparse(torch::Tensor lut, torch::Tensor image, torch::Tensor target,
+                                                                                  int norm, int lut_dim, int shift, float binsize, int width, int height, int batch);
+
+std::tuple<torch::Tensor, torch::Tensor> tetrahedral_sparse_grad(torch::Tensor lut_grad, int lut_dim);
+
+int tetrahedral_sparse_adam(torch::Tensor param, torch::Tensor exp_avg, torch::Tensor exp_avg_sq, c10::optional<torch::Tensor> indices, torch::Tensor values,
+                            int64_t step, double lr, double beta1, double beta2, double eps);
+
+int tetrahedral_sparse_sgd(torch::Tensor param, c10::optional<torch::Tensor> indices, torch::Tensor values, double lr);
+
+int tetrahedral_classify(torch::Tensor lut, torch::Tensor curves, int lut_dim, double tol);
+
+int tetrahedral_forward_separable(torch::Tensor curves, torch::Tensor image, torch::Tensor output,
+                                  int lut_dim, int width, int height, int batch);
+
 #endif
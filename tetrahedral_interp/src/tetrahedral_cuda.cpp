@@ -1,4 +1,5 @@
 #include "tetrahedral_kernel.h"
+#include "lut_host.h"
 #include <c10/cuda/CUDAGuard.h>
 
 #define CHECK_CUDA(x) TORCH_CHECK(x.device().is_cuda(), #x " must be a CUDA tensor")
@@ -74,4 +75,5 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
 {
     m.def("forward", &tetrahedral_forward_cuda, "Tetrahedral forward");
     m.def("backward", &tetrahedral_backward_cuda, "Tetrahedral backward");
+    lut_def_host_ops(m);
 }
@@ -0,0 +1,292 @@
+#ifndef TETRAHEDRAL_SIMD_H
+#define TETRAHEDRAL_SIMD_H
+
+#include "lut_cpu.h"
+
+// Vector versions of the float TetrahedralForwardCpu inner loop, 8 (AVX2) or
+// 16 (AVX-512) pixels per iteration. A row kernel interpolates the longest
+// prefix of one planar image row that fills whole vectors and returns its
+// length; the caller finishes the row with the scalar code. image and output
+// point at the R value of the first pixel, the G and B planes follow `plane`
+// elements apart. The packed instantiations read the node-interleaved layout
+// of lut_layout.h.
+//
+// The tetrahedron is found with a compare-swap network of vector compares
+// and blends that sorts the deltas exactly like the comparisons of
+// tetrahedral_cell (lut_interp.h), ties included, so the results are
+// bit-identical to the scalar path (a 0 ULP bound, given the
+// -ffp-contract=off build).
+typedef int (*TetrahedralRowKernel)(const float *lut, const float *image, float *output,
+                                    const int64_t plane, const int width, const int dim, const int shift);
+
+// Cells of a planar row for the fan-out forward (lut_fanout.h): the node index
+// and weight of corner k of pixel w go to id[k * stride + w] and
+// weight[k * stride + w], in the corner order of tetrahedral_cell.
+typedef int (*TetrahedralCellKernel)(const float *image, const int64_t plane, const int width, const int dim,
+                                     int *id, float *weight, const int stride);
+
+#if LUT_HAVE_X86_SIMD
+
+LUT_TARGET_AVX2 static inline void TetrahedralSwapAvx2(__m256 &x, __m256 &y, __m256i &sx, __m256i &sy, const __m256 swap)
+{
+    const __m256i swap_i = _mm256_castps_si256(swap);
+    const __m256 t = _mm256_blendv_ps(x, y, swap);
+    const __m256i st = _mm256_blendv_epi8(sx, sy, swap_i);
+    y = _mm256_blendv_ps(y, x, swap);
+    sy = _mm256_blendv_epi8(sy, sx, swap_i);
+    x = t;
+    sx = st;
+}
+
+template <bool packed>
+LUT_TARGET_AVX2 static int TetrahedralForwardRowAvx2(const float *lut, const float *image, float *output,
+                                                     const int64_t plane, const int width, const int dim, const int shift)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 scale = _mm256_set1_ps((float)(dim - 1));
+    const __m256i low = _mm256_setzero_si256();
+    const __m256i high = _mm256_set1_epi32(dim - 1);
+    const __m256i step = _mm256_set1_epi32(1);
+    const __m256i dim1 = _mm256_set1_epi32(dim);
+    const __m256i dim2 = _mm256_set1_epi32(dim * dim);
+
+    int w = 0;
+    for (; w + 8 <= width; w += 8)
+    {
+        __m256 r_loc = _mm256_mul_ps(_mm256_loadu_ps(image + w), scale);
+        __m256 g_loc = _mm256_mul_ps(_mm256_loadu_ps(image + plane + w), scale);
+        __m256 b_loc = _mm256_mul_ps(_mm256_loadu_ps(image + plane * 2 + w), scale);
+
+        __m256i r_0 = _mm256_cvttps_epi32(_mm256_floor_ps(r_loc));
+        __m256i g_0 = _mm256_cvttps_epi32(_mm256_floor_ps(g_loc));
+        __m256i b_0 = _mm256_cvttps_epi32(_mm256_floor_ps(b_loc));
+        __m256i r_1 = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(r_0, step), low), high);
+        __m256i g_1 = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(g_0, step), low), high);
+        __m256i b_1 = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(b_0, step), low), high);
+        r_0 = _mm256_min_epi32(_mm256_max_epi32(r_0, low), high);
+        g_0 = _mm256_min_epi32(_mm256_max_epi32(g_0, low), high);
+        b_0 = _mm256_min_epi32(_mm256_max_epi32(b_0, low), high);
+
+        __m256 r_d = _mm256_sub_ps(r_loc, _mm256_cvtepi32_ps(r_0));
+        __m256 g_d = _mm256_sub_ps(g_loc, _mm256_cvtepi32_ps(g_0));
+        __m256 b_d = _mm256_sub_ps(b_loc, _mm256_cvtepi32_ps(b_0));
+
+        __m256i id000 = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(r_0, dim2), _mm256_mullo_epi32(g_0, dim1)), b_0);
+        __m256i id111 = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(r_1, dim2), _mm256_mullo_epi32(g_1, dim1)), b_1);
+        __m256i r_s = _mm256_mullo_epi32(_mm256_sub_epi32(r_1, r_0), dim2);
+        __m256i g_s = _mm256_mullo_epi32(_mm256_sub_epi32(g_1, g_0), dim1);
+        __m256i b_s = _mm256_sub_epi32(b_1, b_0);
+
+        // sort (d0, d1, d2) = (r_d, g_d, b_d) in descending order
+        __m256 r_gt_g = _mm256_cmp_ps(r_d, g_d, _CMP_GT_OQ);
+        __m256 d0 = r_d, d1 = g_d, d2 = b_d;
+        __m256i s0 = r_s, s1 = g_s, s2 = b_s;
+        TetrahedralSwapAvx2(d0, d1, s0, s1, _mm256_cmp_ps(d0, d1, _CMP_NGT_UQ));
+        TetrahedralSwapAvx2(d1, d2, s1, s2, _mm256_blendv_ps(_mm256_cmp_ps(d2, d1, _CMP_GT_OQ), _mm256_cmp_ps(d1, d2, _CMP_NGT_UQ), r_gt_g));
+        TetrahedralSwapAvx2(d0, d1, s0, s1, _mm256_blendv_ps(_mm256_cmp_ps(d1, d0, _CMP_GT_OQ), _mm256_cmp_ps(d0, d1, _CMP_NGT_UQ), r_gt_g));
+
+        __m256 w0 = _mm256_sub_ps(one, d0);
+        __m256 w1 = _mm256_sub_ps(d0, d1);
+        __m256 w2 = _mm256_sub_ps(d1, d2);
+        __m256 w3 = d2;
+        __m256i id1 = _mm256_add_epi32(id000, s0);
+        __m256i id2 = _mm256_add_epi32(id1, s1);
+
+        if (packed)
+        {
+            id000 = _mm256_slli_epi32(id000, 2);
+            id1 = _mm256_slli_epi32(id1, 2);
+            id2 = _mm256_slli_epi32(id2, 2);
+            id111 = _mm256_slli_epi32(id111, 2);
+        }
+
+        for (int c = 0; c < 3; ++c)
+        {
+            const float *table = packed ? lut + c : lut + shift * c;
+            __m256 v = _mm256_mul_ps(w0, _mm256_i32gather_ps(table, id000, 4));
+            v = _mm256_add_ps(v, _mm256_mul_ps(w1, _mm256_i32gather_ps(table, id1, 4)));
+            v = _mm256_add_ps(v, _mm256_mul_ps(w2, _mm256_i32gather_ps(table, id2, 4)));
+            v = _mm256_add_ps(v, _mm256_mul_ps(w3, _mm256_i32gather_ps(table, id111, 4)));
+            _mm256_storeu_ps(output + plane * c + w, v);
+        }
+    }
+    return w;
+}
+
+LUT_TARGET_AVX2 static int TetrahedralCellsAvx2(const float *image, const int64_t plane, const int width, const int dim,
+                                                int *id, float *weight, const int stride)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 scale = _mm256_set1_ps((float)(dim - 1));
+    const __m256i low = _mm256_setzero_si256();
+    const __m256i high = _mm256_set1_epi32(dim - 1);
+    const __m256i step = _mm256_set1_epi32(1);
+    const __m256i dim1 = _mm256_set1_epi32(dim);
+    const __m256i dim2 = _mm256_set1_epi32(dim * dim);
+
+    int w = 0;
+    for (; w + 8 <= width; w += 8)
+    {
+        __m256 r_loc = _mm256_mul_ps(_mm256_loadu_ps(image + w), scale);
+        __m256 g_loc = _mm256_mul_ps(_mm256_loadu_ps(image + plane + w), scale);
+        __m256 b_loc = _mm256_mul_ps(_mm256_loadu_ps(image + plane * 2 + w), scale);
+
+        __m256i r_0 = _mm256_cvttps_epi32(_mm256_floor_ps(r_loc));
+        __m256i g_0 = _mm256_cvttps_epi32(_mm256_floor_ps(g_loc));
+        __m256i b_0 = _mm256_cvttps_epi32(_mm256_floor_ps(b_loc));
+        __m256i r_1 = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(r_0, step), low), high);
+        __m256i g_1 = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(g_0, step), low), high);
+        __m256i b_1 = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(b_0, step), low), high);
+        r_0 = _mm256_min_epi32(_mm256_max_epi32(r_0, low), high);
+        g_0 = _mm256_min_epi32(_mm256_max_epi32(g_0, low), high);
+        b_0 = _mm256_min_epi32(_mm256_max_epi32(b_0, low), high);
+
+        __m256 r_d = _mm256_sub_ps(r_loc, _mm256_cvtepi32_ps(r_0));
+        __m256 g_d = _mm256_sub_ps(g_loc, _mm256_cvtepi32_ps(g_0));
+        __m256 b_d = _mm256_sub_ps(b_loc, _mm256_cvtepi32_ps(b_0));
+
+        __m256i id000 = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(r_0, dim2), _mm256_mullo_epi32(g_0, dim1)), b_0);
+        __m256i id111 = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(r_1, dim2), _mm256_mullo_epi32(g_1, dim1)), b_1);
+        __m256i r_s = _mm256_mullo_epi32(_mm256_sub_epi32(r_1, r_0), dim2);
+        __m256i g_s = _mm256_mullo_epi32(_mm256_sub_epi32(g_1, g_0), dim1);
+        __m256i b_s = _mm256_sub_epi32(b_1, b_0);
+
+        // sort (d0, d1, d2) = (r_d, g_d, b_d) in descending order
+        __m256 r_gt_g = _mm256_cmp_ps(r_d, g_d, _CMP_GT_OQ);
+        __m256 d0 = r_d, d1 = g_d, d2 = b_d;
+        __m256i s0 = r_s, s1 = g_s, s2 = b_s;
+        TetrahedralSwapAvx2(d0, d1, s0, s1, _mm256_cmp_ps(d0, d1, _CMP_NGT_UQ));
+        TetrahedralSwapAvx2(d1, d2, s1, s2, _mm256_blendv_ps(_mm256_cmp_ps(d2, d1, _CMP_GT_OQ), _mm256_cmp_ps(d1, d2, _CMP_NGT_UQ), r_gt_g));
+        TetrahedralSwapAvx2(d0, d1, s0, s1, _mm256_blendv_ps(_mm256_cmp_ps(d1, d0, _CMP_GT_OQ), _mm256_cmp_ps(d0, d1, _CMP_NGT_UQ), r_gt_g));
+
+        __m256i id1 = _mm256_add_epi32(id000, s0);
+        _mm256_storeu_ps(weight + w, _mm256_sub_ps(one, d0));
+        _mm256_storeu_ps(weight + stride + w, _mm256_sub_ps(d0, d1));
+        _mm256_storeu_ps(weight + stride * 2 + w, _mm256_sub_ps(d1, d2));
+        _mm256_storeu_ps(weight + stride * 3 + w, d2);
+        _mm256_storeu_si256((__m256i *)(id + w), id000);
+        _mm256_storeu_si256((__m256i *)(id + stride + w), id1);
+        _mm256_storeu_si256((__m256i *)(id + stride * 2 + w), _mm256_add_epi32(id1, s1));
+        _mm256_storeu_si256((__m256i *)(id + stride * 3 + w), id111);
+    }
+    return w;
+}
+
+LUT_TARGET_AVX512 static inline void TetrahedralSwapAvx512(__m512 &x, __m512 &y, __m512i &sx, __m512i &sy, const __mmask16 swap)
+{
+    const __m512 t = _mm512_mask_blend_ps(swap, x, y);
+    const __m512i st = _mm512_mask_blend_epi32(swap, sx, sy);
+    y = _mm512_mask_blend_ps(swap, y, x);
+    sy = _mm512_mask_blend_epi32(swap, sy, sx);
+    x = t;
+    sx = st;
+}
+
+template <bool packed>
+LUT_TARGET_AVX512 static int TetrahedralForwardRowAvx512(const float *lut, const float *image, float *output,
+                                                         const int64_t plane, const int width, const int dim, const int shift)
+{
+    const __m512 one = _mm512_set1_ps(1.0f);
+    const __m512 scale = _mm512_set1_ps((float)(dim - 1));
+    const __m512i low = _mm512_setzero_si512();
+    const __m512i high = _mm512_set1_epi32(dim - 1);
+    const __m512i step = _mm512_set1_epi32(1);
+    const __m512i dim1 = _mm512_set1_epi32(dim);
+    const __m512i dim2 = _mm512_set1_epi32(dim * dim);
+    const int floor_mode = _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC;
+
+    int w = 0;
+    for (; w + 16 <= width; w += 16)
+    {
+        __m512 r_loc = _mm512_mul_ps(_mm512_loadu_ps(image + w), scale);
+        __m512 g_loc = _mm512_mul_ps(_mm512_loadu_ps(image + plane + w), scale);
+        __m512 b_loc = _mm512_mul_ps(_mm512_loadu_ps(image + plane * 2 + w), scale);
+
+        __m512i r_0 = _mm512_cvttps_epi32(_mm512_roundscale_ps(r_loc, floor_mode));
+        __m512i g_0 = _mm512_cvttps_epi32(_mm512_roundscale_ps(g_loc, floor_mode));
+        __m512i b_0 = _mm512_cvttps_epi32(_mm512_roundscale_ps(b_loc, floor_mode));
+        __m512i r_1 = _mm512_min_epi32(_mm512_max_epi32(_mm512_add_epi32(r_0, step), low), high);
+        __m512i g_1 = _mm512_min_epi32(_mm512_max_epi32(_mm512_add_epi32(g_0, step), low), high);
+        __m512i b_1 = _mm512_min_epi32(_mm512_max_epi32(_mm512_add_epi32(b_0, step), low), high);
+        r_0 = _mm512_min_epi32(_mm512_max_epi32(r_0, low), high);
+        g_0 = _mm512_min_epi32(_mm512_max_epi32(g_0, low), high);
+        b_0 = _mm512_min_epi32(_mm512_max_epi32(b_0, low), high);
+
+        __m512 r_d = _mm512_sub_ps(r_loc, _mm512_cvtepi32_ps(r_0));
+        __m512 g_d = _mm512_sub_ps(g_loc, _mm512_cvtepi32_ps(g_0));
+        __m512 b_d = _mm512_sub_ps(b_loc, _mm512_cvtepi32_ps(b_0));
+
+        __m512i id000 = _mm512_add_epi32(_mm512_add_epi32(_mm512_mullo_epi32(r_0, dim2), _mm512_mullo_epi32(g_0, dim1)), b_0);
+        __m512i id111 = _mm512_add_epi32(_mm512_add_epi32(_mm512_mullo_epi32(r_1, dim2), _mm512_mullo_epi32(g_1, dim1)), b_1);
+        __m512i r_s = _mm512_mullo_epi32(_mm512_sub_epi32(r_1, r_0), dim2);
+        __m512i g_s = _mm512_mullo_epi32(_mm512_sub_epi32(g_1, g_0), dim1);
+        __m512i b_s = _mm512_sub_epi32(b_1, b_0);
+
+        // sort (d0, d1, d2) = (r_d, g_d, b_d) in descending order
+        const __mmask16 r_gt_g = _mm512_cmp_ps_mask(r_d, g_d, _CMP_GT_OQ);
+        __m512 d0 = r_d, d1 = g_d, d2 = b_d;
+        __m512i s0 = r_s, s1 = g_s, s2 = b_s;
+        TetrahedralSwapAvx512(d0, d1, s0, s1, _mm512_cmp_ps_mask(d0, d1, _CMP_NGT_UQ));
+        TetrahedralSwapAvx512(d1, d2, s1, s2, (r_gt_g & _mm512_cmp_ps_mask(d1, d2, _CMP_NGT_UQ)) | (~r_gt_g & _mm512_cmp_ps_mask(d2, d1, _CMP_GT_OQ)));
+        TetrahedralSwapAvx512(d0, d1, s0, s1, (r_gt_g & _mm512_cmp_ps_mask(d0, d1, _CMP_NGT_UQ)) | (~r_gt_g & _mm512_cmp_ps_mask(d1, d0, _CMP_GT_OQ)));
+
+        __m512 w0 = _mm512_sub_ps(one, d0);
+        __m512 w1 = _mm512_sub_ps(d0, d1);
+        __m512 w2 = _mm512_sub_ps(d1, d2);
+        __m512 w3 = d2;
+        __m512i id1 = _mm512_add_epi32(id000, s0);
+        __m512i id2 = _mm512_add_epi32(id1, s1);
+
+        if (packed)
+        {
+            id000 = _mm512_slli_epi32(id000, 2);
+            id1 = _mm512_slli_epi32(id1, 2);
+            id2 = _mm512_slli_epi32(id2, 2);
+            id111 = _mm512_slli_epi32(id111, 2);
+        }
+
+        for (int c = 0; c < 3; ++c)
+        {
+            const float *table = packed ? lut + c : lut + shift * c;
+            __m512 v = _mm512_mul_ps(w0, _mm512_i32gather_ps(id000, table, 4));
+            v = _mm512_add_ps(v, _mm512_mul_ps(w1, _mm512_i32gather_ps(id1, table, 4)));
+            v = _mm512_add_ps(v, _mm512_mul_ps(w2, _mm512_i32gather_ps(id2, table, 4)));
+            v = _mm512_add_ps(v, _mm512_mul_ps(w3, _mm512_i32gather_ps(id111, table, 4)));
+            _mm512_storeu_ps(output + plane * c + w, v);
+        }
+    }
+    return w;
+}
+
+#endif
+
+// Picks the widest row kernel the CPU supports, or nullptr for the scalar path.
+// With packed set the kernel reads a node-interleaved LUT (lut_layout.h).
+inline TetrahedralRowKernel TetrahedralSelectRowKernel(const bool packed)
+{
+#if LUT_HAVE_X86_SIMD
+    switch (lut_detect_isa())
+    {
+    case LUT_ISA_AVX512:
+        return packed ? TetrahedralForwardRowAvx512<true> : TetrahedralForwardRowAvx512<false>;
+    case LUT_ISA_AVX2:
+        return packed ? TetrahedralForwardRowAvx2<true> : TetrahedralForwardRowAvx2<false>;
+    default:
+        break;
+    }
+#endif
+    return nullptr;
+}
+
+// AVX2 cell kernel when the CPU supports it (the cells are stored, so wider
+// vectors gain little), or nullptr for the scalar path.
+inline TetrahedralCellKernel TetrahedralSelectCellKernel()
+{
+#if LUT_HAVE_X86_SIMD
+    if (lut_detect_isa() >= LUT_ISA_AVX2)
+        return TetrahedralCellsAvx2;
+#endif
+    return nullptr;
+}
+
+#endif
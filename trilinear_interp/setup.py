@@ -1,7 +1,53 @@
+import os
+import shutil
+import subprocess
+import tempfile
 from setuptools import setup
+from distutils.ccompiler import new_compiler
+from distutils.errors import CompileError, LinkError
 import torch
 from torch.utils.cpp_extension import BuildExtension, CUDAExtension, CppExtension
 
+# Headers shared by the trilinear and tetrahedral extensions. The CUDA builds
+# use them for the host-side operators of lut_host.h.
+common_dir = os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'common')
+
+
+def find_libpng():
+    """Include dirs, library dirs and libraries for libpng, or None.
+
+    pkg-config supplies the flags when it knows libpng. Either way libpng only
+    counts as found when a program that includes png.h compiles and links, so
+    a runtime library without its development headers is not enough.
+    """
+    flags = {'include_dirs': [], 'library_dirs': [], 'libraries': ['png']}
+    if shutil.which('pkg-config'):
+        try:
+            cflags = subprocess.check_output(['pkg-config', '--cflags-only-I', 'libpng'], text=True).split()
+            libs = subprocess.check_output(['pkg-config', '--libs', 'libpng'], text=True).split()
+            flags = {'include_dirs': [f[2:] for f in cflags],
+                     'library_dirs': [f[2:] for f in libs if f.startswith('-L')],
+                     'libraries': [f[2:] for f in libs if f.startswith('-l')]}
+        except subprocess.CalledProcessError:
+            pass
+
+    compiler = new_compiler()
+    with tempfile.TemporaryDirectory() as tmp:
+        source = os.path.join(tmp, 'png_check.c')
+        with open(source, 'w') as f:
+            f.write('#include <png.h>\nint main(void) { return png_access_version_number() == 0; }\n')
+        try:
+            objects = compiler.compile([source], output_dir=tmp, include_dirs=flags['include_dirs'])
+            compiler.link_executable(objects, os.path.join(tmp, 'png_check'),
+                                     library_dirs=flags['library_dirs'], libraries=flags['libraries'])
+        except (CompileError, LinkError):
+            return None
+    return flags
+
+
+# batch_forward reads and writes PNG files through libpng when it is installed.
+png = find_libpng()
+
 if torch.cuda.is_available():
     print('Including CUDA code.')
     setup(
@@ -10,7 +56,9 @@ if torch.cuda.is_available():
             CUDAExtension('trilinear', [
                 'src/trilinear_cuda.cpp',
                 'src/trilinear_kernel.cu',
-            ])
+            ], include_dirs=[common_dir],
+               extra_compile_args={'cxx': ['-O3', '-fopenmp', '-ffp-contract=off']},
+               extra_link_args=['-fopenmp'])
         ],
         cmdclass={
             'build_ext': BuildExtension
@@ -18,5 +66,11 @@ if torch.cuda.is_available():
 else:
     print('NO CUDA is found. Fall back to CPU.')
     setup(name='trilinear',
-        ext_modules=[CppExtension('trilinear', ['src/trilinear.cpp'])],
+        ext_modules=[CppExtension('trilinear', ['src/trilinear.cpp'],
+                                include_dirs=[common_dir] + (png['include_dirs'] if png else []),
+                                define_macros=[('LUT_WITH_PNG', None)] if png else [],
+                                library_dirs=png['library_dirs'] if png else [],
+                                libraries=png['libraries'] if png else [],
+                                extra_compile_args=['-O3', '-fopenmp', '-ffp-contract=off'],
+                                extra_link_args=['-fopenmp'])],
         cmdclass={'build_ext': BuildExtension})
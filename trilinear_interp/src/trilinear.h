@@ -2,6 +2,26 @@
 #define TRILINEAR_H
 
 #include <torch/extension.h>
+#include "lut_bank.h"
+#include "lut_batch.h"
+#include "lut_blend.h"
+#include "lut_chain.h"
+#include "lut_cube.h"
+#include "lut_fanout.h"
+#include "lut_host.h"
+#include "lut_image.h"
+#include "lut_interp.h"
+#include "lut_layout.h"
+#include "lut_loss.h"
+#include "lut_mask.h"
+#include "lut_op.h"
+#include "lut_parallel.h"
+#include "lut_separable.h"
+#include "lut_shaper.h"
+#include "lut_shard.h"
+#include "lut_sparse.h"
+#include "lut_stream.h"
+#include "lut_table.h"
 
 #define CLIP(x, low, high) (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
 #define INDEX(a, b, c, d, d1, d2, d3) ((a) * (d1) * (d2) * (d3) + (b) * (d2) * (d3) + (c) * (d3) + (d))
@@ -12,10 +32,110 @@ int trilinear_forward(torch::Tensor lut, torch::Tensor image, torch::Tensor outp
 int trilinear_backward(torch::Tensor image, torch::Tensor image_grad, torch::Tensor lut_grad,
                        int lut_dim, int shift, float binsize, int width, int height, int batch);
 
+int trilinear_backward_input(torch::Tensor lut, torch::Tensor image, torch::Tensor image_grad, torch::Tensor lut_grad, torch::Tensor input_grad,
+                             int lut_dim, int shift, float binsize, int width, int height, int batch);
+
+int trilinear_pack_lut(torch::Tensor lut, torch::Tensor packed, int lut_dim);
+
+int trilinear_forward_packed(torch::Tensor packed, torch::Tensor image, torch::Tensor output,
+                             int lut_dim, int width, int height, int batch);
+
+int trilinear_shaper_forward(torch::Tensor shaper, torch::Tensor lut, torch::Tensor image, torch::Tensor output,
+                             int shaper_dim, int lut_dim, int shift, float binsize, int width, int height, int batch);
+
+int trilinear_shaper_backward(torch::Tensor shaper, torch::Tensor lut, torch::Tensor image, torch::Tensor image_grad,
+                              torch::Tensor shaper_grad, torch::Tensor lut_grad,
+                              int shaper_dim, int lut_dim, int shift, float binsize, int width, int height, int batch);
+
+int trilinear_chain_forward(std::vector<torch::Tensor> stages, torch::Tensor image, torch::Tensor output,
+                            int width, int height, int batch);
+
+int trilinear_bake(std::vector<torch::Tensor> stages, torch::Tensor baked, int baked_dim);
+
+int trilinear_bake_table(torch::Tensor lut, torch::Tensor table, int lut_dim, int shift);
+
+int trilinear_forward_table(torch::Tensor table, torch::Tensor image, torch::Tensor output,
+                            int width, int height, int batch);
+
+int trilinear_blend_forward(torch::Tensor basis, torch::Tensor weights, torch::Tensor image, torch::Tensor output,
+                            int lut_dim, int shift, float binsize, int width, int height, int batch);
+
+int trilinear_blend_backward(torch::Tensor basis, torch::Tensor weights, torch::Tensor image, torch::Tensor image_grad,
+                             torch::Tensor basis_grad, torch::Tensor weights_grad, c10::optional<torch::Tensor> input_grad,
+                             int lut_dim, int shift, float binsize, int width, int height, int batch);
+
+int trilinear_bank_forward(torch::Tensor arena, torch::Tensor index, torch::Tensor ids, torch::Tensor image, torch::Tensor output,
+                           int width, int height, int batch);
+
+int trilinear_fanout_forward(torch::Tensor luts, torch::Tensor image, torch::Tensor output,
+                             int lut_dim, int width, int height, int batch);
+
+int trilinear_mask_forward(torch::Tensor luts, torch::Tensor mask, torch::Tensor image, torch::Tensor output,
+                           int lut_dim, int width, int height, int batch);
+
+int trilinear_mask_backward(torch::Tensor luts, torch::Tensor mask, torch::Tensor image, torch::Tensor image_grad,
+                            torch::Tensor luts_grad, c10::optional<torch::Tensor> mask_grad, c10::optional<torch::Tensor> input_grad,
+                            int lut_dim, int width, int height, int batch);
+
+int trilinear_stream_forward(torch::Tensor lut, const std::string &input_path, const std::string &output_path,
+                             int lut_dim, int shift, float binsize, int raw_width, int raw_height,
+                             const std::string &raw_type, int64_t budget);
+
+std::map<std::string, std::map<std::string, double>> trilinear_batch_forward(torch::Tensor lut, const std::vector<std::string> &inputs, const std::string &output_dir,
+                                                                             int lut_dim, int shift, float binsize, int workers, int depth);
+
+double trilinear_loss_backward(torch::Tensor lut, torch::Tensor image, torch::Tensor target, torch::Tensor lut_grad,
+                               int norm, int lut_dim, int shift, float binsize, int width, int height, int batch);
+
+std::tuple<torch::Tensor, torch::Tensor> trilinear_backward_sparse(torch::Tensor lut, torch::Tensor image, torch::Tensor image_grad, c10::optional<torch::Tensor> input_grad,
+                                                                   int lut_dim, int shift, float binsize, int width, int height, int batch);
+
+std::tuple<double, torch::Tensor, torch::Tensor> trilinear_loss_backward_sparse(torch::Tensor lut, torch::Tensor image, torch::Tensor target,
+                                                                                int norm, int lut_dim, int shift, float binsize, int width, int height, int batch);
+
+std::tuple<torch::Tensor, torch::Tensor> trilinear_sparse_grad(torch::Tensor lut_grad, int lut_dim);
+
+int trilinear_sparse_adam(torch::Tensor param, torch::Tensor exp_avg, torch::Tensor exp_avg_sq, c10::optional<torch::Tensor> indices, torch::Tensor values,
+                          int64_t step, double lr, double beta1, double beta2, double eps);
+
+int trilinear_sparse_sgd(torch::Tensor param, c10::optional<torch::Tensor> indices, torch::Tensor values, double lr);
+
+int trilinear_classify(torch::Tensor lut, torch::Tensor curves, int lut_dim, double tol);
+
+int trilinear_forward_separable(torch::Tensor curves, torch::Tensor image, torch::Tensor output,
+                                int lut_dim, int width, int height, int batch);
+
+template <typename scalar_t, typename pixel_t>
+void TriLinearForwardCpu(const scalar_t *lut, const pixel_t *image, pixel_t *output, const LutImageLayout &image_layout, const LutImageLayout &output_layout, const int dim, const int shift, const float binsize, const int width, const int height, const int batch);
+
 template <typename scalar_t>
-void TriLinearForwardCpu(const scalar_t *lut, const scalar_t *image, scalar_t *output, const int dim, const int shift, const float binsize, const int width, const int height, const int channels, const int batch);
+void TriLinearBackwardCpu(const scalar_t *image, const scalar_t *image_grad, const scalar_t *lut, scalar_t *lut_grad, LutSparseGrad<scalar_t> *sparse_grad, scalar_t *input_grad, const LutImageLayout &image_layout, const LutImageLayout &grad_layout, const LutImageLayout &input_grad_layout, const int dim, const int shift, const float binsize, const int width, const int height, const int batch);
+
+template <typename scalar_t>
+double TriLinearLossBackwardCpu(const scalar_t *lut, const scalar_t *image, const scalar_t *target, scalar_t *lut_grad, LutSparseGrad<scalar_t> *sparse_grad, const LutImageLayout &image_layout, const LutImageLayout &target_layout, const int norm, const int dim, const int shift, const int width, const int height, const int batch);
+
+template <typename scalar_t, typename pixel_t>
+void TriLinearForwardPackedCpu(const scalar_t *packed, const pixel_t *image, pixel_t *output, const LutImageLayout &image_layout, const LutImageLayout &output_layout, const int dim, const int width, const int height, const int batch);
+
+template <typename scalar_t>
+void TriLinearShaperForwardCpu(const scalar_t *shaper, const int shaper_dim, const int shaper_stride, const scalar_t *lut, const scalar_t *image, scalar_t *output, const LutImageLayout &image_layout, const LutImageLayout &output_layout, const int dim, const int shift, const int width, const int height, const int batch);
+
+template <typename scalar_t>
+void TriLinearShaperBackwardCpu(const scalar_t *shaper, const int shaper_dim, const int shaper_stride, const scalar_t *lut, const scalar_t *image, const scalar_t *image_grad, scalar_t *grad, const LutImageLayout &image_layout, const LutImageLayout &grad_layout, const int dim, const int shift, const int width, const int height, const int batch);
+
+template <typename scalar_t>
+void TriLinearBakeTableCpu(const scalar_t *lut, uint32_t *table, const int dim, const int shift);
+
+template <typename scalar_t, typename pixel_t>
+void TriLinearBankForwardCpu(const scalar_t *arena, const LutBankLut *luts, const pixel_t *image, pixel_t *output, const LutImageLayout &image_layout, const LutImageLayout &output_layout, const int width, const int height, const int batch);
+
+template <typename scalar_t, typename pixel_t>
+void TriLinearFanoutForwardCpu(const scalar_t *luts, const int count, const pixel_t *image, pixel_t *output, const LutImageLayout &image_layout, const LutImageLayout &output_layout, const int64_t output_stride, const int dim, const int width, const int height, const int batch);
+
+template <typename scalar_t, typename pixel_t>
+void TriLinearMaskForwardCpu(const scalar_t *luts, const int count, const scalar_t *mask, const int mask_channels, const pixel_t *image, pixel_t *output, const LutImageLayout &mask_layout, const LutImageLayout &image_layout, const LutImageLayout &output_layout, const int dim, const int width, const int height, const int batch);
 
 template <typename scalar_t>
-void TriLinearBackwardCpu(const scalar_t *image, const scalar_t *image_grad, scalar_t *lut_grad, const int dim, const int shift, const float binsize, const int width, const int height, const int channels, const int batch);
+void TriLinearMaskBackwardCpu(const scalar_t *luts, const int count, const scalar_t *mask, const int mask_channels, const scalar_t *image, const scalar_t *image_grad, scalar_t *luts_grad, scalar_t *mask_grad, scalar_t *input_grad, const LutImageLayout &mask_layout, const LutImageLayout &image_layout, const LutImageLayout &grad_layout, const LutImageLayout &mask_grad_layout, const LutImageLayout &input_grad_layout, const int dim, const int width, const int height, const int batch);
 
 #endif
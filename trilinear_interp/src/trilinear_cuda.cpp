@@ -1,4 +1,5 @@
 #include "trilinear_kernel.h"
+#include "lut_host.h"
 #include <c10/cuda/CUDAGuard.h>
 
 #define CHECK_CUDA(x) TORCH_CHECK(x.device().is_cuda(), #x " must be a CUDA tensor")
@@ -74,4 +75,5 @@ PYBIND11_MODULE(TORCH_EXTENSION_NAME, m)
 {
     m.def("forward", &trilinear_forward_cuda, "Trilinear forward");
     m.def("backward", &trilinear_backward_cuda, "Trilinear backward");
+    lut_def_host_ops(m);
 }
@@ -0,0 +1,306 @@
+#ifndef TRILINEAR_SIMD_H
+#define TRILINEAR_SIMD_H
+
+#include "lut_cpu.h"
+
+// Vector versions of the float TriLinearForwardCpu inner loop, 8 (AVX2) or 16
+// (AVX-512) pixels per iteration. A row kernel interpolates the longest prefix
+// of one planar image row that fills whole vectors and returns its length; the
+// caller finishes the row with the scalar code. image and output point at the
+// R value of the first pixel, the G and B planes follow `plane` elements apart.
+// The packed instantiations read the node-interleaved layout of lut_layout.h.
+//
+// Every arithmetic operation happens in the same order as in the scalar
+// template, and the extension is built with -ffp-contract=off, so the vector
+// results are bit-identical to the scalar path (a 0 ULP bound).
+typedef int (*TriLinearRowKernel)(const float *lut, const float *image, float *output,
+                                  const int64_t plane, const int width, const int dim, const int shift);
+
+// Cells of a planar row for the fan-out forward (lut_fanout.h): the node index
+// and weight of corner k of pixel w go to id[k * stride + w] and
+// weight[k * stride + w], in the corner order of trilinear_cell.
+typedef int (*TriLinearCellKernel)(const float *image, const int64_t plane, const int width, const int dim,
+                                   int *id, float *weight, const int stride);
+
+#if LUT_HAVE_X86_SIMD
+
+template <bool packed>
+LUT_TARGET_AVX2 static int TriLinearForwardRowAvx2(const float *lut, const float *image, float *output,
+                                                   const int64_t plane, const int width, const int dim, const int shift)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 scale = _mm256_set1_ps((float)(dim - 1));
+    const __m256i low = _mm256_setzero_si256();
+    const __m256i high = _mm256_set1_epi32(dim - 1);
+    const __m256i step = _mm256_set1_epi32(1);
+    const __m256i dim1 = _mm256_set1_epi32(dim);
+    const __m256i dim2 = _mm256_set1_epi32(dim * dim);
+
+    int w = 0;
+    for (; w + 8 <= width; w += 8)
+    {
+        __m256 r_loc = _mm256_mul_ps(_mm256_loadu_ps(image + w), scale);
+        __m256 g_loc = _mm256_mul_ps(_mm256_loadu_ps(image + plane + w), scale);
+        __m256 b_loc = _mm256_mul_ps(_mm256_loadu_ps(image + plane * 2 + w), scale);
+
+        __m256i r_0 = _mm256_cvttps_epi32(_mm256_floor_ps(r_loc));
+        __m256i g_0 = _mm256_cvttps_epi32(_mm256_floor_ps(g_loc));
+        __m256i b_0 = _mm256_cvttps_epi32(_mm256_floor_ps(b_loc));
+        __m256i r_1 = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(r_0, step), low), high);
+        __m256i g_1 = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(g_0, step), low), high);
+        __m256i b_1 = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(b_0, step), low), high);
+        r_0 = _mm256_min_epi32(_mm256_max_epi32(r_0, low), high);
+        g_0 = _mm256_min_epi32(_mm256_max_epi32(g_0, low), high);
+        b_0 = _mm256_min_epi32(_mm256_max_epi32(b_0, low), high);
+
+        __m256 r_d = _mm256_sub_ps(r_loc, _mm256_cvtepi32_ps(r_0));
+        __m256 g_d = _mm256_sub_ps(g_loc, _mm256_cvtepi32_ps(g_0));
+        __m256 b_d = _mm256_sub_ps(b_loc, _mm256_cvtepi32_ps(b_0));
+        __m256 r_m = _mm256_sub_ps(one, r_d);
+        __m256 g_m = _mm256_sub_ps(one, g_d);
+        __m256 b_m = _mm256_sub_ps(one, b_d);
+
+        __m256 w00 = _mm256_mul_ps(r_m, g_m);
+        __m256 w10 = _mm256_mul_ps(r_d, g_m);
+        __m256 w01 = _mm256_mul_ps(r_m, g_d);
+        __m256 w11 = _mm256_mul_ps(r_d, g_d);
+        __m256 w000 = _mm256_mul_ps(w00, b_m);
+        __m256 w100 = _mm256_mul_ps(w10, b_m);
+        __m256 w010 = _mm256_mul_ps(w01, b_m);
+        __m256 w110 = _mm256_mul_ps(w11, b_m);
+        __m256 w001 = _mm256_mul_ps(w00, b_d);
+        __m256 w101 = _mm256_mul_ps(w10, b_d);
+        __m256 w011 = _mm256_mul_ps(w01, b_d);
+        __m256 w111 = _mm256_mul_ps(w11, b_d);
+
+        __m256i rr_0 = _mm256_mullo_epi32(r_0, dim2);
+        __m256i rr_1 = _mm256_mullo_epi32(r_1, dim2);
+        __m256i gg_0 = _mm256_mullo_epi32(g_0, dim1);
+        __m256i gg_1 = _mm256_mullo_epi32(g_1, dim1);
+        __m256i id000 = _mm256_add_epi32(_mm256_add_epi32(rr_0, gg_0), b_0);
+        __m256i id100 = _mm256_add_epi32(_mm256_add_epi32(rr_1, gg_0), b_0);
+        __m256i id010 = _mm256_add_epi32(_mm256_add_epi32(rr_0, gg_1), b_0);
+        __m256i id110 = _mm256_add_epi32(_mm256_add_epi32(rr_1, gg_1), b_0);
+        __m256i id001 = _mm256_add_epi32(_mm256_add_epi32(rr_0, gg_0), b_1);
+        __m256i id101 = _mm256_add_epi32(_mm256_add_epi32(rr_1, gg_0), b_1);
+        __m256i id011 = _mm256_add_epi32(_mm256_add_epi32(rr_0, gg_1), b_1);
+        __m256i id111 = _mm256_add_epi32(_mm256_add_epi32(rr_1, gg_1), b_1);
+
+        if (packed)
+        {
+            id000 = _mm256_slli_epi32(id000, 2);
+            id100 = _mm256_slli_epi32(id100, 2);
+            id010 = _mm256_slli_epi32(id010, 2);
+            id110 = _mm256_slli_epi32(id110, 2);
+            id001 = _mm256_slli_epi32(id001, 2);
+            id101 = _mm256_slli_epi32(id101, 2);
+            id011 = _mm256_slli_epi32(id011, 2);
+            id111 = _mm256_slli_epi32(id111, 2);
+        }
+
+        for (int c = 0; c < 3; ++c)
+        {
+            const float *table = packed ? lut + c : lut + shift * c;
+            __m256 v = _mm256_mul_ps(w000, _mm256_i32gather_ps(table, id000, 4));
+            v = _mm256_add_ps(v, _mm256_mul_ps(w100, _mm256_i32gather_ps(table, id100, 4)));
+            v = _mm256_add_ps(v, _mm256_mul_ps(w010, _mm256_i32gather_ps(table, id010, 4)));
+            v = _mm256_add_ps(v, _mm256_mul_ps(w110, _mm256_i32gather_ps(table, id110, 4)));
+            v = _mm256_add_ps(v, _mm256_mul_ps(w001, _mm256_i32gather_ps(table, id001, 4)));
+            v = _mm256_add_ps(v, _mm256_mul_ps(w101, _mm256_i32gather_ps(table, id101, 4)));
+            v = _mm256_add_ps(v, _mm256_mul_ps(w011, _mm256_i32gather_ps(table, id011, 4)));
+            v = _mm256_add_ps(v, _mm256_mul_ps(w111, _mm256_i32gather_ps(table, id111, 4)));
+            _mm256_storeu_ps(output + plane * c + w, v);
+        }
+    }
+    return w;
+}
+
+template <bool packed>
+LUT_TARGET_AVX512 static int TriLinearForwardRowAvx512(const float *lut, const float *image, float *output,
+                                                       const int64_t plane, const int width, const int dim, const int shift)
+{
+    const __m512 one = _mm512_set1_ps(1.0f);
+    const __m512 scale = _mm512_set1_ps((float)(dim - 1));
+    const __m512i low = _mm512_setzero_si512();
+    const __m512i high = _mm512_set1_epi32(dim - 1);
+    const __m512i step = _mm512_set1_epi32(1);
+    const __m512i dim1 = _mm512_set1_epi32(dim);
+    const __m512i dim2 = _mm512_set1_epi32(dim * dim);
+    const int floor_mode = _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC;
+
+    int w = 0;
+    for (; w + 16 <= width; w += 16)
+    {
+        __m512 r_loc = _mm512_mul_ps(_mm512_loadu_ps(image + w), scale);
+        __m512 g_loc = _mm512_mul_ps(_mm512_loadu_ps(image + plane + w), scale);
+        __m512 b_loc = _mm512_mul_ps(_mm512_loadu_ps(image + plane * 2 + w), scale);
+
+        __m512i r_0 = _mm512_cvttps_epi32(_mm512_roundscale_ps(r_loc, floor_mode));
+        __m512i g_0 = _mm512_cvttps_epi32(_mm512_roundscale_ps(g_loc, floor_mode));
+        __m512i b_0 = _mm512_cvttps_epi32(_mm512_roundscale_ps(b_loc, floor_mode));
+        __m512i r_1 = _mm512_min_epi32(_mm512_max_epi32(_mm512_add_epi32(r_0, step), low), high);
+        __m512i g_1 = _mm512_min_epi32(_mm512_max_epi32(_mm512_add_epi32(g_0, step), low), high);
+        __m512i b_1 = _mm512_min_epi32(_mm512_max_epi32(_mm512_add_epi32(b_0, step), low), high);
+        r_0 = _mm512_min_epi32(_mm512_max_epi32(r_0, low), high);
+        g_0 = _mm512_min_epi32(_mm512_max_epi32(g_0, low), high);
+        b_0 = _mm512_min_epi32(_mm512_max_epi32(b_0, low), high);
+
+        __m512 r_d = _mm512_sub_ps(r_loc, _mm512_cvtepi32_ps(r_0));
+        __m512 g_d = _mm512_sub_ps(g_loc, _mm512_cvtepi32_ps(g_0));
+        __m512 b_d = _mm512_sub_ps(b_loc, _mm512_cvtepi32_ps(b_0));
+        __m512 r_m = _mm512_sub_ps(one, r_d);
+        __m512 g_m = _mm512_sub_ps(one, g_d);
+        __m512 b_m = _mm512_sub_ps(one, b_d);
+
+        __m512 w00 = _mm512_mul_ps(r_m, g_m);
+        __m512 w10 = _mm512_mul_ps(r_d, g_m);
+        __m512 w01 = _mm512_mul_ps(r_m, g_d);
+        __m512 w11 = _mm512_mul_ps(r_d, g_d);
+        __m512 w000 = _mm512_mul_ps(w00, b_m);
+        __m512 w100 = _mm512_mul_ps(w10, b_m);
+        __m512 w010 = _mm512_mul_ps(w01, b_m);
+        __m512 w110 = _mm512_mul_ps(w11, b_m);
+        __m512 w001 = _mm512_mul_ps(w00, b_d);
+        __m512 w101 = _mm512_mul_ps(w10, b_d);
+        __m512 w011 = _mm512_mul_ps(w01, b_d);
+        __m512 w111 = _mm512_mul_ps(w11, b_d);
+
+        __m512i rr_0 = _mm512_mullo_epi32(r_0, dim2);
+        __m512i rr_1 = _mm512_mullo_epi32(r_1, dim2);
+        __m512i gg_0 = _mm512_mullo_epi32(g_0, dim1);
+        __m512i gg_1 = _mm512_mullo_epi32(g_1, dim1);
+        __m512i id000 = _mm512_add_epi32(_mm512_add_epi32(rr_0, gg_0), b_0);
+        __m512i id100 = _mm512_add_epi32(_mm512_add_epi32(rr_1, gg_0), b_0);
+        __m512i id010 = _mm512_add_epi32(_mm512_add_epi32(rr_0, gg_1), b_0);
+        __m512i id110 = _mm512_add_epi32(_mm512_add_epi32(rr_1, gg_1), b_0);
+        __m512i id001 = _mm512_add_epi32(_mm512_add_epi32(rr_0, gg_0), b_1);
+        __m512i id101 = _mm512_add_epi32(_mm512_add_epi32(rr_1, gg_0), b_1);
+        __m512i id011 = _mm512_add_epi32(_mm512_add_epi32(rr_0, gg_1), b_1);
+        __m512i id111 = _mm512_add_epi32(_mm512_add_epi32(rr_1, gg_1), b_1);
+
+        if (packed)
+        {
+            id000 = _mm512_slli_epi32(id000, 2);
+            id100 = _mm512_slli_epi32(id100, 2);
+            id010 = _mm512_slli_epi32(id010, 2);
+            id110 = _mm512_slli_epi32(id110, 2);
+            id001 = _mm512_slli_epi32(id001, 2);
+            id101 = _mm512_slli_epi32(id101, 2);
+            id011 = _mm512_slli_epi32(id011, 2);
+            id111 = _mm512_slli_epi32(id111, 2);
+        }
+
+        for (int c = 0; c < 3; ++c)
+        {
+            const float *table = packed ? lut + c : lut + shift * c;
+            __m512 v = _mm512_mul_ps(w000, _mm512_i32gather_ps(id000, table, 4));
+            v = _mm512_add_ps(v, _mm512_mul_ps(w100, _mm512_i32gather_ps(id100, table, 4)));
+            v = _mm512_add_ps(v, _mm512_mul_ps(w010, _mm512_i32gather_ps(id010, table, 4)));
+            v = _mm512_add_ps(v, _mm512_mul_ps(w110, _mm512_i32gather_ps(id110, table, 4)));
+            v = _mm512_add_ps(v, _mm512_mul_ps(w001, _mm512_i32gather_ps(id001, table, 4)));
+            v = _mm512_add_ps(v, _mm512_mul_ps(w101, _mm512_i32gather_ps(id101, table, 4)));
+            v = _mm512_add_ps(v, _mm512_mul_ps(w011, _mm512_i32gather_ps(id011, table, 4)));
+            v = _mm512_add_ps(v, _mm512_mul_ps(w111, _mm512_i32gather_ps(id111, table, 4)));
+            _mm512_storeu_ps(output + plane * c + w, v);
+        }
+    }
+    return w;
+}
+
+
+LUT_TARGET_AVX2 static int TriLinearCellsAvx2(const float *image, const int64_t plane, const int width, const int dim,
+                                              int *id, float *weight, const int stride)
+{
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 scale = _mm256_set1_ps((float)(dim - 1));
+    const __m256i low = _mm256_setzero_si256();
+    const __m256i high = _mm256_set1_epi32(dim - 1);
+    const __m256i step = _mm256_set1_epi32(1);
+    const __m256i dim1 = _mm256_set1_epi32(dim);
+    const __m256i dim2 = _mm256_set1_epi32(dim * dim);
+
+    int w = 0;
+    for (; w + 8 <= width; w += 8)
+    {
+        __m256 r_loc = _mm256_mul_ps(_mm256_loadu_ps(image + w), scale);
+        __m256 g_loc = _mm256_mul_ps(_mm256_loadu_ps(image + plane + w), scale);
+        __m256 b_loc = _mm256_mul_ps(_mm256_loadu_ps(image + plane * 2 + w), scale);
+
+        __m256i r_0 = _mm256_cvttps_epi32(_mm256_floor_ps(r_loc));
+        __m256i g_0 = _mm256_cvttps_epi32(_mm256_floor_ps(g_loc));
+        __m256i b_0 = _mm256_cvttps_epi32(_mm256_floor_ps(b_loc));
+        __m256i r_1 = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(r_0, step), low), high);
+        __m256i g_1 = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(g_0, step), low), high);
+        __m256i b_1 = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(b_0, step), low), high);
+        r_0 = _mm256_min_epi32(_mm256_max_epi32(r_0, low), high);
+        g_0 = _mm256_min_epi32(_mm256_max_epi32(g_0, low), high);
+        b_0 = _mm256_min_epi32(_mm256_max_epi32(b_0, low), high);
+
+        __m256 r_d = _mm256_sub_ps(r_loc, _mm256_cvtepi32_ps(r_0));
+        __m256 g_d = _mm256_sub_ps(g_loc, _mm256_cvtepi32_ps(g_0));
+        __m256 b_d = _mm256_sub_ps(b_loc, _mm256_cvtepi32_ps(b_0));
+        __m256 r_m = _mm256_sub_ps(one, r_d);
+        __m256 g_m = _mm256_sub_ps(one, g_d);
+        __m256 b_m = _mm256_sub_ps(one, b_d);
+
+        __m256 w00 = _mm256_mul_ps(r_m, g_m);
+        __m256 w10 = _mm256_mul_ps(r_d, g_m);
+        __m256 w01 = _mm256_mul_ps(r_m, g_d);
+        __m256 w11 = _mm256_mul_ps(r_d, g_d);
+        _mm256_storeu_ps(weight + w, _mm256_mul_ps(w00, b_m));
+        _mm256_storeu_ps(weight + stride + w, _mm256_mul_ps(w10, b_m));
+        _mm256_storeu_ps(weight + stride * 2 + w, _mm256_mul_ps(w01, b_m));
+        _mm256_storeu_ps(weight + stride * 3 + w, _mm256_mul_ps(w11, b_m));
+        _mm256_storeu_ps(weight + stride * 4 + w, _mm256_mul_ps(w00, b_d));
+        _mm256_storeu_ps(weight + stride * 5 + w, _mm256_mul_ps(w10, b_d));
+        _mm256_storeu_ps(weight + stride * 6 + w, _mm256_mul_ps(w01, b_d));
+        _mm256_storeu_ps(weight + stride * 7 + w, _mm256_mul_ps(w11, b_d));
+
+        __m256i rr_0 = _mm256_mullo_epi32(r_0, dim2);
+        __m256i rr_1 = _mm256_mullo_epi32(r_1, dim2);
+        __m256i gg_0 = _mm256_mullo_epi32(g_0, dim1);
+        __m256i gg_1 = _mm256_mullo_epi32(g_1, dim1);
+        _mm256_storeu_si256((__m256i *)(id + w), _mm256_add_epi32(_mm256_add_epi32(rr_0, gg_0), b_0));
+        _mm256_storeu_si256((__m256i *)(id + stride + w), _mm256_add_epi32(_mm256_add_epi32(rr_1, gg_0), b_0));
+        _mm256_storeu_si256((__m256i *)(id + stride * 2 + w), _mm256_add_epi32(_mm256_add_epi32(rr_0, gg_1), b_0));
+        _mm256_storeu_si256((__m256i *)(id + stride * 3 + w), _mm256_add_epi32(_mm256_add_epi32(rr_1, gg_1), b_0));
+        _mm256_storeu_si256((__m256i *)(id + stride * 4 + w), _mm256_add_epi32(_mm256_add_epi32(rr_0, gg_0), b_1));
+        _mm256_storeu_si256((__m256i *)(id + stride * 5 + w), _mm256_add_epi32(_mm256_add_epi32(rr_1, gg_0), b_1));
+        _mm256_storeu_si256((__m256i *)(id + stride * 6 + w), _mm256_add_epi32(_mm256_add_epi32(rr_0, gg_1), b_1));
+        _mm256_storeu_si256((__m256i *)(id + stride * 7 + w), _mm256_add_epi32(_mm256_add_epi32(rr_1, gg_1), b_1));
+    }
+    return w;
+}
+
+#endif
+
+// Picks the widest row kernel the CPU supports, or nullptr for the scalar path.
+// With packed set the kernel reads a node-interleaved LUT (lut_layout.h).
+inline TriLinearRowKernel TriLinearSelectRowKernel(const bool packed)
+{
+#if LUT_HAVE_X86_SIMD
+    switch (lut_detect_isa())
+    {
+    case LUT_ISA_AVX512:
+        return packed ? TriLinearForwardRowAvx512<true> : TriLinearForwardRowAvx512<false>;
+    case LUT_ISA_AVX2:
+        return packed ? TriLinearForwardRowAvx2<true> : TriLinearForwardRowAvx2<false>;
+    default:
+        break;
+    }
+#endif
+    return nullptr;
+}
+
+// AVX2 cell kernel when the CPU supports it (the cells are stored, so wider
+// vectors gain little), or nullptr for the scalar path.
+inline TriLinearCellKernel TriLinearSelectCellKernel()
+{
+#if LUT_HAVE_X86_SIMD
+    if (lut_detect_isa() >= LUT_ISA_AVX2)
+        return TriLinearCellsAvx2;
+#endif
+    return nullptr;
+}
+
+#endif